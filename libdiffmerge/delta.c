@@ -0,0 +1,385 @@
+/*
+** Copyright (c) 2006 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This module implements the fossil delta format: a compact encoding of
+** a target file as a sequence of copies from a source file and literal
+** inserts.
+**
+** A delta is text.  It starts with the size of the target followed by a
+** newline.  Then follows any number of commands:
+**
+**     NNN@OOO,     copy NNN bytes from offset OOO of the source
+**     NNN:DATA     insert the NNN bytes of DATA
+**     CCC;         end of the delta, CCC is a checksum of the target
+**
+** Integers are written in base 64 using the digits of zDigits[] below.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+
+/*
+** Size of the blocks of the source that are indexed.  Must be a power
+** of two.
+*/
+#define NHASH 16
+
+/*
+** Maximum number of candidate source blocks checked per position of the
+** target.
+*/
+#define NCANDIDATE 250
+
+/*
+** Rolling hash over a window of NHASH bytes.
+*/
+typedef struct hash hash;
+struct hash {
+  u16 a, b;         /* Hash values */
+  u16 i;            /* Start of the window within z[] */
+  u8 z[NHASH];      /* The values that have been hashed */
+};
+
+static void hash_init(hash *pHash, const u8 *z){
+  u16 a, b, i;
+  a = b = z[0];
+  for(i=1; i<NHASH; i++){
+    a += z[i];
+    b += a;
+  }
+  memcpy(pHash->z, z, NHASH);
+  pHash->a = a;
+  pHash->b = b;
+  pHash->i = 0;
+}
+
+static void hash_next(hash *pHash, u8 c){
+  u16 old = pHash->z[pHash->i];
+  pHash->z[pHash->i] = c;
+  pHash->i = (pHash->i+1)&(NHASH-1);
+  pHash->a = pHash->a - old + c;
+  pHash->b = pHash->b - NHASH*old + pHash->a;
+}
+
+static u32 hash_32bit(hash *pHash){
+  return (pHash->a & 0xffff) | (((u32)(pHash->b & 0xffff))<<16);
+}
+
+static const char zDigits[] =
+  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz~";
+
+/*
+** Write an integer in base 64 to *pz and advance *pz.
+*/
+static void putInt(u32 v, char **pz){
+  int i, j;
+  char zBuf[20];
+  if( v==0 ){
+    *(*pz)++ = '0';
+    return;
+  }
+  for(i=0; v>0; i++, v>>=6){
+    zBuf[i] = zDigits[v&0x3f];
+  }
+  for(j=i-1; j>=0; j--){
+    *(*pz)++ = zBuf[j];
+  }
+}
+
+/*
+** Number of digits needed to write v with putInt().
+*/
+static int digit_count(u32 v){
+  int i;
+  for(i=1; v>=0x40; i++, v>>=6){}
+  return i;
+}
+
+/*
+** Read a base 64 integer from *pz, advancing *pz and decrementing *pLen.
+** Returns -1 if no digits are found.
+*/
+static int getInt(const char **pz, int *pLen, u32 *pV){
+  static const signed char zValue[] = {
+    -1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,    8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, 16,   17, 18, 19, 20, 21, 22, 23, 24,
+    25, 26, 27, 28, 29, 30, 31, 32,   33, 34, 35, -1, -1, -1, -1, 36,
+    -1, 37, 38, 39, 40, 41, 42, 43,   44, 45, 46, 47, 48, 49, 50, 51,
+    52, 53, 54, 55, 56, 57, 58, 59,   60, 61, 62, -1, -1, -1, 63, -1,
+  };
+  u32 v = 0;
+  int n = 0;
+  const u8 *z = (const u8*)*pz;
+  while( *pLen>0 && *z<0x80 && zValue[*z]>=0 ){
+    v = (v<<6) + zValue[*z];
+    z++;
+    (*pLen)--;
+    n++;
+  }
+  if( n==0 ) return -1;
+  *pz = (const char*)z;
+  *pV = v;
+  return 0;
+}
+
+/*
+** Checksum of the target, stored at the end of a delta.
+*/
+static u32 checksum(const char *zIn, size_t N){
+  const u8 *z = (const u8*)zIn;
+  u32 sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+  while( N>=16 ){
+    sum0 += ((u32)z[0] + z[4] + z[8] + z[12]);
+    sum1 += ((u32)z[1] + z[5] + z[9] + z[13]);
+    sum2 += ((u32)z[2] + z[6] + z[10]+ z[14]);
+    sum3 += ((u32)z[3] + z[7] + z[11]+ z[15]);
+    z += 16;
+    N -= 16;
+  }
+  while( N>=4 ){
+    sum0 += z[0];
+    sum1 += z[1];
+    sum2 += z[2];
+    sum3 += z[3];
+    z += 4;
+    N -= 4;
+  }
+  sum3 += (sum2 << 8) + (sum1 << 16) + (sum0 << 24);
+  switch( N ){
+    case 3:   sum3 += (z[2] << 8);
+    case 2:   sum3 += (z[1] << 16);
+    case 1:   sum3 += (z[0] << 24);
+    default:  ;
+  }
+  return sum3;
+}
+
+/*
+** Emit a literal insert of n bytes.
+*/
+static void putLiteral(const char *zData, u32 n, char **pz){
+  putInt(n, pz);
+  *(*pz)++ = ':';
+  memcpy(*pz, zData, n);
+  *pz += n;
+}
+
+/*
+** Create a delta that converts zSrc into zOut.  zDelta must have room for
+** at least lenOut+DELTA_OVERHEAD bytes.  Returns the size of the delta.
+**
+** The source is split into blocks of NHASH bytes that are indexed by their
+** rolling hash.  The target is scanned with the same rolling hash and each
+** hit is extended forwards and backwards, the longest match that is cheaper
+** to encode as a copy than as a literal wins.
+*/
+int delta_create(
+  const char *zSrc,      /* The source or pattern file */
+  unsigned int lenSrc,   /* Length of the source file */
+  const char *zOut,      /* The target file */
+  unsigned int lenOut,   /* Length of the target file */
+  char *zDelta           /* Write the delta into this buffer */
+){
+  const u8 *zS = (const u8*)zSrc;
+  const u8 *zT = (const u8*)zOut;
+  char *zStart = zDelta;
+  int *collide;          /* Next block with the same hash */
+  int *landmark;         /* First block for each hash value */
+  unsigned int nHash;    /* Number of hash table entries */
+  unsigned int base;     /* Start of the unencoded part of the target */
+  unsigned int i;
+  hash h;
+
+  putInt(lenOut, &zDelta);
+  *(zDelta++) = '\n';
+
+  if( lenSrc<=NHASH || lenOut<=NHASH ){
+    if( lenOut>0 ) putLiteral(zOut, lenOut, &zDelta);
+    putInt(checksum(zOut, lenOut), &zDelta);
+    *(zDelta++) = ';';
+    return zDelta - zStart;
+  }
+
+  nHash = lenSrc/NHASH;
+  collide = malloc(nHash*2*sizeof(int));
+  if( collide==0 ) return -1;
+  landmark = &collide[nHash];
+  memset(landmark, -1, nHash*sizeof(int));
+  memset(collide, -1, nHash*sizeof(int));
+  for(i=0; i<lenSrc-NHASH; i+=NHASH){
+    int hv;
+    hash_init(&h, &zS[i]);
+    hv = hash_32bit(&h) % nHash;
+    collide[i/NHASH] = landmark[hv];
+    landmark[hv] = i/NHASH;
+  }
+
+  base = 0;
+  while( base+NHASH<lenOut ){
+    int bestOfst = 0;    /* Offset in the source of the best match */
+    int bestCnt = 0;     /* Length of the best match */
+    int bestLitsz = 0;   /* Literal bytes before the best match */
+    hash_init(&h, &zT[base]);
+    i = 0;
+    for(;;){
+      int hv = hash_32bit(&h) % nHash;
+      int iBlock = landmark[hv];
+      int limit = NCANDIDATE;
+      while( iBlock>=0 && (limit--)>0 ){
+        unsigned int iSrc = iBlock*NHASH;
+        unsigned int j, k;
+        int cnt, ofst, litsz, sz;
+
+        /* Forward match starting at the block */
+        for(j=0; iSrc+j<lenSrc && base+i+j<lenOut; j++){
+          if( zS[iSrc+j]!=zT[base+i+j] ) break;
+        }
+
+        /* Backward match into the unencoded part of the target */
+        for(k=1; k<=iSrc && k<=i; k++){
+          if( zS[iSrc-k]!=zT[base+i-k] ) break;
+        }
+        k--;
+
+        ofst = iSrc-k;
+        cnt = j+k;
+        litsz = i-k;
+        sz = digit_count(litsz) + digit_count(cnt) + digit_count(ofst) + 3;
+        if( cnt>=sz && cnt>bestCnt ){
+          bestCnt = cnt;
+          bestOfst = ofst;
+          bestLitsz = litsz;
+        }
+        iBlock = collide[iBlock];
+      }
+
+      if( bestCnt>0 ){
+        if( bestLitsz>0 ){
+          putLiteral((const char*)&zT[base], bestLitsz, &zDelta);
+          base += bestLitsz;
+        }
+        putInt(bestCnt, &zDelta);
+        *(zDelta++) = '@';
+        putInt(bestOfst, &zDelta);
+        *(zDelta++) = ',';
+        base += bestCnt;
+        break;
+      }
+
+      if( base+i+NHASH>=lenOut ){
+        /* No match before the end of the target */
+        putLiteral((const char*)&zT[base], lenOut-base, &zDelta);
+        base = lenOut;
+        break;
+      }
+
+      hash_next(&h, zT[base+i+NHASH]);
+      i++;
+    }
+  }
+
+  if( base<lenOut ){
+    putLiteral((const char*)&zT[base], lenOut-base, &zDelta);
+  }
+  putInt(checksum(zOut, lenOut), &zDelta);
+  *(zDelta++) = ';';
+  free(collide);
+  return zDelta - zStart;
+}
+
+/*
+** Return the size of the target encoded by a delta or -1 if the delta is
+** malformed.
+*/
+int delta_output_size(const char *zDelta, int lenDelta){
+  u32 size;
+  if( getInt(&zDelta, &lenDelta, &size) || lenDelta<1 || *zDelta!='\n' ){
+    return -1;
+  }
+  return size;
+}
+
+/*
+** Apply a delta to zSrc, writing the target into zOut which must be at
+** least delta_output_size() bytes long.  Returns the size of the target or
+** -1 if the delta is malformed or does not match the source.
+*/
+int delta_apply(
+  const char *zSrc,      /* The source or pattern file */
+  int lenSrc,            /* Length of the source file */
+  const char *zDelta,    /* Delta to apply */
+  int lenDelta,          /* Length of the delta */
+  char *zOut             /* Write the target here */
+){
+  u32 limit;
+  u32 total = 0;
+  char *zOrigOut = zOut;
+
+  if( getInt(&zDelta, &lenDelta, &limit) || lenDelta<1 || *zDelta!='\n' ){
+    return -1;
+  }
+  zDelta++; lenDelta--;
+
+  while( lenDelta>0 ){
+    u32 cnt, ofst;
+    if( getInt(&zDelta, &lenDelta, &cnt) || lenDelta<1 ) return -1;
+    switch( zDelta[0] ){
+      case '@': {
+        zDelta++; lenDelta--;
+        if( getInt(&zDelta, &lenDelta, &ofst) || lenDelta<1 ) return -1;
+        if( zDelta[0]!=',' ) return -1;
+        zDelta++; lenDelta--;
+        if( cnt>limit-total ) return -1;
+        if( ofst>(u32)lenSrc || cnt>(u32)lenSrc-ofst ) return -1;
+        memcpy(zOut, &zSrc[ofst], cnt);
+        zOut += cnt;
+        total += cnt;
+        break;
+      }
+      case ':': {
+        zDelta++; lenDelta--;
+        if( cnt>limit-total ) return -1;
+        if( cnt>(u32)lenDelta ) return -1;
+        memcpy(zOut, zDelta, cnt);
+        zOut += cnt;
+        total += cnt;
+        zDelta += cnt;
+        lenDelta -= cnt;
+        break;
+      }
+      case ';': {
+        if( cnt!=checksum(zOrigOut, total) ) return -1;
+        if( total!=limit ) return -1;
+        return total;
+      }
+      default: {
+        return -1;
+      }
+    }
+  }
+  /* Unterminated delta */
+  return -1;
+}
@@ -0,0 +1,8 @@
+
+#undef INTERFACE
+int delta_output_size(const char *zDelta,int lenDelta);
+int delta_apply(const char *zSrc,int lenSrc,const char *zDelta,int lenDelta,char *zOut);
+int delta_create(const char *zSrc,unsigned int lenSrc,const char *zOut,unsigned int lenOut,char *zDelta);
+#define DELTA_OVERHEAD 60
+
+#undef INTERFACE
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compares the chunkers on throughput and deduplication.
+ *
+ * Each file given on the command line is chunked separately and the chunks
+ * of all files are deduplicated together, so several versions of the same
+ * file measure how well the boundaries resynchronize after edits.  Without
+ * arguments a random buffer and a series of edited copies of it are used.
+ */
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/time.h>
+
+#include <openssl/sha.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <utility>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include "rkchunker.h"
+#include "gearchunker.h"
+#include "fchunker.h"
+
+using namespace std;
+
+#define SYNTH_LEN       (64 * 1024 * 1024)
+#define SYNTH_VERSIONS  8
+#define SYNTH_EDITS     64
+
+class BenchCB : public ChunkerCB
+{
+public:
+    BenchCB(const string &data)
+        : data(data), done(false)
+    {
+    }
+    virtual void match(const uint8_t *b, uint32_t l)
+    {
+        chunks.push_back(make_pair(b - (const uint8_t *)data.data(), l));
+    }
+    virtual int load(uint8_t **b, uint64_t *l, uint64_t *o)
+    {
+        if (done)
+            return 0;
+
+        *b = (uint8_t *)data.data();
+        *l = data.size();
+        *o = 0;
+        done = true;
+        return 1;
+    }
+    const string &data;
+    bool done;
+    vector<pair<uint64_t, uint32_t> > chunks;
+};
+
+static double
+now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template<class Chunker>
+void
+bench(const char *name, const vector<string> &inputs)
+{
+    Chunker c;
+    set<string> seen;
+    uint64_t total = 0;
+    uint64_t unique = 0;
+    uint64_t chunks = 0;
+    double elapsed = 0.0;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        BenchCB cb(inputs[i]);
+        double start = now();
+
+        c.chunk(&cb);
+        elapsed += now() - start;
+
+        // Hashing is kept out of the timing
+        for (size_t j = 0; j < cb.chunks.size(); j++) {
+            unsigned char hash[SHA256_DIGEST_LENGTH];
+            uint32_t l = cb.chunks[j].second;
+
+            SHA256((const unsigned char *)inputs[i].data() + cb.chunks[j].first,
+                   l, hash);
+            if (seen.insert(string((char *)hash, sizeof(hash))).second)
+                unique += l;
+        }
+        total += inputs[i].size();
+        chunks += cb.chunks.size();
+    }
+
+    printf("%-6s %9.2f MB/s  chunks %10" PRIu64 "  avg %6" PRIu64
+           "  unique %9.2f MB  dedup %6.3f\n",
+           name, total / elapsed / (1024.0 * 1024.0), chunks,
+           chunks ? total / chunks : 0, unique / (1024.0 * 1024.0),
+           unique ? (double)total / unique : 0.0);
+}
+
+/*
+ * Random data followed by versions that each differ from the previous one
+ * by a few small inserts, deletes and overwrites.
+ */
+static void
+synthesize(vector<string> &inputs)
+{
+    string data(SYNTH_LEN, '\0');
+
+    srand(42);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = rand() % 256;
+    inputs.push_back(data);
+
+    for (int v = 1; v < SYNTH_VERSIONS; v++) {
+        for (int e = 0; e < SYNTH_EDITS; e++) {
+            size_t off = rand() % (data.size() - 64);
+            size_t len = 1 + rand() % 32;
+
+            switch (rand() % 3) {
+                case 0:
+                    data.insert(off, string(len, (char)(rand() % 256)));
+                    break;
+                case 1:
+                    data.erase(off, len);
+                    break;
+                case 2:
+                    data.replace(off, len, string(len, (char)(rand() % 256)));
+                    break;
+            }
+        }
+        inputs.push_back(data);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    vector<string> inputs;
+
+    if (argc < 2) {
+        synthesize(inputs);
+    } else {
+        for (int i = 1; i < argc; i++) {
+            ifstream f(argv[i], ios::in | ios::binary);
+            stringstream ss;
+
+            if (!f.is_open()) {
+                fprintf(stderr, "Cannot open %s\n", argv[i]);
+                return 1;
+            }
+            ss << f.rdbuf();
+            inputs.push_back(ss.str());
+        }
+    }
+
+    bench<RKChunker<4096, 2048, 8192> >("rk", inputs);
+    bench<GearChunker<4096, 2048, 8192> >("gear", inputs);
+    bench<FChunker<4096> >("fixed", inputs);
+
+    return 0;
+}
+
@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/orifile.h>
+#include <oriutil/stream.h>
+#include <oriutil/systemexception.h>
+#include <ori/index.h>
+#include <ori/packfile.h>
+#include <ori/compactor.h>
+
+using namespace std;
+
+#define COMPACTOR_JOURNAL       "compact.journal"
+#define COMPACTOR_MAGIC         "ORJ2"
+
+static bool
+_packOffsetCmp(const IndexEntry &a, const IndexEntry &b)
+{
+    if (a.packfile != b.packfile)
+        return a.packfile < b.packfile;
+    return a.offset < b.offset;
+}
+
+PackfileCompactor::PackfileCompactor(PackfileManager *packfiles, Index *idx)
+    : packfiles(packfiles), idx(idx),
+      journalPath(packfiles->getRootPath() + COMPACTOR_JOURNAL)
+{
+}
+
+PackfileCompactor::~PackfileCompactor()
+{
+}
+
+/*
+ * The index is updated with a single log block, so either every moved object
+ * points at the destinations or none does.  In the former case the remaining
+ * sources are garbage, otherwise the destinations are.
+ */
+void
+PackfileCompactor::recover()
+{
+    vector<packid_t> dests;
+    vector<packid_t> srcs;
+
+    if (!OriFile_Exists(journalPath))
+        return;
+
+    if (!_readJournal(dests, srcs)) {
+        // The journal is written before any packfile is touched
+        WARNING("Ignoring a corrupt compaction journal");
+        _removeJournal();
+        return;
+    }
+
+    set<packid_t> destSet(dests.begin(), dests.end());
+    bool relocated = false;
+    idx->forEach([&](const IndexEntry &e) {
+        if (destSet.count(e.packfile))
+            relocated = true;
+    });
+
+    if (relocated) {
+        LOG("Completing the compaction into %lu packfiles", dests.size());
+        for (size_t i = 0; i < srcs.size(); i++) {
+            if (packfiles->hasPackfile(srcs[i]))
+                packfiles->removePackfile(srcs[i]);
+        }
+    } else {
+        LOG("Rolling back the compaction into %lu packfiles", dests.size());
+        for (size_t i = 0; i < dests.size(); i++) {
+            if (packfiles->hasPackfile(dests[i]))
+                packfiles->removePackfile(dests[i]);
+        }
+    }
+
+    _removeJournal();
+}
+
+size_t
+PackfileCompactor::run(const set<packid_t> &purgedPacks)
+{
+    unordered_map<packid_t, uint64_t> live;
+    unordered_map<packid_t, uint64_t> liveObjs;
+    unordered_map<packid_t, uint64_t> liveMeta;
+    vector<packid_t> ids = packfiles->getPackfileList();
+    vector<PackStats> candidates;
+    size_t removed = 0;
+
+    idx->forEach([&](const IndexEntry &e) {
+        live[e.packfile] += e.packed_size + ENTRYSIZE;
+        liveObjs[e.packfile]++;
+        if (e.info.type == ObjectInfo::Commit ||
+            e.info.type == ObjectInfo::Tree)
+            liveMeta[e.packfile] += e.packed_size + ENTRYSIZE;
+    });
+
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        PackStats ps;
+
+        ps.id = ids[i];
+        ps.fileSize = packfiles->getPackfile(ids[i])->getFileSize();
+        ps.liveBytes = live.count(ids[i]) ? live[ids[i]] : 0;
+        ps.liveObjects = liveObjs.count(ids[i]) ? liveObjs[ids[i]] : 0;
+        ps.metadata = liveMeta.count(ids[i]) &&
+                      liveMeta[ids[i]] * 2 >= ps.liveBytes;
+
+        if (ps.liveBytes == 0) {
+            // Nothing to copy
+            packfiles->removePackfile(ps.id);
+            removed++;
+            continue;
+        }
+
+        // Rewriting a packfile that other repositories link frees nothing
+        if (packfiles->isShared(ps.id))
+            continue;
+
+        // Purged objects must not stay on disk where rebuildIndex finds them
+        double dead = 1.0 - (double)ps.liveBytes / ps.fileSize;
+        if (dead >= GC_COMPACT_THRESHOLD || purgedPacks.count(ps.id))
+            candidates.push_back(ps);
+    }
+
+    // Group candidates so that each destination is about one packfile and
+    // metadata packfiles are not merged with data packfiles
+    stable_sort(candidates.begin(), candidates.end(),
+                [](const PackStats &a, const PackStats &b) {
+                    return a.metadata && !b.metadata;
+                });
+    vector<packid_t> group;
+    uint64_t groupBytes = 0;
+    uint64_t groupObjs = 0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const PackStats &ps = candidates[i];
+
+        if (!group.empty() &&
+            (groupBytes + ps.liveBytes > PACKFILE_MAXSIZE ||
+             groupObjs + ps.liveObjects > PACKFILE_MAXOBJS ||
+             ps.metadata != candidates[i - 1].metadata)) {
+            _compactGroup(group);
+            removed += group.size();
+            group.clear();
+            groupBytes = 0;
+            groupObjs = 0;
+        }
+
+        group.push_back(ps.id);
+        groupBytes += ps.liveBytes;
+        groupObjs += ps.liveObjects;
+    }
+    // A lone packfile is still worth rewriting to reclaim its space
+    if (!group.empty()) {
+        _compactGroup(group);
+        removed += group.size();
+    }
+
+    return removed;
+}
+
+void
+PackfileCompactor::_compactGroup(const vector<packid_t> &group)
+{
+    set<packid_t> srcSet(group.begin(), group.end());
+    unordered_map<packid_t, uint64_t> srcBytes;
+    vector<IndexEntry> entries;
+    vector<IndexEntry> moved;
+
+    idx->forEach([&](const IndexEntry &e) {
+        if (srcSet.count(e.packfile)) {
+            entries.push_back(e);
+            srcBytes[e.packfile] += e.packed_size;
+        }
+    });
+    sort(entries.begin(), entries.end(), _packOffsetCmp);
+
+    Packfile::sp dest = packfiles->newPackfile();
+    _writeJournal(vector<packid_t>(1, dest->getPackfileID()), group);
+
+    DLOG("Compacting %lu packfiles into packfile %u",
+         group.size(), dest->getPackfileID());
+
+    moved.reserve(entries.size());
+    dest->appendFrom(entries, moved);
+
+    // The copies must be durable before the index points at them and the
+    // index must be durable before the originals go away
+    dest->seal();
+    dest->sync();
+    packfiles->inheritAccess(dest->getPackfileID(), srcBytes);
+    idx->relocateEntries(moved);
+    idx->sync(true);
+
+    for (size_t i = 0; i < group.size(); i++) {
+        packfiles->removePackfile(group[i]);
+    }
+
+    _removeJournal();
+}
+
+/*
+ * Write the objects of each stream in the given order into new packfiles and
+ * remove the source packfiles.  The streams must hold every live object of
+ * the sources exactly once.
+ */
+size_t
+PackfileCompactor::repack(const vector<vector<IndexEntry> > &streams,
+                          const vector<packid_t> &srcs)
+{
+    set<packid_t> srcSet(srcs.begin(), srcs.end());
+    vector<packid_t> dests;
+    vector<IndexEntry> moved;
+    size_t live = 0;
+    size_t total = 0;
+
+    idx->forEach([&](const IndexEntry &e) {
+        if (srcSet.count(e.packfile))
+            live++;
+    });
+    for (size_t s = 0; s < streams.size(); s++)
+        total += streams[s].size();
+    ASSERT(total == live);
+
+    moved.reserve(total);
+    _writeJournal(dests, srcs);
+    for (size_t s = 0; s < streams.size(); s++) {
+        const vector<IndexEntry> &objs = streams[s];
+        size_t first = 0;
+
+        while (first < objs.size()) {
+            unordered_map<packid_t, uint64_t> srcBytes;
+            size_t last = first;
+            uint64_t bytes = 0;
+
+            while (last < objs.size() && last - first < PACKFILE_MAXOBJS &&
+                   bytes < PACKFILE_MAXSIZE) {
+                bytes += objs[last].packed_size + ENTRYSIZE;
+                srcBytes[objs[last].packfile] += objs[last].packed_size;
+                last++;
+            }
+
+            Packfile::sp dest = packfiles->newPackfile();
+            dests.push_back(dest->getPackfileID());
+            _writeJournal(dests, srcs);
+
+            dest->appendFrom(vector<IndexEntry>(objs.begin() + first,
+                                                objs.begin() + last), moved);
+            dest->seal();
+            dest->sync();
+            // Traversal order mixes objects from several sources
+            packfiles->inheritAccess(dest->getPackfileID(), srcBytes);
+            packfiles->setOrdered(dest->getPackfileID());
+            first = last;
+        }
+    }
+
+    DLOG("Repacked %lu objects into %lu packfiles", moved.size(),
+         dests.size());
+
+    // Same ordering constraints as compaction
+    idx->relocateEntries(moved);
+    idx->sync(true);
+
+    for (size_t i = 0; i < srcs.size(); i++) {
+        packfiles->removePackfile(srcs[i]);
+    }
+
+    _removeJournal();
+
+    return moved.size();
+}
+
+/*
+ * Rewrite sealed packfiles that have not been read since coldBefore with the
+ * given compression algorithm.  Objects that do not shrink keep their stored
+ * form.  A packfile that is not smaller afterwards is kept and only marked so
+ * that it is not tried again.
+ */
+size_t
+PackfileCompactor::recompress(time_t coldBefore, ObjectInfo::ZipAlgo algo)
+{
+    vector<packid_t> ids = packfiles->getPackfileList();
+    unordered_map<packid_t, vector<IndexEntry> > live;
+    size_t recompressed = 0;
+
+    idx->forEach([&](const IndexEntry &e) {
+        live[e.packfile].push_back(e);
+    });
+
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        packid_t id = ids[i];
+        PackAccess a = packfiles->getAccess(id);
+
+        if (a.recompressed || a.lastRead >= coldBefore ||
+            packfiles->isShared(id))
+            continue;
+
+        auto it = live.find(id);
+        if (it == live.end())
+            continue;
+
+        Packfile::sp src = packfiles->getPackfile(id);
+        if (!src->isSealed())
+            continue;
+
+        vector<IndexEntry> &entries = it->second;
+        vector<IndexEntry> moved;
+        sort(entries.begin(), entries.end(), _packOffsetCmp);
+
+        Packfile::sp dest = packfiles->newPackfile();
+        packid_t destId = dest->getPackfileID();
+        _writeJournal(vector<packid_t>(1, destId), vector<packid_t>(1, id));
+
+        moved.reserve(entries.size());
+        dest->recompressFrom(entries, algo, moved);
+        dest->seal();
+        dest->sync();
+
+        if (dest->getFileSize() >= src->getFileSize()) {
+            DLOG("Packfile %u does not shrink, keeping it", id);
+            dest.reset();
+            packfiles->removePackfile(destId);
+            packfiles->setRecompressed(id);
+            _removeJournal();
+            continue;
+        }
+
+        DLOG("Recompressed packfile %u into packfile %u (%lu -> %lu bytes)",
+             id, destId, (size_t)src->getFileSize(),
+             (size_t)dest->getFileSize());
+
+        unordered_map<packid_t, uint64_t> srcBytes;
+        srcBytes[id] = src->getFileSize();
+        packfiles->inheritAccess(destId, srcBytes);
+        packfiles->setRecompressed(destId);
+        idx->relocateEntries(moved);
+        idx->sync(true);
+
+        src.reset();
+        packfiles->removePackfile(id);
+        _removeJournal();
+        recompressed++;
+    }
+
+    return recompressed;
+}
+
+void
+PackfileCompactor::_writeJournal(const vector<packid_t> &dests,
+                                 const vector<packid_t> &srcs)
+{
+    strwstream ss;
+    string tmpPath = journalPath + ".tmp";
+
+    ss.write(COMPACTOR_MAGIC, 4);
+    ss.writeUInt32(dests.size());
+    for (size_t i = 0; i < dests.size(); i++) {
+        ss.writeUInt32(dests[i]);
+    }
+    ss.writeUInt32(srcs.size());
+    for (size_t i = 0; i < srcs.size(); i++) {
+        ss.writeUInt32(srcs[i]);
+    }
+
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw SystemException();
+
+    const string &buf = ss.str();
+    size_t off = 0;
+    while (off < buf.size()) {
+        ssize_t status = ::write(fd, buf.data() + off, buf.size() - off);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            int errcode = errno;
+            ::close(fd);
+            throw SystemException(errcode);
+        }
+        off += status;
+    }
+
+    if (fsync(fd) < 0) {
+        int errcode = errno;
+        ::close(fd);
+        throw SystemException(errcode);
+    }
+    ::close(fd);
+
+    int status = OriFile_Rename(tmpPath, journalPath);
+    if (status < 0)
+        throw SystemException(-status);
+}
+
+bool
+PackfileCompactor::_readJournal(vector<packid_t> &dests,
+                                vector<packid_t> &srcs)
+{
+    string buf = OriFile_ReadFile(journalPath);
+    size_t len = 4;
+    uint32_t num;
+
+    if (buf.size() < 12)
+        return false;
+
+    if (memcmp(buf.data(), COMPACTOR_MAGIC, 4) != 0)
+        return false;
+
+    strstream ss(buf, 4);
+    num = ss.readUInt32();
+    len += 4 + (size_t)num * 4;
+    if (buf.size() < len + 4)
+        return false;
+    dests.resize(num);
+    for (size_t i = 0; i < num; i++) {
+        dests[i] = ss.readUInt32();
+    }
+
+    num = ss.readUInt32();
+    len += 4 + (size_t)num * 4;
+    if (buf.size() != len)
+        return false;
+
+    srcs.resize(num);
+    for (size_t i = 0; i < num; i++) {
+        srcs[i] = ss.readUInt32();
+    }
+
+    return !ss.error();
+}
+
+void
+PackfileCompactor::_removeJournal()
+{
+    int status = OriFile_Delete(journalPath);
+    if (status < 0 && status != -ENOENT)
+        throw SystemException(-status);
+}
+
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#include <string>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/stream.h>
+#include <ori/compression.h>
+
+#include "tuneables.h"
+
+using namespace std;
+
+CompressionPolicy::CompressionPolicy()
+    : mode(getDefaultMode())
+{
+}
+
+CompressionPolicy::~CompressionPolicy()
+{
+}
+
+void
+CompressionPolicy::setMode(Mode m)
+{
+    mode = m;
+}
+
+CompressionPolicy::Mode
+CompressionPolicy::getMode() const
+{
+    return mode;
+}
+
+bool
+CompressionPolicy::parseMode(const string &str, Mode &m)
+{
+    if (str == "none") {
+        m = COMPRESSION_NONE;
+    } else if (str == "fastlz") {
+        m = COMPRESSION_FASTLZ;
+    } else if (str == "snappy") {
+        m = COMPRESSION_SNAPPY;
+    } else if (str == "lzma") {
+        if (!zipstream::isSupported(ObjectInfo::ZIPALGO_LZMA)) {
+            WARNING("LZMA support was not compiled in");
+            return false;
+        }
+        m = COMPRESSION_LZMA;
+    } else if (str == "adaptive") {
+        m = COMPRESSION_ADAPTIVE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+string
+CompressionPolicy::modeName(Mode m)
+{
+    switch (m) {
+        case COMPRESSION_NONE:
+            return "none";
+        case COMPRESSION_FASTLZ:
+            return "fastlz";
+        case COMPRESSION_SNAPPY:
+            return "snappy";
+        case COMPRESSION_LZMA:
+            return "lzma";
+        case COMPRESSION_ADAPTIVE:
+            return "adaptive";
+    }
+    return "unknown";
+}
+
+CompressionPolicy::Mode
+CompressionPolicy::getDefaultMode()
+{
+    Mode m;
+
+    if (!parseMode(ORI_DEFAULT_COMPRESSION, m)) {
+        WARNING("Unknown default compression '%s'", ORI_DEFAULT_COMPRESSION);
+        return COMPRESSION_FASTLZ;
+    }
+    return m;
+}
+
+ObjectInfo::ZipAlgo
+CompressionPolicy::select(ObjectInfo::Type type, size_t size,
+                          bool isChunk) const
+{
+    switch (mode) {
+        case COMPRESSION_NONE:
+            return ObjectInfo::ZIPALGO_NONE;
+        case COMPRESSION_FASTLZ:
+            return ObjectInfo::ZIPALGO_FASTLZ_FRAMED;
+        case COMPRESSION_SNAPPY:
+            return ObjectInfo::ZIPALGO_SNAPPY;
+        case COMPRESSION_LZMA:
+            return ObjectInfo::ZIPALGO_LZMA;
+        case COMPRESSION_ADAPTIVE:
+            break;
+    }
+
+    // Metadata is read on every lookup so favor decompression speed
+    if (type != ObjectInfo::Blob)
+        return ObjectInfo::ZIPALGO_SNAPPY;
+    // Large file chunks are rarely read back after they are written
+    if (isChunk) {
+        if (zipstream::isSupported(ObjectInfo::ZIPALGO_LZMA))
+            return ObjectInfo::ZIPALGO_LZMA;
+        return ObjectInfo::ZIPALGO_FASTLZ_FRAMED;
+    }
+    if (size <= COMPRESSION_SMALLBLOB_SIZE)
+        return ObjectInfo::ZIPALGO_SNAPPY;
+    return ObjectInfo::ZIPALGO_FASTLZ_FRAMED;
+}
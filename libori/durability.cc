@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <unistd.h>
+
+#include <string>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include <oriutil/debug.h>
+#include <oriutil/thread.h>
+#include <ori/durability.h>
+
+#include "tuneables.h"
+
+using namespace std;
+
+/*
+ * Background thread used in group mode.
+ */
+class DurabilityFlusher : public Thread
+{
+public:
+    DurabilityFlusher(DurabilityPolicy *policy)
+        : Thread("DurabilityFlusher"), policy(policy)
+    {
+    }
+    void run() {
+        while (!interruptionRequested()) {
+            usleep(DURABILITY_GROUP_INTERVAL * 1000);
+            policy->flush();
+        }
+    }
+private:
+    DurabilityPolicy *policy;
+};
+
+DurabilityPolicy::DurabilityPolicy()
+    : lock(), mode(DURABILITY_TRANSACTION), dirtyData(), dirtyMeta(),
+      flushing(), flushedCV(), flusher(NULL)
+{
+}
+
+DurabilityPolicy::~DurabilityPolicy()
+{
+    setMode(DURABILITY_TRANSACTION);
+}
+
+void
+DurabilityPolicy::setMode(Mode m)
+{
+    DurabilityFlusher *oldFlusher = NULL;
+
+    {
+        unique_lock<mutex> l(lock);
+        if (mode == DURABILITY_GROUP && m != DURABILITY_GROUP) {
+            oldFlusher = flusher;
+            flusher = NULL;
+        }
+        if (mode != DURABILITY_GROUP && m == DURABILITY_GROUP) {
+            flusher = new DurabilityFlusher(this);
+            flusher->start();
+        }
+        mode = m;
+    }
+
+    if (oldFlusher != NULL) {
+        oldFlusher->interrupt();
+        oldFlusher->wait();
+        delete oldFlusher;
+    }
+
+    // Leave nothing behind when switching away from group commit
+    flush();
+}
+
+DurabilityPolicy::Mode
+DurabilityPolicy::getMode() const
+{
+    return mode;
+}
+
+bool
+DurabilityPolicy::parseMode(const string &str, Mode &m)
+{
+    if (str == "none") {
+        m = DURABILITY_NONE;
+    } else if (str == "transaction") {
+        m = DURABILITY_TRANSACTION;
+    } else if (str == "group") {
+        m = DURABILITY_GROUP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+string
+DurabilityPolicy::modeName(Mode m)
+{
+    switch (m) {
+        case DURABILITY_NONE:
+            return "none";
+        case DURABILITY_TRANSACTION:
+            return "transaction";
+        case DURABILITY_GROUP:
+            return "group";
+    }
+    return "unknown";
+}
+
+DurabilityPolicy::sp
+DurabilityPolicy::getDefault()
+{
+    static DurabilityPolicy::sp defaultPolicy(new DurabilityPolicy());
+
+    return defaultPolicy;
+}
+
+void
+DurabilityPolicy::written(int fd, FileClass c)
+{
+    if (mode == DURABILITY_NONE)
+        return;
+
+    unique_lock<mutex> l(lock);
+    if (c == DURABILITY_DATA)
+        dirtyData.insert(fd);
+    else
+        dirtyMeta.insert(fd);
+}
+
+void
+DurabilityPolicy::commit(int fd, FileClass c)
+{
+    switch (mode) {
+        case DURABILITY_NONE:
+            break;
+        case DURABILITY_TRANSACTION:
+            _clean(fd);
+            syncFd(fd);
+            break;
+        case DURABILITY_GROUP:
+            written(fd, c);
+            break;
+    }
+}
+
+void
+DurabilityPolicy::release(int fd)
+{
+    if (_clean(fd) && mode != DURABILITY_NONE)
+        syncFd(fd);
+}
+
+/*
+ * Forget the outstanding writes of fd, returns true if it had any.  Waits
+ * for a flush syncing fd so that fd is not closed under it.
+ */
+bool
+DurabilityPolicy::_clean(int fd)
+{
+    unique_lock<mutex> l(lock);
+
+    while (flushing.count(fd) != 0)
+        flushedCV.wait(l);
+    return dirtyData.erase(fd) + dirtyMeta.erase(fd) > 0;
+}
+
+void
+DurabilityPolicy::flush()
+{
+    set<int> data, meta;
+
+    {
+        unique_lock<mutex> l(lock);
+        // Another flush is syncing, wait so that we return after it
+        while (!flushing.empty())
+            flushedCV.wait(l);
+        data.swap(dirtyData);
+        meta.swap(dirtyMeta);
+        flushing.insert(data.begin(), data.end());
+        flushing.insert(meta.begin(), meta.end());
+    }
+
+    for (set<int>::iterator it = data.begin(); it != data.end(); it++) {
+        syncFd(*it);
+    }
+    for (set<int>::iterator it = meta.begin(); it != meta.end(); it++) {
+        syncFd(*it);
+    }
+
+    unique_lock<mutex> l(lock);
+    flushing.clear();
+    flushedCV.notify_all();
+}
+
+void
+DurabilityPolicy::syncFd(int fd)
+{
+#if defined(__APPLE__)
+    ::fsync(fd);
+#else
+    ::fdatasync(fd);
+#endif
+}
+
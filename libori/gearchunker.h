@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Implements a gear hash chunker with normalized chunking (FastCDC).
+ *
+ * The gear hash shifts the hash left by one bit and adds a random 64-bit
+ * value for each input byte, so the top bits of the hash depend on the last
+ * 64 bytes only and no bytes leave the window explicitly.  A cut point is
+ * found by testing the top bits against a mask.  Up to the target size a
+ * mask with two more bits than log2(target) is used and after it a mask
+ * with two fewer bits, which narrows the chunk size distribution around the
+ * target.  Hashing starts GEAR_WINDOW bytes before the minimum chunk size
+ * so that every cut point only depends on the content preceding it.
+ */
+
+#ifndef __GEARCHUNKER_H__
+#define __GEARCHUNKER_H__
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "chunker.h"
+
+#define GEAR_WINDOW     64
+#define GEAR_NORMALIZE  2
+
+template<int target, int min, int max>
+class GearChunker
+{
+public:
+    GearChunker();
+    ~GearChunker();
+    void chunk(ChunkerCB *cb);
+private:
+    uint64_t cut(const uint8_t *in, uint64_t start, uint64_t end);
+    uint64_t maskS;
+    uint64_t maskL;
+    uint64_t gear[256];
+};
+
+template<int target, int min, int max>
+GearChunker<target, min, max>::GearChunker()
+{
+    static_assert((target & (target - 1)) == 0,
+                  "Target chunk size must be a power of two");
+    static_assert(min >= GEAR_WINDOW && min < target && target < max,
+                  "Chunk sizes must satisfy window <= min < target < max");
+
+    int bits = 0;
+    uint64_t seed = 0;
+
+    while ((1 << bits) < target)
+        bits++;
+
+    maskS = ~0ULL << (64 - (bits + GEAR_NORMALIZE));
+    maskL = ~0ULL << (64 - (bits - GEAR_NORMALIZE));
+
+    /*
+     * The table is generated with splitmix64 from a fixed seed, chunk
+     * boundaries must not change between builds or platforms.
+     */
+    for (int i = 0; i < 256; i++) {
+        uint64_t z;
+
+        seed += 0x9E3779B97F4A7C15ULL;
+        z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+template<int target, int min, int max>
+GearChunker<target, min, max>::~GearChunker()
+{
+}
+
+/*
+ * Returns the end of the chunk starting at start, end is the end of the
+ * available data.
+ */
+template<int target, int min, int max>
+uint64_t GearChunker<target, min, max>::cut(const uint8_t *in,
+                                            uint64_t start,
+                                            uint64_t end)
+{
+    uint64_t hash = 0;
+    uint64_t limit = end - start;
+    uint64_t normal = target;
+    uint64_t i;
+
+    if (limit <= min)
+        return end;
+    if (limit > max)
+        limit = max;
+    if (normal > limit)
+        normal = limit;
+
+    in += start;
+    for (i = min - GEAR_WINDOW; i < min; i++)
+        hash = (hash << 1) + gear[in[i]];
+
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[in[i]];
+        if ((hash & maskS) == 0)
+            return start + i + 1;
+    }
+
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear[in[i]];
+        if ((hash & maskL) == 0)
+            return start + i + 1;
+    }
+
+    return start + limit;
+}
+
+template<int target, int min, int max>
+void GearChunker<target, min, max>::chunk(ChunkerCB *cb)
+{
+    uint8_t *in = NULL;
+    uint64_t len = 0;
+    uint64_t off = 0;
+    uint64_t start = 0;
+
+    if (cb->load(&in, &len, &off) == 0) {
+        assert(false);
+        return;
+    }
+    start = off;
+
+fastPath:
+    /*
+     * Every chunk ends within the buffer, no state is carried between
+     * chunks so the buffer may be refilled at any chunk boundary.
+     */
+    while (off + max < len) {
+        off = cut(in, off, len);
+        cb->match(in + start, off - start);
+        start = off;
+    }
+
+    if (cb->load(&in, &len, &off) == 1) {
+        start = off;
+        goto fastPath;
+    }
+
+    while (off < len) {
+        off = cut(in, off, len);
+        cb->match(in + start, off - start);
+        start = off;
+    }
+
+    return;
+}
+
+#endif /* __GEARCHUNKER_H__ */
+
@@ -127,17 +127,12 @@ HttpRepo::getObject(const ObjectHash &id)
         num = bs->readUInt32();
         ASSERT(num == 0);
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        if (info.getAlgo() == ObjectInfo::ZIPALGO_NONE) {
+            payloads[info.hash] = payload;
+        } else {
+            payloads[info.hash] = zipstream(new strstream(payload),
+                                            DECOMPRESS, info.payload_size,
+                                            info.getAlgo()).readAll();
         }
         return Object::sp(new HttpObject(this, info));
     }
@@ -71,8 +71,17 @@ HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg)
     return;
 }
 
+void
+HTTPServerScrubCB(evutil_socket_t fd, short what, void *arg)
+{
+    HTTPServer *httpd = (HTTPServer *)arg;
+
+    httpd->scrub();
+}
+
 HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port)
-    : repo(repository), port(port), httpd(NULL), base(NULL)
+    : repo(repository), port(port), httpd(NULL), base(NULL),
+      scrubber(NULL), scrubEvent(NULL)
 {
     base = event_base_new();
     event_set_log_callback(HTTPServerLogCB);
@@ -85,6 +94,8 @@ HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port)
 
 HTTPServer::~HTTPServer()
 {
+    if (scrubEvent)
+        event_free(scrubEvent);
     evhttp_free(httpd);
     event_base_free(base);
 }
@@ -98,9 +109,35 @@ HTTPServer::start(bool mDNSEnable)
         MDNS_Register(port);
 #endif
 
+    if (scrubber) {
+        scrubEvent = evtimer_new(base, HTTPServerScrubCB, this);
+        scrub();
+    }
+
     event_base_dispatch(base);
 }
 
+/*
+ * Requests are served on the same event loop, so a scrubber slice never
+ * runs concurrently with a request.
+ */
+void
+HTTPServer::setScrubber(Scrubber *scrubber)
+{
+    this->scrubber = scrubber;
+}
+
+void
+HTTPServer::scrub()
+{
+    uint32_t wait = scrubber->step();
+    struct timeval tv;
+
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+    evtimer_add(scrubEvent, &tv);
+}
+
 void
 HTTPServer::stop()
 {
@@ -19,14 +19,19 @@
 
 #include <fcntl.h>
 #include <sys/param.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <string>
 #include <set>
+#include <vector>
 #include <iostream>
-#include <unordered_map>
+#include <queue>
+#include <algorithm>
+
+#include "tuneables.h"
 
 #include <oriutil/debug.h>
 #include <oriutil/runtimeexception.h>
@@ -38,12 +43,29 @@
 
 using namespace std;
 
-/// Adds a checksum
+/// Legacy log entries carry a truncated SHA-256 checksum each
 #define TOTAL_ENTRYSIZE (IndexEntry::SIZE + 16)
+/// The object hash is stored after the type in the serialized ObjectInfo
+#define INDEX_KEYOFFSET ORI_OBJECT_TYPESIZE
+/// Sorted index table
+#define INDEX_TABLE_EXT ".tbl"
+/// Sorted table of inline payloads, [hash][length][payload padded]
+#define INDEX_INLINE_EXT ".inl"
+#define INDEX_INLINE_RECSIZE (ObjectHash::SIZE + 1 + INDEX_INLINE_MAX)
+/// Log header, distinguishes the block format from the legacy log
+#define INDEX_LOG_MAGIC "ORIL"
+#define INDEX_LOG_VERSION 3
+/// Version 2 logs are the same without cached payloads
+#define INDEX_LOG_MINVERSION 2
+#define INDEX_LOG_HDRSIZE 8
+/// Each block is [count][entries][CRC32C of count and entries], an
+/// INDEX_INLINE record is followed by its payload
+#define INDEX_BLOCK_OVERHEAD 8
 
 Index::Index()
 {
     fd = -1;
+    durability = DurabilityPolicy::getDefault();
 }
 
 Index::~Index()
@@ -54,67 +76,67 @@ Index::~Index()
 void
 Index::open(const string &indexFile)
 {
-    int i, entries;
     struct stat sb;
+    bool legacy = false;
 
     fileName = indexFile;
 
-    // Read index
+    // Map the sorted tables, throws on corruption
+    table.open(indexFile + INDEX_TABLE_EXT);
+    try {
+        inlineTable.open(indexFile + INDEX_INLINE_EXT);
+    } catch (exception &e) {
+        table.close();
+        throw;
+    }
+
+    // Read the log of recent updates
     fd = ::open(indexFile.c_str(), O_RDWR | O_CREAT,
               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd < 0) {
         WARNING("Could not open the index file!");
+        table.close();
+        inlineTable.close();
         throw SystemException();
     }
 
+    try {
+        if (::fstat(fd, &sb) < 0) {
+            WARNING("Could not fstat the index file!");
+            throw SystemException();
+        }
 
-    if (::fstat(fd, &sb) < 0) {
-        int errcode = errno;
-        ::close(fd);
-        fd = -1;
-        WARNING("Could not fstat the index file!");
-        throw SystemException(errcode);
-    }
+        std::string log(sb.st_size, '\0');
+        if (sb.st_size != 0) {
+            ssize_t status = pread(fd, &log[0], sb.st_size, 0);
+            if (status != sb.st_size) {
+                WARNING("Could not read the index file!");
+                throw SystemException();
+            }
+        }
 
-    if (sb.st_size % TOTAL_ENTRYSIZE != 0) {
-        // XXX: Attempt truncating last entries
-        WARNING("Index seems dirty please rebuild it!");
+        if (log.size() == 0) {
+            _writeHeader();
+        } else if (log.compare(0, 4, INDEX_LOG_MAGIC) == 0) {
+            size_t valid = _replayLog(log);
+            if (valid != log.size()) {
+                WARNING("Truncating torn index log block");
+                if (ftruncate(fd, valid) < 0)
+                    throw SystemException();
+                durability->written(fd);
+            }
+        } else {
+            _replayLegacyLog(log);
+            legacy = true;
+        }
+    } catch (exception &e) {
         ::close(fd);
         fd = -1;
-        throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
-    }
-
-    entries = sb.st_size / TOTAL_ENTRYSIZE;
-    for (i = 0; i < entries; i++) {
-        std::string entry_str(TOTAL_ENTRYSIZE, '\0');
-
-        int status UNUSED = read(fd, &entry_str[0], TOTAL_ENTRYSIZE);
-        ASSERT(status == TOTAL_ENTRYSIZE);
-
-        IndexEntry entry;
-
-        string info_str = entry_str.substr(0, ObjectInfo::SIZE);
-        entry.info.fromString(info_str);
-
-        strstream ss(entry_str, ObjectInfo::SIZE);
-        entry.offset = ss.readUInt32();
-        entry.packed_size = ss.readUInt32();
-        entry.packfile = ss.readUInt32();
-
-
-        std::vector<uint8_t> storedChecksum(16);
-        ss.read(&storedChecksum[0], 16);
-        ObjectHash computedChecksum =
-            OriCrypt_HashString(entry_str.substr(0, IndexEntry::SIZE));
-        if (memcmp(&storedChecksum[0], computedChecksum.hash, 16) != 0) {
-            // XXX: Attempt truncating last entries
-            WARNING("Index has corrupt entries please rebuild it!");
-            ::close(fd);
-            fd = -1;
-            throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
-        }
-
-        index[entry.info.hash] = entry;
+        table.close();
+        inlineTable.close();
+        delta.clear();
+        inlined.clear();
+        throw;
     }
     ::close(fd);
 
@@ -122,98 +144,440 @@ Index::open(const string &indexFile)
     fd = ::open(indexFile.c_str(), O_WRONLY | O_APPEND);
     ASSERT(fd >= 0); // Assume that the repository lock protects the index
 
+    // Fold the old per-entry log into the table, this resets the log
+    if (legacy) {
+        LOG("Converting index log to the block format");
+        rewrite();
+        if (!delta.empty()) {
+            close();
+            throw RuntimeException(ORIEC_INDEXDIRTY,
+                                   "Could not convert the index log");
+        }
+    }
+
     // Delete temporary index if present
     if (OriFile_Exists(indexFile + ".tmp")) {
         OriFile_Delete(indexFile + ".tmp");
     }
+    if (OriFile_Exists(indexFile + INDEX_TABLE_EXT ".tmp")) {
+        OriFile_Delete(indexFile + INDEX_TABLE_EXT ".tmp");
+    }
+    if (OriFile_Exists(indexFile + INDEX_INLINE_EXT ".tmp")) {
+        OriFile_Delete(indexFile + INDEX_INLINE_EXT ".tmp");
+    }
 }
 
 void
 Index::close()
 {
     if (fd != -1) {
-        ::fsync(fd);
+        try {
+            _flushPending();
+        } catch (SystemException &e) {
+            WARNING("Could not write cached payloads: %s", e.what());
+        }
+        durability->release(fd);
         ::close(fd);
         fd = -1;
     }
+    table.close();
+    inlineTable.close();
+    delta.clear();
+    inlined.clear();
+    pending.clear();
 }
 
 void
-Index::sync()
+Index::sync(bool force)
 {
-    ::fsync(fd);
+    _flushPending();
+    if (force)
+        DurabilityPolicy::syncFd(fd);
+    else
+        durability->commit(fd);
 }
 
+void
+Index::setDurability(DurabilityPolicy::sp policy)
+{
+    durability = policy;
+}
+
+/*
+ * Merge the update log into a new sorted table and truncate the log.  If we
+ * crash before the log is truncated its entries are replayed on top of the
+ * new table, which is harmless.
+ */
 void
 Index::rewrite()
 {
-    int fdNew;
-    string newIndex = fileName + ".tmp";
-
-    fdNew = ::open(newIndex.c_str(), O_RDWR | O_CREAT,
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fdNew < 0) {
-        perror("open");
-        WARNING("Could not open a temporary index file!");
+    vector<IndexEntry> updates;
+
+    updates.reserve(delta.size());
+    delta.forEach([&](const IndexEntry &e) {
+        updates.push_back(e);
+    });
+    sort(updates.begin(), updates.end(),
+         [](const IndexEntry &a, const IndexEntry &b) {
+            return a.info.hash < b.info.hash;
+         });
+
+    try {
+        // The cached payloads in the log must reach a table first
+        _rewriteInline();
+
+        SortedTableWriter writer(fileName + INDEX_TABLE_EXT,
+                                 IndexEntry::SIZE, INDEX_KEYOFFSET);
+        uint64_t i = 0;
+        size_t j = 0;
+
+        // Write new table
+        while (i < table.size() || j < updates.size()) {
+            if (j == updates.size()) {
+                writer.append(table.record(i++));
+                continue;
+            }
+            if (i < table.size() && table.key(i) < updates[j].info.hash) {
+                writer.append(table.record(i++));
+                continue;
+            }
+
+            if (i < table.size() && table.key(i) == updates[j].info.hash)
+                i++; // Log entry supersedes the table
+            if (updates[j].packfile != INDEX_TOMBSTONE)
+                writer.append(_encodeEntry(updates[j]));
+            j++;
+        }
+
+        writer.commit();
+        table.open(fileName + INDEX_TABLE_EXT);
+    } catch (exception &e) {
+        WARNING("Could not rewrite the index: %s", e.what());
+        return;
+    }
+
+    // Truncate the log
+    try {
+        _writeHeader();
+    } catch (SystemException &e) {
+        WARNING("Could not truncate the index log: %s", e.what());
         return;
+    }
+    ::fsync(fd);
+    delta.clear();
+    inlined.clear();
+    pending.clear();
+}
+
+/*
+ * Merge runs of entries, each sorted by hash, straight into the sorted table
+ * without going through the log.  Where runs hold the same object the entry
+ * of the last run wins.  Entries in the log still supersede the table.
+ */
+void
+Index::loadTable(const vector<vector<IndexEntry> > &runs)
+{
+    typedef pair<size_t, size_t> Cursor;
+    auto later = [&runs](const Cursor &a, const Cursor &b) {
+        const IndexEntry &ea = runs[a.first][a.second];
+        const IndexEntry &eb = runs[b.first][b.second];
+        if (ea.info.hash != eb.info.hash)
+            return eb.info.hash < ea.info.hash;
+        // Among copies prefer the one with the shortest delta chain
+        if (ea.info.getDeltaDepth() != eb.info.getDeltaDepth())
+            return ea.info.getDeltaDepth() > eb.info.getDeltaDepth();
+        return a.first < b.first;
     };
+    priority_queue<Cursor, vector<Cursor>, decltype(later)> heap(later);
+    ObjectHash last;
+    uint64_t written = 0;
 
-    int tmpFd = fd;
-    fd = fdNew;
-    ::close(tmpFd);
+    ASSERT(table.size() == 0);
 
-    // Write new index
-    for (unordered_map<ObjectHash, IndexEntry>::iterator it = index.begin();
-            it != index.end();
-            it++)
-    {
-        _writeEntry((*it).second);
+    for (size_t r = 0; r < runs.size(); r++) {
+        if (!runs[r].empty())
+            heap.push(Cursor(r, 0));
     }
 
-    OriFile_Rename(newIndex, fileName);
+    SortedTableWriter writer(fileName + INDEX_TABLE_EXT,
+                             IndexEntry::SIZE, INDEX_KEYOFFSET);
+    while (!heap.empty()) {
+        Cursor c = heap.top();
+        const IndexEntry &e = runs[c.first][c.second];
+
+        heap.pop();
+        if (c.second + 1 < runs[c.first].size())
+            heap.push(Cursor(c.first, c.second + 1));
+
+        // The heap yields the preferred copy first among equal hashes
+        if (written > 0 && e.info.hash == last)
+            continue;
+        ASSERT(e.packfile != INDEX_INLINE && e.packfile != INDEX_TOMBSTONE);
+        writer.append(_encodeEntry(e));
+        last = e.info.hash;
+        written++;
+    }
+
+    writer.commit();
+    table.open(fileName + INDEX_TABLE_EXT);
 }
 
+/*
+ * Merge the cached payloads of the log into a new inline table.  Payloads of
+ * objects that are no longer in the index are dropped.
+ */
 void
-Index::dump()
+Index::_rewriteInline()
 {
-    unordered_map<ObjectHash, IndexEntry>::iterator it;
+    vector<ObjectHash> updates;
+    uint64_t i = 0;
+    size_t j = 0;
+    string rec;
 
-    cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
-    for (it = index.begin(); it != index.end(); it++)
-    {
-        cout << (*it).first.hex() << " packfile: " <<
-            (*it).second.packfile << "," <<
-            (*it).second.offset << "," <<
-            (*it).second.packed_size << endl;
+    if (inlined.empty() && inlineTable.size() == 0)
+        return;
+
+    updates.reserve(inlined.size());
+    for (unordered_map<ObjectHash, string>::const_iterator it =
+            inlined.begin();
+         it != inlined.end();
+         it++) {
+        updates.push_back((*it).first);
+    }
+    sort(updates.begin(), updates.end());
+
+    auto encode = [&](const ObjectHash &hash, const string &payload) {
+        ASSERT(payload.size() <= INDEX_INLINE_MAX);
+        rec.assign(INDEX_INLINE_RECSIZE, '\0');
+        memcpy(&rec[0], hash.hash, ObjectHash::SIZE);
+        rec[ObjectHash::SIZE] = (char)payload.size();
+        memcpy(&rec[ObjectHash::SIZE + 1], payload.data(), payload.size());
+    };
+
+    SortedTableWriter writer(fileName + INDEX_INLINE_EXT,
+                             INDEX_INLINE_RECSIZE, 0);
+    while (i < inlineTable.size() || j < updates.size()) {
+        if (j == updates.size() ||
+            (i < inlineTable.size() && inlineTable.key(i) < updates[j])) {
+            ObjectHash hash = inlineTable.key(i++);
+            string payload;
+            if (getInline(hash, payload)) {
+                encode(hash, payload);
+                writer.append(rec);
+            }
+            continue;
+        }
+
+        if (i < inlineTable.size() && inlineTable.key(i) == updates[j])
+            i++; // Log record supersedes the table
+        if (hasObject(updates[j])) {
+            encode(updates[j], inlined[updates[j]]);
+            writer.append(rec);
+        }
+        j++;
     }
+
+    writer.commit();
+    inlineTable.open(fileName + INDEX_INLINE_EXT);
+}
+
+void
+Index::dump()
+{
+    cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
+    forEach([](const IndexEntry &e) {
+        cout << e.info.hash.hex() << " packfile: " <<
+            e.packfile << "," <<
+            e.offset << "," <<
+            e.packed_size << endl;
+    });
     cout << "***** END REPOSITORY INDEX *****" << endl;
 }
 
 void
 Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
 {
-    ASSERT(!objId.isEmpty());
+    ASSERT(objId == entry.info.hash);
+
+    updateEntries(vector<IndexEntry>(1, entry));
+}
+
+/*
+ * Append a batch of entries to the log as a single block and write.
+ */
+void
+Index::updateEntries(const vector<IndexEntry> &entries)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        ASSERT(!entries[i].info.hash.isEmpty());
+        if (hasObject(entries[i].info.hash)) {
+            fprintf(stderr, "WARNING: duplicate updateEntry\n");
+        }
+    }
 
-    _writeEntry(entry);
+    _appendBlock(entries);
+}
 
-    if (index.find(objId) != index.end()) {
-        fprintf(stderr, "WARNING: duplicate updateEntry\n");
+void
+Index::relocateEntries(const vector<IndexEntry> &entries)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        ASSERT(hasObject(entries[i].info.hash));
+        ASSERT(entries[i].packfile != INDEX_TOMBSTONE);
+    }
+
+    _appendBlock(entries);
+}
+
+void
+Index::removeEntries(const vector<ObjectHash> &objs)
+{
+    vector<IndexEntry> tombstones;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (!hasObject(objs[i]))
+            continue;
+
+        IndexEntry e;
+        e.info = ObjectInfo(objs[i]);
+        e.info.type = ObjectInfo::Purged;
+        e.offset = 0;
+        e.packed_size = 0;
+        e.packfile = INDEX_TOMBSTONE;
+        tombstones.push_back(e);
     }
 
-    // Add to in-memory index
-    index[objId] = entry;
+    _appendBlock(tombstones);
+}
+
+void
+Index::addInline(const ObjectInfo &info, const string &payload)
+{
+    ASSERT(!info.hash.isEmpty());
+    ASSERT(payload.size() <= INDEX_INLINE_MAX);
+    if (inlined.count(info.hash) != 0)
+        return;
+
+    IndexEntry e;
+    e.info = info;
+    e.info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    e.info.setDeltaDepth(0);
+    e.info.payload_size = payload.size();
+    e.offset = 0;
+    e.packed_size = payload.size();
+    e.packfile = INDEX_INLINE;
+
+    pending.push_back(e);
+    inlined[info.hash] = payload;
 }
 
-const IndexEntry &
+bool
+Index::getInline(const ObjectHash &objId, string &payload) const
+{
+    // Records outlive removed objects until the next rewrite
+    if (!hasObject(objId))
+        return false;
+
+    unordered_map<ObjectHash, string>::const_iterator it;
+    it = inlined.find(objId);
+    if (it != inlined.end()) {
+        payload = (*it).second;
+        return true;
+    }
+
+    const uint8_t *rec = inlineTable.lookup(objId);
+    if (rec == NULL)
+        return false;
+
+    size_t len = rec[ObjectHash::SIZE];
+    if (ObjectHash::SIZE + 1 + len > inlineTable.recordSize()) {
+        WARNING("Inline object %s is corrupt!", objId.hex().c_str());
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Inline object corrupt");
+    }
+    payload.assign((const char *)rec + ObjectHash::SIZE + 1, len);
+
+    return true;
+}
+
+bool
+Index::hasInline(const ObjectHash &objId) const
+{
+    if (!hasObject(objId))
+        return false;
+
+    return inlined.find(objId) != inlined.end() ||
+           inlineTable.lookup(objId) != NULL;
+}
+
+/*
+ * Append a batch of entries to the log as a single block and write.  The
+ * pending cache records are written at the start of the block.
+ */
+void
+Index::_appendBlock(const vector<IndexEntry> &entries)
+{
+    strwstream ss;
+
+    if (pending.size() + entries.size() == 0)
+        return;
+
+    ss.writeUInt32(pending.size() + entries.size());
+    for (size_t i = 0; i < pending.size(); i++) {
+        string entry_str = _encodeEntry(pending[i]);
+        const string &payload = inlined[pending[i].info.hash];
+        ss.write(entry_str.data(), entry_str.size());
+        ss.write(payload.data(), payload.size());
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        ASSERT(entries[i].packfile != INDEX_INLINE);
+        string entry_str = _encodeEntry(entries[i]);
+        ss.write(entry_str.data(), entry_str.size());
+    }
+
+    uint32_t crc = OriCrypt_CRC32C((const uint8_t *)ss.str().data(),
+                                   ss.str().size());
+    ss.writeUInt32(crc);
+    _writeLog(ss.str());
+    pending.clear();
+
+    // Add to in-memory log
+    for (size_t i = 0; i < entries.size(); i++) {
+        _insert(entries[i]);
+    }
+}
+
+void
+Index::_flushPending()
+{
+    if (!pending.empty())
+        _appendBlock(vector<IndexEntry>());
+}
+
+void
+Index::_insert(const IndexEntry &entry)
+{
+    delta.insert(entry);
+    if (entry.packfile == INDEX_TOMBSTONE && !inlined.empty())
+        inlined.erase(entry.info.hash);
+}
+
+IndexEntry
 Index::getEntry(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
-    ASSERT(it != index.end());
+    IndexEntry entry;
+
+    if (delta.find(objId, &entry)) {
+        ASSERT(entry.packfile != INDEX_TOMBSTONE);
+        return entry;
+    }
 
-    return (*it).second;
+    const uint8_t *rec = table.lookup(objId);
+    ASSERT(rec != NULL);
+
+    return _decodeEntry(rec);
 }
 
-const ObjectInfo &
+ObjectInfo
 Index::getInfo(const ObjectHash &objId) const
 {
     return getEntry(objId).info;
@@ -222,30 +586,203 @@ Index::getInfo(const ObjectHash &objId) const
 bool
 Index::hasObject(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+    IndexEntry entry;
 
-    it = index.find(objId);
+    if (delta.find(objId, &entry))
+        return entry.packfile != INDEX_TOMBSTONE;
 
-    return it != index.end();
+    return table.lookup(objId) != NULL;
 }
 
 set<ObjectInfo>
 Index::getList()
 {
     set<ObjectInfo> lst;
-    unordered_map<ObjectHash, IndexEntry>::iterator it;
 
-    for (it = index.begin(); it != index.end(); it++)
+    forEach([&](const IndexEntry &e) {
+        lst.insert(e.info);
+    });
+
+    return lst;
+}
+
+void
+Index::forEach(const function<void(const IndexEntry &)> &fn) const
+{
+    for (uint64_t i = 0; i < table.size(); i++)
     {
-        lst.insert((*it).second.info);
+        if (!delta.empty() && delta.contains(table.key(i)))
+            continue;
+
+        fn(_decodeEntry(table.record(i)));
     }
 
-    return lst;
+    delta.forEach([&](const IndexEntry &e) {
+        if (e.packfile != INDEX_TOMBSTONE)
+            fn(e);
+    });
+}
+
+
+void
+Index::_writeLog(const string &buf)
+{
+    size_t off = 0;
+
+    while (off < buf.size()) {
+        ssize_t status = write(fd, buf.data() + off, buf.size() - off);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        off += status;
+    }
+    durability->written(fd);
+}
+
+/*
+ * Truncate the log and write a fresh header.
+ */
+void
+Index::_writeHeader()
+{
+    strwstream ss;
+
+    if (ftruncate(fd, 0) < 0)
+        throw SystemException();
+
+    ss.write(INDEX_LOG_MAGIC, 4);
+    ss.writeUInt32(INDEX_LOG_VERSION);
+    ASSERT(ss.str().size() == INDEX_LOG_HDRSIZE);
+    _writeLog(ss.str());
 }
 
+/*
+ * Load the blocks of the log into memory.  Returns the length of the valid
+ * prefix of the log, a block that fails to verify at the end of the log was
+ * torn by a crash and is dropped, as is a zero filled tail.
+ */
+size_t
+Index::_replayLog(const string &log)
+{
+    size_t off = INDEX_LOG_HDRSIZE;
+
+    if (log.size() < INDEX_LOG_HDRSIZE)
+        return 0;
+    uint32_t version = strstream(log.substr(4, 4)).readUInt32();
+    if (version < INDEX_LOG_MINVERSION || version > INDEX_LOG_VERSION) {
+        WARNING("Index log has an unsupported version!");
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Unsupported index log version");
+    }
+
+    // Blocks appended from now on may hold cache records
+    if (version != INDEX_LOG_VERSION) {
+        strwstream ss;
+        ss.writeUInt32(INDEX_LOG_VERSION);
+        if (pwrite(fd, ss.str().data(), 4, 4) != 4)
+            throw SystemException();
+        durability->written(fd);
+    }
+
+    const uint8_t *buf = (const uint8_t *)log.data();
+    vector<IndexEntry> entries;
+    vector<size_t> payloadOffs;
+    while (off < log.size()) {
+        uint32_t count = 0;
+        size_t pos = off + 4;
+        bool complete = false;
+
+        entries.clear();
+        payloadOffs.clear();
+        if (pos <= log.size()) {
+            count = strstream(log.substr(off, 4)).readUInt32();
+            // Space allocated by a crash before the block reached the disk
+            if (count == 0 &&
+                (pos + 4 > log.size() ||
+                 strstream(log.substr(pos, 4)).readUInt32() == 0))
+                return off;
+            while (entries.size() < count &&
+                   pos + IndexEntry::SIZE <= log.size()) {
+                IndexEntry entry = _decodeEntry(buf + pos);
+                pos += IndexEntry::SIZE;
+                payloadOffs.push_back(pos);
+                if (entry.packfile == INDEX_INLINE)
+                    pos += entry.packed_size;
+                entries.push_back(entry);
+            }
+            complete = entries.size() == count && pos + 4 <= log.size();
+        }
+
+        bool valid = count != 0 && complete;
+        if (valid) {
+            uint32_t crc = OriCrypt_CRC32C(buf + off, pos - off);
+            valid = strstream(log.substr(pos, 4)).readUInt32() == crc;
+        }
+
+        if (!valid) {
+            if (!complete || pos + 4 >= log.size())
+                return off; // Torn write at the end of the log
+
+            WARNING("Index has corrupt entries please rebuild it!");
+            throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].packfile == INDEX_INLINE) {
+                if (entries[i].packed_size > INDEX_INLINE_MAX) {
+                    WARNING("Index has corrupt entries please rebuild it!");
+                    throw RuntimeException(ORIEC_INDEXCORRUPT,
+                                           "Index corrupt");
+                }
+                inlined[entries[i].info.hash] =
+                    log.substr(payloadOffs[i], entries[i].packed_size);
+            } else {
+                _insert(entries[i]);
+            }
+        }
+
+        off = pos + 4;
+    }
+
+    return off;
+}
 
+/*
+ * Load a log written before the block format was introduced, each entry
+ * is followed by its own checksum.
+ */
 void
-Index::_writeEntry(const IndexEntry &e)
+Index::_replayLegacyLog(const string &log)
+{
+    size_t i, entries;
+
+    if (log.size() % TOTAL_ENTRYSIZE != 0) {
+        // XXX: Attempt truncating last entries
+        WARNING("Index seems dirty please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
+    }
+
+    entries = log.size() / TOTAL_ENTRYSIZE;
+    for (i = 0; i < entries; i++) {
+        const uint8_t *entry_buf = (const uint8_t *)log.data() +
+                                   i * TOTAL_ENTRYSIZE;
+        ObjectHash computedChecksum =
+            OriCrypt_HashBlob(entry_buf, IndexEntry::SIZE);
+        if (memcmp(entry_buf + IndexEntry::SIZE,
+                   computedChecksum.hash, 16) != 0) {
+            WARNING("Index has corrupt entries please rebuild it!");
+            throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+        }
+
+        IndexEntry entry = _decodeEntry(entry_buf);
+        delta.insert(entry);
+    }
+}
+
+string
+Index::_encodeEntry(const IndexEntry &e)
 {
     strwstream ss;
 
@@ -256,11 +793,24 @@ Index::_writeEntry(const IndexEntry &e)
     ss.writeUInt32(e.packed_size);
     ss.writeUInt32(e.packfile);
 
-    ObjectHash checksum = OriCrypt_HashString(ss.str());
-    ss.write(checksum.hash, 16);
+    ASSERT(ss.str().size() == IndexEntry::SIZE);
+
+    return ss.str();
+}
+
+IndexEntry
+Index::_decodeEntry(const uint8_t *buf)
+{
+    IndexEntry entry;
+    string entry_str((const char *)buf, IndexEntry::SIZE);
+
+    entry.info.fromString(entry_str.substr(0, ObjectInfo::SIZE));
+
+    strstream ss(entry_str, ObjectInfo::SIZE);
+    entry.offset = ss.readUInt32();
+    entry.packed_size = ss.readUInt32();
+    entry.packfile = ss.readUInt32();
 
-    const string &final = ss.str();
-    ASSERT(final.size() == TOTAL_ENTRYSIZE);
-    write(fd, final.data(), final.size());
+    return entry;
 }
 
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <string>
+#include <iostream>
+#include <functional>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <ori/indexmap.h>
+
+using namespace std;
+
+#define INDEXMAP_EMPTY          0x80
+/// Maximum load factor is 7/8
+#define INDEXMAP_LOAD_NUM       7
+#define INDEXMAP_LOAD_DEN       8
+/// The type is kept in the top byte of the flags, which ObjectInfo leaves
+/// unused
+#define INDEXMAP_TYPE_SHIFT     24
+
+/*
+ * Returns a bitmask of the control bytes in the group equal to b.
+ */
+static inline uint32_t
+groupMatch(const uint8_t *group, uint8_t b)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < IndexMap::GROUP_SIZE; i++) {
+        if (group[i] == b)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint64_t
+hashIndex(const ObjectHash &hash)
+{
+    uint64_t v;
+    memcpy(&v, hash.hash, sizeof(v));
+    return v;
+}
+
+static inline uint8_t
+hashTag(const ObjectHash &hash)
+{
+    return hash.hash[sizeof(uint64_t)] & 0x7F;
+}
+
+IndexMap::IndexMap()
+    : ctrl(NULL), slots(NULL), chunks(), groups(0), count(0)
+{
+}
+
+IndexMap::~IndexMap()
+{
+    clear();
+}
+
+void
+IndexMap::clear()
+{
+    delete[] ctrl;
+    delete[] slots;
+    for (size_t i = 0; i < chunks.size(); i++)
+        delete[] chunks[i];
+    ctrl = NULL;
+    slots = NULL;
+    chunks.clear();
+    groups = 0;
+    count = 0;
+}
+
+/*
+ * Probe the groups in triangular order, which visits every group once
+ * because the number of groups is a power of two.  Returns the slot or -1.
+ */
+ssize_t
+IndexMap::_findSlot(const ObjectHash &hash, uint8_t tag) const
+{
+    if (groups == 0)
+        return -1;
+
+    size_t mask = groups - 1;
+    size_t g = hashIndex(hash) & mask;
+
+    for (size_t step = 1; step <= groups; step++) {
+        const uint8_t *group = ctrl + g * GROUP_SIZE;
+        uint32_t match = groupMatch(group, tag);
+
+        while (match != 0) {
+            size_t i = g * GROUP_SIZE + __builtin_ctz(match);
+            if (memcmp(_entry(slots[i]).hash, hash.hash,
+                       ObjectHash::SIZE) == 0)
+                return i;
+            match &= match - 1;
+        }
+        // An empty slot ends the probe sequence
+        if (groupMatch(group, INDEXMAP_EMPTY) != 0)
+            return -1;
+
+        g = (g + step) & mask;
+    }
+
+    return -1;
+}
+
+void
+IndexMap::_insertSlot(const uint8_t *hashBytes, uint32_t entry)
+{
+    ObjectHash hash;
+    size_t mask = groups - 1;
+
+    memcpy(hash.hash, hashBytes, ObjectHash::SIZE);
+    size_t g = hashIndex(hash) & mask;
+
+    for (size_t step = 1; step <= groups; step++) {
+        uint8_t *group = ctrl + g * GROUP_SIZE;
+        uint32_t empty = groupMatch(group, INDEXMAP_EMPTY);
+
+        if (empty != 0) {
+            size_t i = g * GROUP_SIZE + __builtin_ctz(empty);
+            ctrl[i] = hashTag(hash);
+            slots[i] = entry;
+            return;
+        }
+
+        g = (g + step) & mask;
+    }
+
+    // Unreachable, the load factor keeps empty slots in the table
+    PANIC();
+}
+
+/*
+ * Double the table and reinsert the entries in storage order, the entries
+ * themselves stay in place.
+ */
+void
+IndexMap::_grow()
+{
+    groups = (groups == 0) ? 1 : groups * 2;
+    delete[] ctrl;
+    delete[] slots;
+    ctrl = new uint8_t[groups * GROUP_SIZE];
+    slots = new uint32_t[groups * GROUP_SIZE];
+    memset(ctrl, INDEXMAP_EMPTY, groups * GROUP_SIZE);
+
+    for (size_t i = 0; i < count; i++)
+        _insertSlot(_entry(i).hash, i);
+}
+
+void
+IndexMap::insert(const IndexEntry &entry)
+{
+    const ObjectHash &hash = entry.info.hash;
+    ssize_t i = _findSlot(hash, hashTag(hash));
+
+    if (i >= 0) {
+        _pack(entry, _entry(slots[i]));
+        return;
+    }
+
+    ASSERT(count < UINT32_MAX);
+    if (count % CHUNK_SIZE == 0)
+        chunks.push_back(new Entry[CHUNK_SIZE]);
+    _pack(entry, _entry(count));
+    count++;
+
+    if (count * INDEXMAP_LOAD_DEN > groups * GROUP_SIZE * INDEXMAP_LOAD_NUM)
+        _grow();
+    else
+        _insertSlot(entry.info.hash.hash, count - 1);
+}
+
+bool
+IndexMap::find(const ObjectHash &hash, IndexEntry *entry) const
+{
+    ssize_t i = _findSlot(hash, hashTag(hash));
+
+    if (i < 0)
+        return false;
+
+    if (entry != NULL)
+        _unpack(_entry(slots[i]), *entry);
+    return true;
+}
+
+bool
+IndexMap::contains(const ObjectHash &hash) const
+{
+    return _findSlot(hash, hashTag(hash)) >= 0;
+}
+
+void
+IndexMap::forEach(const function<void(const IndexEntry &)> &fn) const
+{
+    IndexEntry entry;
+
+    for (size_t i = 0; i < count; i++) {
+        _unpack(_entry(i), entry);
+        fn(entry);
+    }
+}
+
+void
+IndexMap::_pack(const IndexEntry &entry, Entry &e)
+{
+    ASSERT((entry.info.flags >> INDEXMAP_TYPE_SHIFT) == 0);
+
+    memcpy(e.hash, entry.info.hash.hash, ObjectHash::SIZE);
+    e.typeFlags = entry.info.flags |
+                  ((uint32_t)entry.info.type << INDEXMAP_TYPE_SHIFT);
+    e.payloadSize = entry.info.payload_size;
+    e.offset = entry.offset;
+    e.packedSize = entry.packed_size;
+    e.packfile = entry.packfile;
+}
+
+void
+IndexMap::_unpack(const Entry &e, IndexEntry &entry)
+{
+    memcpy(entry.info.hash.hash, e.hash, ObjectHash::SIZE);
+    entry.info.type = (ObjectInfo::Type)(e.typeFlags >> INDEXMAP_TYPE_SHIFT);
+    entry.info.flags = e.typeFlags & ((1U << INDEXMAP_TYPE_SHIFT) - 1);
+    entry.info.payload_size = e.payloadSize;
+    entry.offset = e.offset;
+    entry.packed_size = e.packedSize;
+    entry.packfile = e.packfile;
+}
+
+
+static IndexEntry
+selfTestEntry(int i, packid_t packfile)
+{
+    IndexEntry e;
+
+    e.info.hash = OriCrypt_HashString(to_string(i));
+    e.info.type = (i % 2) ? ObjectInfo::Blob : ObjectInfo::Tree;
+    e.info.flags = i & (ORI_FLAG_DELTAMASK | ORI_FLAG_ZIPMASK);
+    e.info.payload_size = i;
+    e.offset = 4 * i;
+    e.packed_size = i + 1;
+    e.packfile = packfile;
+    return e;
+}
+
+int
+IndexMap_selfTest(void)
+{
+    IndexMap m;
+    IndexEntry e;
+    const int n = 20000;
+
+    cout << "Testing IndexMap ..." << endl;
+
+    assert(!m.find(selfTestEntry(0, 0).info.hash, &e));
+
+    // Grow through every table size
+    for (int i = 0; i < n; i++) {
+        m.insert(selfTestEntry(i, i % 7));
+        assert(m.size() == (size_t)i + 1);
+    }
+    for (int i = 0; i < n; i++) {
+        assert(m.find(selfTestEntry(i, 0).info.hash, &e));
+        assert(e.info.type == selfTestEntry(i, 0).info.type);
+        assert(e.info.flags == selfTestEntry(i, 0).info.flags);
+        assert(e.info.payload_size == (uint32_t)i);
+        assert(e.offset == (offset_t)(4 * i));
+        assert(e.packed_size == (uint32_t)i + 1);
+        assert(e.packfile == (packid_t)(i % 7));
+    }
+    assert(!m.contains(selfTestEntry(n, 0).info.hash));
+
+    // Removal replaces the entry with a tombstone
+    for (int i = 0; i < n; i += 3)
+        m.insert(selfTestEntry(i, INDEX_TOMBSTONE));
+    assert(m.size() == (size_t)n);
+    for (int i = 0; i < n; i++) {
+        assert(m.find(selfTestEntry(i, 0).info.hash, &e));
+        assert(e.packfile == ((i % 3 == 0) ? INDEX_TOMBSTONE :
+                                             (packid_t)(i % 7)));
+    }
+
+    size_t visited = 0;
+    m.forEach([&visited](const IndexEntry &entry) {
+        (void)entry;
+        visited++;
+    });
+    assert(visited == (size_t)n);
+
+    m.clear();
+    assert(m.empty());
+    assert(!m.contains(selfTestEntry(1, 0).info.hash));
+    m.insert(selfTestEntry(1, 2));
+    assert(m.find(selfTestEntry(1, 0).info.hash, &e) && e.packfile == 2);
+
+    return 0;
+}
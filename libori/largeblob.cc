@@ -30,6 +30,12 @@
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include <openssl/sha.h>
 
@@ -39,12 +45,22 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/orifile.h>
+#include <oriutil/runtimeexception.h>
+#include <oriutil/thread.h>
+#include <oriutil/threadpool.h>
 #include <ori/largeblob.h>
 
+#include "tuneables.h"
+
 #ifdef ORI_USE_RK
 #include "rkchunker.h"
 #endif /* ORI_USE_RK */
 
+#ifdef ORI_USE_GEAR
+#include "gearchunker.h"
+#endif /* ORI_USE_GEAR */
+
 #ifdef ORI_USE_FIXED
 #include "fchunker.h"
 #endif /* ORI_USE_FIXED */
@@ -64,7 +80,7 @@ LBlobEntry::LBlobEntry(const LBlobEntry &l)
 {
 }
 
-LBlobEntry::LBlobEntry(const ObjectHash &h, uint16_t l)
+LBlobEntry::LBlobEntry(const ObjectHash &h, uint32_t l)
     : hash(h), length(l)
 {
 }
@@ -90,121 +106,347 @@ LargeBlob::~LargeBlob()
 {
 }
 
+/*
+ * Reads a file into a ring of buffers on its own thread and computes the
+ * hash of the whole file on the way, so the file is read once and the
+ * chunker never waits for the disk or the file hash.  Each buffer has
+ * headroom in front of the data, into which the chunker moves the part of
+ * the previous buffer it has not consumed yet.
+ */
+class FileReader : public Thread
+{
+public:
+    FileReader(int fd, uint64_t fileLen, bool streaming)
+        : Thread("FileReader"), fd(fd), fileLen(fileLen),
+          streaming(streaming), lock(), cv(),
+          idle(), filled(), error(0), done(false), aborted(false)
+    {
+        for (int i = 0; i < LARGEBLOB_BUFFERS; i++)
+            idle.push_back(new uint8_t[LARGEBLOB_HEADROOM + LARGEBLOB_BUFSZ]);
+    }
+    ~FileReader()
+    {
+        {
+            unique_lock<mutex> l(lock);
+            aborted = true;
+        }
+        cv.notify_all();
+        wait();
+
+        for (size_t i = 0; i < idle.size(); i++)
+            delete[] idle[i];
+        for (size_t i = 0; i < filled.size(); i++)
+            delete[] filled[i].first;
+    }
+    void run()
+    {
+        SHA256_CTX state;
+        uint64_t fileOff = 0;
+
+        SHA256_Init(&state);
+        if (streaming)
+            OriFile_AdviseSequential(fd);
+
+        while (fileOff < fileLen) {
+            uint8_t *buf;
+            uint64_t toRead = MIN(LARGEBLOB_BUFSZ, fileLen - fileOff);
+            uint64_t len = 0;
+            {
+                unique_lock<mutex> l(lock);
+                while (idle.empty() && !aborted)
+                    cv.wait(l);
+                if (aborted)
+                    return;
+                buf = idle.back();
+                idle.pop_back();
+            }
+
+            while (len < toRead) {
+                ssize_t status = ::read(fd, buf + LARGEBLOB_HEADROOM + len,
+                                        toRead - len);
+                if (status < 0 && errno == EINTR)
+                    continue;
+                if (status <= 0) {
+                    // The file shrank while it was being read
+                    unique_lock<mutex> l(lock);
+                    error = (status < 0) ? errno : EIO;
+                    idle.push_back(buf);
+                    done = true;
+                    cv.notify_all();
+                    return;
+                }
+                len += status;
+            }
+
+            SHA256_Update(&state, buf + LARGEBLOB_HEADROOM, len);
+            if (streaming)
+                OriFile_DropCache(fd, fileOff, len);
+            fileOff += len;
+
+            unique_lock<mutex> l(lock);
+            filled.push_back(make_pair(buf, len));
+            cv.notify_all();
+        }
+
+        unique_lock<mutex> l(lock);
+        SHA256_Final(hash.hash, &state);
+        done = true;
+        cv.notify_all();
+    }
+    /*
+     * Returns the next buffer and the length of the data that follows the
+     * headroom, or false once the whole file has been returned.
+     */
+    bool next(uint8_t **buf, uint64_t *len)
+    {
+        unique_lock<mutex> l(lock);
+
+        while (filled.empty() && !done)
+            cv.wait(l);
+        if (error != 0) {
+            errno = error;
+            perror("Cannot read large file");
+            PANIC();
+        }
+        if (filled.empty())
+            return false;
+
+        *buf = filled.front().first;
+        *len = filled.front().second;
+        filled.pop_front();
+        return true;
+    }
+    void release(uint8_t *buf)
+    {
+        unique_lock<mutex> l(lock);
+        idle.push_back(buf);
+        cv.notify_all();
+    }
+    /// Valid after next has returned false
+    ObjectHash hash;
+private:
+    int fd;
+    uint64_t fileLen;
+    bool streaming;
+    mutex lock;
+    condition_variable cv;
+    vector<uint8_t *> idle;
+    deque<pair<uint8_t *, uint64_t> > filled;
+    int error;
+    bool done;
+    bool aborted;
+};
+
+/*
+ * Chunks are copied out of the read buffers in batches and hashed on a
+ * thread pool.  Completed batches are added to the repository in file
+ * order, which keeps the chunks of a file together in the packfiles.  The
+ * repository compresses them on its own worker pool.
+ */
+struct ChunkBatch
+{
+    typedef shared_ptr<ChunkBatch> sp;
+    ChunkBatch() : chunks(), hashes(), bytes(0), done(false) { }
+    vector<string> chunks;
+    vector<ObjectHash> hashes;
+    uint64_t bytes;
+    bool done;
+};
+
 class FileChunkerCB : public ChunkerCB
 {
 public:
     FileChunkerCB(LargeBlob *l)
+        : lb(l), lbOff(0), srcFd(-1), fileLen(0), reader(NULL), cur(NULL), lock(),
+          doneCV(), batch(), pending(), pool()
     {
-        lb = l;
-        lbOff = 0;
-        buf = NULL;
     }
     ~FileChunkerCB()
     {
-        if (buf)
-            delete[] buf;
-        if (srcFd > 0)
+        // Wait for outstanding jobs before the batches and lock go away
+        pool.reset();
+        if (reader) {
+            if (cur)
+                reader->release(cur);
+            delete reader;
+        }
+        if (srcFd >= 0)
             ::close(srcFd);
     }
     int open(const string &path)
     {
         struct stat sb;
 
-        bufLen = 8 * 1024 * 1024;
-        buf = new uint8_t[bufLen];
-        if (buf == NULL)
-            return -ENOMEM;
-
         srcFd = ::open(path.c_str(), O_RDONLY);
         if (srcFd < 0)
             return -errno;
 
         if (fstat(srcFd, &sb) < 0) {
-            close(srcFd);
-            return -errno;
+            int err = errno;
+            ::close(srcFd);
+            srcFd = -1;
+            return -err;
         }
+
         fileLen = sb.st_size;
-        fileOff = 0;
+        pool.reset(new ThreadPool(LARGEBLOB_HASH_THREADS));
+        reader = new FileReader(srcFd, fileLen, lb->repo->isStreaming());
+        reader->start();
 
         return 0;
     }
+    uint64_t size() const { return fileLen; }
+    /// Adds the remaining chunks and returns the hash of the whole file
+    ObjectHash finish()
+    {
+        if (batch.get())
+            _submit();
+        _drain(true);
+        return reader->hash;
+    }
     virtual void match(const uint8_t *b, uint32_t l)
     {
-        // Add the fragment into the repository
-        // XXX: Journal for cleanup!
-        string blob = string((const char *)b, l);
-        ObjectHash hash = OriCrypt_HashString(blob);
-        lb->repo->addObject(ObjectInfo::Blob, hash, blob);
-
-        // Add the fragment to the LargeBlob object.
-        lb->parts.insert(make_pair(lbOff, LBlobEntry(hash, l)));
-        lbOff += l;
+        if (!batch.get())
+            batch.reset(new ChunkBatch());
+
+        batch->chunks.push_back(string((const char *)b, l));
+        batch->bytes += l;
+        if (batch->bytes >= LARGEBLOB_HASH_BATCH)
+            _submit();
     }
     virtual int load(uint8_t **b, uint64_t *l, uint64_t *o)
     {
-        if (*b == NULL)
-            *b = buf;
+        uint8_t *buf;
+        uint64_t len;
 
-        if (fileOff == fileLen)
+        if (!reader->next(&buf, &len))
             return 0;
 
-        // Sanity checking
-        ASSERT(*b == buf);
-        ASSERT(*l <= bufLen);
-        ASSERT(*o <= bufLen);
-
-        if (*o != 0 || *o != *l) {
-            ASSERT(*o > 32); // XXX: Must equal hashLen
-            ASSERT(*l > 32);
-            memcpy(buf, buf + *o - 32, *l - *o + 32);
-            *l = *l - *o + 32;
+        if (cur == NULL) {
+            *b = buf + LARGEBLOB_HEADROOM;
+            *l = len;
+            *o = 0;
+        } else {
+            // Keep the unconsumed data and the hash window before it
+            ASSERT(*o >= 32); // XXX: Must equal hashLen
+            uint64_t keep = *l - *o + 32;
+
+            ASSERT(keep <= LARGEBLOB_HEADROOM);
+            memcpy(buf + LARGEBLOB_HEADROOM - keep, *b + *o - 32, keep);
+            reader->release(cur);
+
+            *b = buf + LARGEBLOB_HEADROOM - keep;
+            *l = keep + len;
             *o = 32;
         }
+        cur = buf;
 
-        uint64_t toRead = MIN(bufLen - *l, fileLen - fileOff);
-        int status;
+        return 1;
+    }
+private:
+    void _submit()
+    {
+        pending.push_back(batch);
+        pool->enqueue(bind(&FileChunkerCB::_hashJob, this, batch));
+        batch.reset();
 
-        status = read(srcFd, buf + *l, toRead);
-        if (status < 0) {
-            perror("Cannot read large file");
-            PANIC();
-            return -1;
-        }
-        ASSERT(status == (int)toRead);
+        _drain(false);
+    }
+    void _hashJob(ChunkBatch::sp b)
+    {
+        vector<ObjectHash> hashes;
 
-        fileOff += status;
-        *l += status;
-        //*o = 32;
+        hashes.reserve(b->chunks.size());
+        for (size_t i = 0; i < b->chunks.size(); i++)
+            hashes.push_back(OriCrypt_HashString(b->chunks[i]));
 
-        return 1;
+        unique_lock<mutex> l(lock);
+        b->hashes.swap(hashes);
+        b->done = true;
+        doneCV.notify_all();
     }
-private:
+    /*
+     * Adds the hashed batches at the front of the queue.  Waits for the
+     * front batch when wait is set or too many batches are outstanding.
+     */
+    void _drain(bool wait)
+    {
+        size_t maxPending = 2 * pool->getThreads();
+
+        while (!pending.empty()) {
+            ChunkBatch::sp b = pending.front();
+            {
+                unique_lock<mutex> l(lock);
+                if (!b->done && !wait && pending.size() <= maxPending)
+                    return;
+                while (!b->done)
+                    doneCV.wait(l);
+            }
+            pending.pop_front();
+
+            for (size_t i = 0; i < b->chunks.size(); i++) {
+                uint32_t len = b->chunks[i].size();
+
+                // XXX: Journal for cleanup!
+                lb->repo->addChunk(b->hashes[i], b->chunks[i]);
+                lb->parts.insert(make_pair(lbOff, LBlobEntry(b->hashes[i],
+                                                             len)));
+                lbOff += len;
+            }
+        }
+    }
+
     // Output large blob
     LargeBlob *lb;
     uint64_t lbOff;
     // Input file
     int srcFd;
     uint64_t fileLen;
-    uint64_t fileOff;
-    // RK buffer
-    uint8_t *buf;
-    uint64_t bufLen;
+    FileReader *reader;
+    // Buffer being chunked
+    uint8_t *cur;
+    // Batches being hashed in file order
+    mutex lock;
+    condition_variable doneCV;
+    ChunkBatch::sp batch;
+    deque<ChunkBatch::sp> pending;
+    ThreadPool::sp pool;
 };
 
-void
-LargeBlob::chunkFile(const string &path)
+/*
+ * Chunks the file with the given chunk sizes, the fixed chunker uses eight
+ * times the target size.
+ */
+template<int target, int min, int max>
+static void
+chunkWith(ChunkerCB *cb)
 {
-    int status;
-    FileChunkerCB cb = FileChunkerCB(this);
 #ifdef ORI_USE_RK
-    RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
+    RKChunker<target, min, max> c = RKChunker<target, min, max>();
 #endif /* ORI_USE_RK */
 
+#ifdef ORI_USE_GEAR
+    GearChunker<target, min, max> c = GearChunker<target, min, max>();
+#endif /* ORI_USE_GEAR */
+
 #ifdef ORI_USE_FIXED
-    //FChunker<4096> c = FChunker<4096>();
-    FChunker<32*1024> c = FChunker<32*1024>();
+    FChunker<8 * target> c = FChunker<8 * target>();
 #endif /* ORI_USE_FIXED */
 
+    c.chunk(cb);
+}
+
+/*
+ * Larger files use larger chunks, which bounds the number of chunk
+ * objects, index entries and references per file at the cost of coarser
+ * deduplication.
+ */
+void
+LargeBlob::chunkFile(const string &path)
+{
+    int status;
+    FileChunkerCB cb(this);
+
     status = cb.open(path);
     if (status < 0) {
         perror("Cannot open large file for chunking");
@@ -212,9 +454,14 @@ LargeBlob::chunkFile(const string &path)
         return;
     }
 
-    totalHash = OriCrypt_HashFile(path);
+    if (cb.size() < LARGEBLOB_TIER_MEDIUM)
+        chunkWith<4096, 2048, 8192>(&cb);
+    else if (cb.size() < LARGEBLOB_TIER_HUGE)
+        chunkWith<16384, 8192, 65536>(&cb);
+    else
+        chunkWith<65536, 32768, 262144>(&cb);
 
-    c.chunk(&cb);
+    totalHash = cb.finish();
 }
 
 void
@@ -231,6 +478,9 @@ LargeBlob::extractFile(const string &path)
         return;
     }
 
+    // Written data is dropped from the cache every LARGEBLOB_BUFSZ bytes
+    bool streaming = repo->isStreaming();
+    uint64_t dropOff = 0;
     for (it = parts.begin(); it != parts.end(); it++)
     {
         int status;
@@ -248,10 +498,19 @@ LargeBlob::extractFile(const string &path)
         }
 
         ASSERT(status == (int)tmp.length());
+
+        uint64_t end = (*it).first + tmp.length();
+        if (streaming && end - dropOff >= LARGEBLOB_BUFSZ) {
+            OriFile_DropCache(fd, dropOff, end - dropOff, true);
+            dropOff = end;
+        }
     }
+    if (streaming)
+        OriFile_DropCache(fd, dropOff, totalSize() - dropOff, true);
+    ::close(fd);
 
 #ifdef DEBUG
-    ObjectHash extractedHash = OriCrypt_HashFile(path);
+    ObjectHash extractedHash = OriCrypt_HashFile(path, streaming);
     ASSERT(extractedHash == totalHash);
 #endif /* DEBUG */
 }
@@ -295,24 +554,52 @@ LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
 
     Object::sp o(repo->getObject((*it).second.hash));
     ASSERT(o->getInfo().type == ObjectInfo::Blob);
-    const std::string &payload = o->getPayload();
-    memcpy(buf, payload.data()+part_off, to_read);
+    // Only decode the part of the chunk being read
+    bytestream::ap bs(o->getPayloadStreamAt(part_off));
+    if (!bs.get() || !bs->readExact(buf, to_read)) {
+        LOG("could not read chunk %s", (*it).second.hash.hex().c_str());
+        return -EIO;
+    }
 
     return to_read;
 }
 
+/*
+ * Version 1 blobs store 16-bit chunk lengths and version 2 blobs 32-bit
+ * lengths.  The version is kept in the top byte of the chunk count, which
+ * is zero in version 1.  Version 2 is only written when a chunk does not
+ * fit in 16 bits, so files chunked with small chunks keep their hashes and
+ * stay readable by older versions.
+ */
+#define LARGEBLOB_VERSION_SHIFT 56
+#define LARGEBLOB_VERSION_V2 2
+
 const string
 LargeBlob::getBlob()
 {
     strwstream ss;
+    bool wide = false;
+
+    for (auto &it : parts) {
+        if (it.second.length > UINT16_MAX) {
+            wide = true;
+            break;
+        }
+    }
+
     ss.writeHash(totalHash);
 
-    size_t num = parts.size();
+    uint64_t num = parts.size();
+    if (wide)
+        num |= (uint64_t)LARGEBLOB_VERSION_V2 << LARGEBLOB_VERSION_SHIFT;
     ss.writeUInt64(num);
 
     for (auto &it : parts) {
         ss.writeHash(it.second.hash);
-        ss.writeUInt16(it.second.length);
+        if (wide)
+            ss.writeUInt32(it.second.length);
+        else
+            ss.writeUInt16(it.second.length);
     }
 
     return ss.str();
@@ -324,13 +611,25 @@ LargeBlob::fromBlob(const string &blob)
     strstream ss(blob);
     ss.readHash(totalHash);
 
-    size_t num = ss.readUInt64();
+    uint64_t num = ss.readUInt64();
+    uint64_t version = num >> LARGEBLOB_VERSION_SHIFT;
+    num &= ((uint64_t)1 << LARGEBLOB_VERSION_SHIFT) - 1;
+
+    if (version != 0 && version != LARGEBLOB_VERSION_V2) {
+        WARNING("Unsupported large blob version %" PRIu64, version);
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Unsupported large blob version");
+    }
 
     uint64_t off = 0;
-    for (size_t i = 0; i < num; i++) {
+    for (uint64_t i = 0; i < num; i++) {
         ObjectHash hash;
         ss.readHash(hash);
-        size_t length = ss.readUInt16();
+        uint32_t length;
+        if (version == LARGEBLOB_VERSION_V2)
+            length = ss.readUInt32();
+        else
+            length = ss.readUInt16();
 
         parts.insert(make_pair(off, LBlobEntry(hash, length)));
 
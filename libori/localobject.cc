@@ -52,7 +52,7 @@ using namespace std;
  * Object
  */
 LocalObject::LocalObject(PfTransaction::sp transaction, size_t ix)
-    : Object(transaction->infos[ix]), transaction(transaction), ix_tr(ix),
+    : Object(transaction->getInfo(ix)), transaction(transaction), ix_tr(ix),
       packfile()
 {
 }
@@ -62,30 +62,61 @@ LocalObject::LocalObject(Packfile::sp packfile, const IndexEntry &entry)
 {
 }
 
+LocalObject::LocalObject(const ObjectInfo &info, ObjectCache::Payload payload)
+    : Object(info), packfile(), payload(payload)
+{
+}
+
 LocalObject::~LocalObject()
 {
 }
 
-// XXX: Eliminate duplicate compression code!
 bytestream *LocalObject::getPayloadStream() {
     if (packfile.get()) {
         return packfile->getPayload(entry);
     }
     if (transaction.get()) {
-        switch(info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                return new strstream(transaction->payloads[ix_tr]);
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                return new zipstream(new strstream(transaction->payloads[ix_tr]),
-                                     DECOMPRESS, info.payload_size);
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
+        return transaction->getPayloadStream(ix_tr);
+    }
+    if (payload.get()) {
+        return new strstream(*payload);
     }
     return NULL;
 }
 
+std::string LocalObject::getPayload() {
+    if (payload.get()) {
+        return *payload;
+    }
+    return Object::getPayload();
+}
+
+bytestream *LocalObject::getPayloadStreamAt(size_t offset) {
+    PayloadSpan span;
+    if (getPayloadSpan(span)) {
+        offset = MIN(offset, span.len);
+        return new memstream(span.data + offset, span.len - offset,
+                             span.owner);
+    }
+    if (packfile.get()) {
+        return packfile->getPayload(entry, offset);
+    }
+    return Object::getPayloadStreamAt(offset);
+}
+
+bool LocalObject::getPayloadSpan(PayloadSpan &span) {
+    if (payload.get()) {
+        span.data = (const uint8_t *)payload->data();
+        span.len = payload->size();
+        span.owner = payload;
+        return true;
+    }
+    if (packfile.get()) {
+        return packfile->getSpan(entry, span);
+    }
+    return false;
+}
+
 /*
  * Static methods
  */
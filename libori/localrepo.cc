@@ -15,6 +15,7 @@
  */
 
 #include <stdint.h>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -35,6 +36,8 @@
 #include <iostream>
 #include <functional>
 
+#include "tuneables.h"
+
 #include <ori/version.h>
 #include <oriutil/debug.h>
 #include <oriutil/runtimeexception.h>
@@ -45,12 +48,18 @@
 #include <oriutil/oristr.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
+#include <oriutil/stopwatch.h>
 #include <oriutil/zeroconf.h>
+#include <ori/compactor.h>
 #include <ori/largeblob.h>
 #include <ori/localrepo.h>
 #include <ori/sshrepo.h>
 #include <ori/remoterepo.h>
 
+extern "C" {
+#include <libdiffmerge/delta.h>
+};
+
 using namespace std;
 
 #define ORI_DIR_MASK        0755
@@ -197,6 +206,8 @@ LocalRepoLock::~LocalRepoLock()
 
 LocalRepo::LocalRepo(const string &root)
     : opened(false),
+      streaming(false),
+      durability(new DurabilityPolicy()),
       remoteRepo(NULL)
 {
     rootPath = (root == "") ? findRootPath() : root;
@@ -252,6 +263,10 @@ LocalRepo::open(const string &root)
         throw SystemException();
     }
 
+    // All files share the repository durability policy
+    index.setDurability(durability);
+    metadata.setDurability(durability);
+
     // XXX: Check and rebuild index on error
     index.open(rootPath + ORI_PATH_INDEX); // throws SystemException or RuntimeException
 
@@ -272,7 +287,50 @@ LocalRepo::open(const string &root)
         snapshots.close();
         throw e;
     }
-    packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS));
+    packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS,
+                                        durability));
+    packfiles->setIndex(&index);
+    PackfileCompactor(packfiles.get(), &index).recover();
+    compressPool.reset(new ThreadPool());
+
+    // Durability mode is a repository variable
+    string durabilityMode = vars.get("durability");
+    if (durabilityMode != "") {
+        DurabilityPolicy::Mode mode;
+        if (DurabilityPolicy::parseMode(durabilityMode, mode)) {
+            durability->setMode(mode);
+        } else {
+            WARNING("Unknown durability mode '%s'", durabilityMode.c_str());
+        }
+    }
+
+    // Compression mode is a repository variable
+    string compressionMode = vars.get("compression");
+    if (compressionMode != "") {
+        CompressionPolicy::Mode mode;
+        if (CompressionPolicy::parseMode(compressionMode, mode)) {
+            compression.setMode(mode);
+        } else {
+            WARNING("Unknown compression mode '%s'", compressionMode.c_str());
+        }
+    }
+
+    // In streaming ingest mode file contents read or written in bulk and
+    // packfile appends of this repository bypass the page cache
+    string ingestMode = vars.get("ingest");
+    if (ingestMode != "" && ingestMode != "cached" &&
+        ingestMode != "streaming") {
+        WARNING("Unknown ingest mode '%s'", ingestMode.c_str());
+    }
+    streaming = (ingestMode == "streaming");
+    packfiles->setStreaming(streaming);
+
+    // Object cache budget in bytes
+    objectCache.setBudget(OBJCACHE_BUDGET);
+    string cacheSize = vars.get("cachesize");
+    if (cacheSize != "") {
+        objectCache.setBudget(strtoull(cacheSize.c_str(), NULL, 10));
+    }
 
     // Scan for peers
     string peer_path = rootPath + ORI_PATH_REMOTES;
@@ -302,11 +360,20 @@ LocalRepo::close()
         return;
 
     sync();
+    for (int i = 0; i < PACKSTREAM_MAX; i++)
+        _retirePackfile((PackStream)i);
+
+    ObjectCache::Stats stats = objectCache.getStats();
+    LOG("Object cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+        "%" PRIu64 " evictions", stats.hits, stats.misses, stats.evictions);
+    objectCache.clear();
 
-    currTransaction.reset();
+    compressPool.reset();
     index.close();
     snapshots.close();
     packfiles.reset();
+    durability->flush();
+    streaming = false;
     opened = false;
 }
 
@@ -424,15 +491,14 @@ Object::sp LocalRepo::getObject(const ObjectHash &objId)
 // XXX: Verify and recover from corrupt objects!!!
 // XXX: Why do we check compression in Packfile::getPayload
 // XXX: LocalObject::getStream and transactions multiple places.
-LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
+LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId,
+                                          bool cached)
 {
     ASSERT(opened);
 
-    if (currTransaction.get()) {
-        if (currTransaction->has(objId)) {
-            return LocalObject::sp(new LocalObject(currTransaction,
-                        currTransaction->hashToIx[objId]));
-        }
+    PfTransaction::sp tr = _findTransaction(objId);
+    if (tr.get()) {
+        return LocalObject::sp(new LocalObject(tr, tr->hashToIx[objId]));
     }
 
     /*
@@ -443,7 +509,38 @@ LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
 	return LocalObject::sp();
 
     const IndexEntry &ie = index.getEntry(objId);
+
+    ObjectCache::Payload payload;
+    if (ie.info.payload_size <= INDEX_INLINE_MAX) {
+        string *str = new string();
+        payload.reset(str);
+        if (index.getInline(objId, *str))
+            return LocalObject::sp(new LocalObject(ie.info, payload));
+    }
+
+    if (cached && objectCache.get(objId, payload))
+        return LocalObject::sp(new LocalObject(ie.info, payload));
+
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
+    if (!cached)
+        return LocalObject::sp(new LocalObject(packfile, ie));
+
+    // Objects that span several frames can be read from any frame
+    bool seekable = !ie.info.isDelta() &&
+        ie.info.getAlgo() == ObjectInfo::ZIPALGO_FASTLZ_FRAMED &&
+        ie.info.payload_size > zipstream::frameSize();
+
+    // Decode small objects once and keep them for later lookups
+    if (!seekable && ie.info.payload_size <= objectCache.maxObjectSize()) {
+        bytestream::ap bs(packfile->getPayload(ie));
+        string *str = new string(bs->readAll());
+        payload.reset(str);
+        if (!bs->error() && str->size() == ie.info.payload_size) {
+            objectCache.put(objId, payload);
+            return LocalObject::sp(new LocalObject(ie.info, payload));
+        }
+    }
+
     return LocalObject::sp(new LocalObject(packfile, ie));
 }
 
@@ -489,6 +586,22 @@ LocalRepo::objIdToPath(const ObjectHash &objId)
 int
 LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
         const std::string &payload)
+{
+    return _addObject(type, hash, payload,
+                      compression.select(type, payload.size()));
+}
+
+int
+LocalRepo::addChunk(const ObjectHash &hash, const std::string &payload)
+{
+    return _addObject(ObjectInfo::Blob, hash, payload,
+                      compression.select(ObjectInfo::Blob, payload.size(),
+                                         true));
+}
+
+int
+LocalRepo::_addObject(ObjectType type, const ObjectHash &hash,
+        const std::string &payload, ObjectInfo::ZipAlgo algo)
 {
     ASSERT(opened);
     ASSERT(!hash.isEmpty());
@@ -497,27 +610,18 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
 
     if (isObjectStored(hash)) return 0;
 
-    if (!currPackfile.get()) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (!currTransaction.get()) {
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (currTransaction->full()) {
-        currTransaction->commit();
-        currTransaction.reset();
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
-
     ObjectInfo info(hash);
     info.type = type;
     info.payload_size = payload.size();
 
-    currTransaction->addPayload(info, payload);
+    PackStream s = _getStream(type);
+    _beginTransaction(s);
+
+    currTransaction[s]->addPayload(info, payload, algo);
+
+    // Tiny objects are also served straight from the index
+    if (payload.size() <= INDEX_INLINE_MAX)
+        index.addInline(info, payload);
 
 
     /*string objPath = objIdToPath(hash);
@@ -537,6 +641,155 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
     return 0;
 }
 
+LocalRepo::PackStream
+LocalRepo::_getStream(ObjectType type)
+{
+    if (type == ObjectInfo::Commit || type == ObjectInfo::Tree)
+        return PACKSTREAM_METADATA;
+    return PACKSTREAM_DATA;
+}
+
+/*
+ * Make sure there is a transaction with room for another object.
+ */
+void
+LocalRepo::_beginTransaction(PackStream s)
+{
+    if (currTransaction[s].get() && currTransaction[s]->full()) {
+        if (s == PACKSTREAM_METADATA) {
+            // Trees must not be indexed before the blobs they reference
+            _commitTransactions();
+        } else {
+            currTransaction[s]->commit();
+            currTransaction[s].reset();
+            _retirePackfile(s);
+        }
+    }
+
+    if (!currTransaction[s].get()) {
+        _nextPackfile(s);
+        currTransaction[s] = currPackfile[s]->begin(&index,
+                                                    compressPool.get());
+    }
+}
+
+/*
+ * Make sure the stream has a packfile with room, packfiles also fill up over
+ * several synced transactions.
+ */
+void
+LocalRepo::_nextPackfile(PackStream s)
+{
+    ASSERT(!currTransaction[s].get());
+    if (currPackfile[s].get() && currPackfile[s]->full())
+        _retirePackfile(s);
+    if (!currPackfile[s].get())
+        currPackfile[s] = packfiles->newPackfile();
+}
+
+/*
+ * Commit the open transactions.  The packfiles that are full are sealed,
+ * the next object of their stream starts a new packfile.
+ */
+void
+LocalRepo::_commitTransactions()
+{
+    for (int i = 0; i < PACKSTREAM_MAX; i++) {
+        if (!currTransaction[i].get())
+            continue;
+
+        bool full = currTransaction[i]->full();
+        currTransaction[i]->commit();
+        currTransaction[i].reset();
+        if (full)
+            _retirePackfile((PackStream)i);
+    }
+}
+
+/*
+ * Seal the current packfile of a stream.
+ */
+void
+LocalRepo::_retirePackfile(PackStream s)
+{
+    if (!currPackfile[s].get())
+        return;
+
+    ASSERT(!currTransaction[s].get());
+    if (!currPackfile[s]->isSealed())
+        currPackfile[s]->seal();
+    currPackfile[s].reset();
+}
+
+PfTransaction::sp
+LocalRepo::_findTransaction(const ObjectHash &hash)
+{
+    for (int i = 0; i < PACKSTREAM_MAX; i++) {
+        if (currTransaction[i].get() && currTransaction[i]->has(hash))
+            return currTransaction[i];
+    }
+
+    return PfTransaction::sp();
+}
+
+/*
+ * Store a blob as a delta against base if base is a blob with a short
+ * enough chain and the delta is small, otherwise store it whole.  The base
+ * may still be in the current transaction, it is then indexed together with
+ * the delta.
+ */
+int
+LocalRepo::addDeltaObject(ObjectType type, const ObjectHash &hash,
+                          const string &payload, const ObjectHash &base)
+{
+    ASSERT(opened);
+    ASSERT(!hash.isEmpty());
+
+    if (type != ObjectInfo::Blob || payload.size() < DELTA_MINIMUM_SIZE ||
+        base.isEmpty() || base == hash || !isObjectStored(base) ||
+        purged.find(base) != purged.end() || isObjectStored(hash))
+        return addObject(type, hash, payload);
+
+    ObjectInfo baseInfo;
+    PfTransaction::sp baseTr = _findTransaction(base);
+    if (baseTr.get())
+        baseInfo = baseTr->getInfo(baseTr->hashToIx[base]);
+    else
+        baseInfo = index.getInfo(base);
+    if (baseInfo.type != ObjectInfo::Blob ||
+        baseInfo.getDeltaDepth() >= DELTA_MAX_DEPTH)
+        return addObject(type, hash, payload);
+
+    string src = getPayload(base);
+    if (src.size() != baseInfo.payload_size)
+        return addObject(type, hash, payload);
+
+    string delta(ObjectHash::SIZE + payload.size() + DELTA_OVERHEAD, '\0');
+    memcpy(&delta[0], base.hash, ObjectHash::SIZE);
+    int len = delta_create(src.data(), src.size(), payload.data(),
+                           payload.size(), &delta[ObjectHash::SIZE]);
+    if (len < 0 || len > payload.size() * DELTA_MAX_RATIO)
+        return addObject(type, hash, payload);
+    delta.resize(ObjectHash::SIZE + len);
+
+    ObjectInfo::ZipAlgo algo = compression.select(type, delta.size());
+    if (algo == ObjectInfo::ZIPALGO_FASTLZ)
+        algo = ObjectInfo::ZIPALGO_FASTLZ_FRAMED;
+
+    purged.erase(hash);
+    PackStream s = _getStream(type);
+    _beginTransaction(s);
+
+    ObjectInfo info(hash);
+    info.type = type;
+    info.payload_size = payload.size();
+    info.setDeltaDepth(baseInfo.getDeltaDepth() + 1);
+
+    currTransaction[s]->addDelta(info, payload, delta, algo);
+
+    return 0;
+}
+
 /*
  * Add a tree to the repository.
  */
@@ -661,7 +914,7 @@ LocalRepo::verifyObject(const ObjectHash &objId)
 	return "Object not found!";
 
     // XXX: Add better error handling
-    o = getLocalObject(objId);
+    o = getLocalObject(objId, false);
     if (!o)
 	return "Cannot open object!";
 
@@ -670,7 +923,12 @@ LocalRepo::verifyObject(const ObjectHash &objId)
         return "Object with Null type!";
 
     if (type != ObjectInfo::Purged) {
-        ObjectHash computedHash = OriCrypt_HashString(o->getPayload());
+        ObjectHash computedHash;
+        PayloadSpan span;
+        if (o->getPayloadSpan(span))
+            computedHash = OriCrypt_HashBlob(span.data, span.len);
+        else
+            computedHash = OriCrypt_HashString(o->getPayload());
         if (computedHash != objId) {
             stringstream ss;
             ss << "Object hash mismatch! (computed hash "
@@ -772,63 +1030,158 @@ LocalRepo::listObjects()
 void
 LocalRepo::sync()
 {
-    bool full = false;
-    if (currTransaction.get()) {
-        full = currTransaction->full();
-        currTransaction->commit();
-        currTransaction.reset();
+    bool pending = false;
+    for (int i = 0; i < PACKSTREAM_MAX; i++) {
+        if (currTransaction[i].get())
+            pending = true;
+    }
+
+    if (pending || index.hasPending()) {
+        _commitTransactions();
         index.sync();
         metadata.sync();
     }
-    if (full) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
+    packfiles->saveAccess(false);
+}
+
+void
+LocalRepo::setDurability(DurabilityPolicy::Mode mode)
+{
+    durability->setMode(mode);
 }
 
-struct RebuildIndexStruct
+DurabilityPolicy::Mode
+LocalRepo::getDurability()
 {
-    Index *idx;
-    packid_t id;
-};
+    return durability->getMode();
+}
 
 void
-rebuildIndexCb(const ObjectInfo &info, offset_t off, void *arg)
+LocalRepo::setCompression(CompressionPolicy::Mode mode)
 {
-    RebuildIndexStruct *ris = (RebuildIndexStruct *)arg;
-    struct IndexEntry entry;
+    compression.setMode(mode);
+}
 
-    entry.info = info;
-    entry.offset = off;
-    entry.packed_size = info.payload_size;
-    entry.packfile = ris->id;
+CompressionPolicy::Mode
+LocalRepo::getCompression()
+{
+    return compression.getMode();
+}
 
-    ris->idx->updateEntry(info.hash, entry);
+ObjectCache &
+LocalRepo::getObjectCache()
+{
+    return objectCache;
+}
+
+void
+rebuildIndexCb(const IndexEntry &entry, void *arg)
+{
+    vector<IndexEntry> *entries = (vector<IndexEntry> *)arg;
+
+    entries->push_back(entry);
 }
 
 bool
 LocalRepo::rebuildIndex()
 {
     string indexPath = rootPath + ORI_PATH_INDEX;
+
     index.close();
+    objectCache.clear();
 
     OriFile_Delete(indexPath);
+    if (OriFile_Exists(indexPath + ".tbl"))
+        OriFile_Delete(indexPath + ".tbl");
+    if (OriFile_Exists(indexPath + ".inl"))
+        OriFile_Delete(indexPath + ".inl");
 
     index.open(indexPath);
 
+    /*
+     * Scan the packfiles concurrently, each worker sorts the entries of its
+     * packfile by hash and the sorted runs are merged into the table.
+     * Packfile ids are reused so they do not order copies of an object,
+     * loadTable keeps the copy that depends on the fewest other objects.
+     */
     vector<packid_t> pfIds = packfiles->getPackfileList();
-    vector<packid_t>::iterator it;
-
-    for (it = pfIds.begin(); it != pfIds.end(); it++)
+    vector<vector<IndexEntry> > runs(pfIds.size());
+    mutex progressLock;
+    size_t packsDone = 0;
+    uint64_t objsDone = 0;
+    uint64_t bytesDone = 0;
+    uint64_t lastReport = 0;
+    Stopwatch sw;
+
+    sort(pfIds.begin(), pfIds.end());
+    sw.start();
     {
-        RebuildIndexStruct ris;
-        Packfile::sp pf = packfiles->getPackfile(*it);
+        ThreadPool pool(REBUILDINDEX_THREADS);
+
+        for (size_t i = 0; i < pfIds.size(); i++) {
+            // Opened here, the manager is not thread safe
+            Packfile::sp pf = packfiles->getPackfile(pfIds[i]);
+
+            pool.enqueue([&, i, pf]() {
+                vector<IndexEntry> &run = runs[i];
+
+                pf->readEntries(rebuildIndexCb, (void *)&run);
+                sort(run.begin(), run.end(),
+                     [](const IndexEntry &a, const IndexEntry &b) {
+                        return a.info.hash < b.info.hash;
+                     });
+
+                unique_lock<mutex> l(progressLock);
+                packsDone++;
+                objsDone += run.size();
+                bytesDone += pf->getFileSize();
+                uint64_t ms = sw.getElapsedMS();
+                if (ms - lastReport >= REBUILDINDEX_REPORT_MS) {
+                    LOG("rebuildindex: %lu/%lu packfiles, %" PRIu64
+                        " objects, %.1f MB/s", packsDone, pfIds.size(),
+                        objsDone, (double)bytesDone / 1000.0 / ms);
+                    lastReport = ms;
+                }
+            });
+        }
+        pool.waitIdle();
+    }
+
+    index.loadTable(runs);
 
-        ris.idx = &index;
-        ris.id = *it;
-        pf->readEntries(rebuildIndexCb, (void *)&ris);
+    // Refill the payload cache of tiny objects from the copies indexed
+    for (size_t i = 0; i < runs.size(); i++) {
+        Packfile::sp pf;
+        for (size_t j = 0; j < runs[i].size(); j++) {
+            const IndexEntry &e = runs[i][j];
+            if (e.info.payload_size > INDEX_INLINE_MAX)
+                continue;
+            IndexEntry ie = index.getEntry(e.info.hash);
+            if (ie.packfile != e.packfile || ie.offset != e.offset)
+                continue;
+            if (!pf.get())
+                pf = packfiles->getPackfile(e.packfile);
+
+            bytestream::ap bs(pf->getPayload(e));
+            string payload = bs->readAll();
+            if (bs->error() || payload.size() != e.info.payload_size ||
+                OriCrypt_HashString(payload) != e.info.hash) {
+                WARNING("rebuildindex: object %s in packfile %u is corrupt",
+                        e.info.hash.hex().c_str(), e.packfile);
+                continue;
+            }
+            index.addInline(e.info, payload);
+        }
     }
-    
+    index.rewrite();
+
+    sw.stop();
+    uint64_t ms = sw.getElapsedMS();
+    LOG("rebuildindex: indexed %" PRIu64 " objects from %lu packfiles "
+        "(%" PRIu64 " MB) in %" PRIu64 " ms, %.1f MB/s", objsDone,
+        pfIds.size(), bytesDone / (1024 * 1024), ms,
+        (double)bytesDone / 1000.0 / (ms ? ms : 1));
+
     return true;
 }
 
@@ -839,10 +1192,10 @@ LocalRepo::dumpIndex()
 }
 
 void
-packfileDumper(const ObjectInfo &info, offset_t off, void *arg)
+packfileDumper(const IndexEntry &entry, void *arg)
 {
-    info.print();
-    printf("  packfile: offset = 0x%x\n", off);
+    entry.info.print();
+    printf("  packfile: offset = 0x%x\n", entry.offset);
 }
 
 void
@@ -1191,31 +1544,101 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
     printf("Speed-up: %lu of %lu objects\n", closerObjs, totalObjs);
 }
 
+/*
+ * Send the objects grouped by packfile, packfiles in the order the request
+ * first names them.  A delta whose base is not part of the request is sent
+ * whole, compressed with the codec of this repository, as are the tiny
+ * objects cached in the index, which are sent without a packfile read.
+ */
 void
 LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
 {
     unordered_set<ObjectHash> includedHashes;
+    unordered_set<ObjectHash> queued;
 
     typedef std::vector<IndexEntry> IndexEntryVec;
-    std::map<Packfile::sp, IndexEntryVec> packs;
+    std::vector<std::pair<Packfile::sp, IndexEntryVec> > packs;
+    std::unordered_map<packid_t, size_t> packIx;
+    IndexEntryVec whole;
+    includedHashes.insert(objs.begin(), objs.end());
     for (size_t i = 0; i < objs.size(); i++) {
-        if (includedHashes.find(objs[i]) == includedHashes.end()) {
-            const IndexEntry &ie = index.getEntry(objs[i]);
-            Packfile::sp pf = packfiles->getPackfile(ie.packfile);
-            packs[pf].push_back(ie);
-            includedHashes.insert(objs[i]);
-        } else {
-            DLOG("duplicate object in LocalRepo::transmit");
+        if (!queued.insert(objs[i]).second)
+            continue;
+
+        const IndexEntry &ie = index.getEntry(objs[i]);
+        if (index.hasInline(objs[i])) {
+            whole.push_back(ie);
+            continue;
         }
-    }
 
-    for (std::map<Packfile::sp, IndexEntryVec>::iterator it = packs.begin();
-            it != packs.end();
-            it++) {
-        const Packfile::sp &pf = (*it).first;
-        //fprintf(stderr, "Transmitting %lu objects from %p\n",
-        //        (*it).second.size(), pf.get());
-        pf->transmit(bs, (*it).second);
+        auto it = packIx.find(ie.packfile);
+        if (it == packIx.end()) {
+            it = packIx.insert(make_pair(ie.packfile, packs.size())).first;
+            packs.push_back(make_pair(packfiles->getPackfile(ie.packfile),
+                                      IndexEntryVec()));
+        }
+        const Packfile::sp &pf = packs[(*it).second].first;
+
+        // The receiver can only rebuild deltas whose base is sent with them
+        if (ie.info.isDelta() &&
+            includedHashes.find(pf->getDeltaBase(ie)) == includedHashes.end()) {
+            whole.push_back(ie);
+            continue;
+        }
+        packs[(*it).second].second.push_back(ie);
+    }
+
+    for (size_t i = 0; i < packs.size(); i++) {
+        if (!packs[i].second.empty())
+            packs[i].first->transmit(bs, packs[i].second);
+    }
+
+    // Whole objects are sent in batches of about PACKFILE_STAGING_BUFSZ
+    size_t first = 0;
+    while (first < whole.size()) {
+        vector<ObjectInfo> infos;
+        vector<string> payloads;
+        size_t bytes = 0;
+
+        while (first < whole.size() && bytes < PACKFILE_STAGING_BUFSZ) {
+            ObjectInfo info = whole[first].info;
+            string payload;
+            string out;
+
+            if (!index.getInline(info.hash, payload)) {
+                Packfile::sp pf =
+                    packfiles->getPackfile(whole[first].packfile);
+                bytestream::ap os(pf->getPayload(whole[first]));
+                payload = os->readAll();
+                if (os->error() || payload.size() != info.payload_size) {
+                    WARNING("Object %s could not be read: %s",
+                            info.hash.hex().c_str(),
+                            os->error() ? os->error() : "short read");
+                    throw RuntimeException(ORIEC_OBJECTCORRUPT,
+                                           "Corrupt object");
+                }
+            }
+
+            info.setDeltaDepth(0);
+            if (PfTransaction::compress(info, payload,
+                    compression.select(info.type, payload.size()), out))
+                payload.swap(out);
+
+            bytes += payload.size();
+            infos.push_back(info);
+            payloads.push_back(string());
+            payloads.back().swap(payload);
+            first++;
+        }
+
+        bs->writeUInt32(infos.size());
+        for (size_t i = 0; i < infos.size(); i++) {
+            bs->write(infos[i].toString().data(), ObjectInfo::SIZE);
+            bs->writeUInt32(payloads[i].size());
+        }
+        for (size_t i = 0; i < payloads.size(); i++) {
+            bs->write(payloads[i].data(), payloads[i].size());
+        }
     }
 
     /* Write (numobjs_t)0 */
@@ -1226,12 +1649,110 @@ void
 LocalRepo::receive(bytestream *bs)
 {
     bool cont = true;
+
+    // Objects are received straight into the packfiles, not a transaction
+    _commitTransactions();
+
+    // The metadata packfile is only created for batches with trees
+    auto metaPf = [this]() -> Packfile * {
+        _nextPackfile(PACKSTREAM_METADATA);
+        return currPackfile[PACKSTREAM_METADATA].get();
+    };
     while (cont) {
-        if (!currPackfile.get() || currPackfile->full()) {
-            currPackfile = packfiles->newPackfile();
+        _nextPackfile(PACKSTREAM_DATA);
+        cont = currPackfile[PACKSTREAM_DATA]->receive(bs, &index, metaPf);
+    }
+    index.sync();
+}
+
+/*
+ * Share the sealed packfiles of the local repository at srcRoot by hard
+ * linking them into this repository and index the objects that src still
+ * holds.  The objects of packfiles that are still being written are copied
+ * from src, so that afterwards this repository holds
+ * every object of src except the commits, which a pull must add.
+ */
+size_t
+LocalRepo::linkObjects(Repo *src, const string &srcRoot)
+{
+    string srcObjs = srcRoot + ORI_PATH_OBJS;
+    vector<packid_t> srcIds = PackfileManager::listPackfiles(srcObjs);
+    unordered_set<ObjectHash> srcObjects;
+    size_t linked = 0;
+    size_t indexed = 0;
+
+    // Commits are left to pull, which also records their snapshots
+    set<ObjectInfo> objs = src->listObjects();
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        if ((*it).type != ObjectInfo::Commit)
+            srcObjects.insert((*it).hash);
+    }
+    objs.clear();
+
+    sort(srcIds.begin(), srcIds.end());
+    for (size_t i = 0; i < srcIds.size(); i++) {
+        stringstream ss;
+        packid_t id;
+
+        ss << srcObjs << "pack" << srcIds[i] << ".pak";
+        if (!packfiles->linkPackfile(ss.str(), id)) {
+            // The source may have compacted it away, its objects are copied
+            if (!OriFile_Exists(ss.str()))
+                continue;
+            LOG("linkObjects: cannot link %s, falling back to copying",
+                ss.str().c_str());
+            break;
+        }
+
+        Packfile::sp pf = packfiles->getPackfile(id);
+        vector<IndexEntry> entries;
+        vector<IndexEntry> added;
+        if (!pf->readTrailer(entries)) {
+            // Unsealed or damaged, copy its objects instead
+            pf.reset();
+            packfiles->removePackfile(id);
+            continue;
+        }
+
+        for (size_t j = 0; j < entries.size(); j++) {
+            const ObjectHash &hash = entries[j].info.hash;
+            if (srcObjects.count(hash) == 0 || index.hasObject(hash))
+                continue;
+            srcObjects.erase(hash);
+            added.push_back(entries[j]);
         }
-        cont = currPackfile->receive(bs, &index);
+
+        if (added.empty()) {
+            pf.reset();
+            packfiles->removePackfile(id);
+            continue;
+        }
+
+        index.updateEntries(added);
+        linked++;
+        indexed += added.size();
     }
+    index.sync(true);
+
+    // Copy the rest, a pull stops at trees that are already present
+    ObjectHashVec rest;
+    for (unordered_set<ObjectHash>::iterator it = srcObjects.begin();
+         it != srcObjects.end();
+         it++) {
+        if (!index.hasObject(*it))
+            rest.push_back(*it);
+    }
+    for (size_t first = 0; first < rest.size(); first += LINK_COPY_BATCH) {
+        size_t last = min(rest.size(), first + LINK_COPY_BATCH);
+        bytestream::ap bs(src->getObjects(
+                ObjectHashVec(rest.begin() + first, rest.begin() + last)));
+        receive(bs.get());
+    }
+
+    LOG("linkObjects: shared %lu objects in %lu packfiles, copied %lu",
+        indexed, linked, rest.size());
+
+    return indexed;
 }
 
 bytestream *
@@ -1441,11 +1962,31 @@ LocalRepo::commitFromObjects(const ObjectHash &treeHash, Repo *objects,
 void
 LocalRepo::gc()
 {
-    // Commit all ongoing transactions
-    if (currTransaction.get()) {
-        currTransaction->commit();
-        currTransaction.reset();
+    // Commit all ongoing transactions and start new objects in fresh
+    // packfiles
+    _commitTransactions();
+    for (int i = 0; i < PACKSTREAM_MAX; i++)
+        _retirePackfile((PackStream)i);
+
+    // Deltas must not outlive their bases, their old copies are removed
+    // with the purged objects so that rebuildIndex cannot find them
+    set<packid_t> purgedPacks;
+    _expandDeltas(purged, purgedPacks);
+
+    // Drop purged objects from the index
+    vector<ObjectHash> purgeList(purged.begin(), purged.end());
+    for (size_t i = 0; i < purgeList.size(); i++) {
+        objectCache.invalidate(purgeList[i]);
+        if (index.hasObject(purgeList[i]))
+            purgedPacks.insert(index.getEntry(purgeList[i]).packfile);
     }
+    index.removeEntries(purgeList);
+
+    // Reclaim the space of dead objects, purged ones are always removed
+    PackfileCompactor compactor(packfiles.get(), &index);
+    size_t removed = compactor.run(purgedPacks);
+    if (removed > 0)
+        LOG("gc: compacted %lu packfiles", removed);
 
     // Compact the index
     index.rewrite();
@@ -1453,23 +1994,209 @@ LocalRepo::gc()
     // Compact the metadata log
     metadata.rewrite();
 
-    // Do purges
-    std::set<packid_t> purgePacks;
-    for (std::set<ObjectHash>::iterator it = purged.begin();
-            it != purged.end();
-            it++) {
-        const IndexEntry &ie = index.getEntry((*it));
-        purgePacks.insert(ie.packfile);
+    purged.clear();
+}
+
+/*
+ * Rewrite packfiles so that objects are stored in the order a checkout
+ * reads them: newest commits first, each tree followed by its files (and
+ * their chunks) before its subdirectories.  Objects that are not reachable
+ * from any commit are kept at the end of their stream.
+ *
+ * Only packfiles written since the last repack are rewritten, together with
+ * undersized packfiles of earlier repacks so that those do not accumulate.
+ * Nothing is done if every packfile is already ordered.
+ */
+size_t
+LocalRepo::repack()
+{
+    vector<vector<IndexEntry> > streams(PACKSTREAM_MAX);
+    set<ObjectHash> seen;
+    unordered_map<packid_t, pair<uint64_t, size_t> > live;
+    unordered_set<packid_t> srcs;
+    bool changed = false;
+
+    _commitTransactions();
+    for (int i = 0; i < PACKSTREAM_MAX; i++)
+        _retirePackfile((PackStream)i);
+
+    // Rewriting shared packfiles would only give this repository a copy
+    vector<packid_t> all = packfiles->getPackfileList();
+    vector<packid_t> ids;
+    for (size_t i = 0; i < all.size(); i++) {
+        if (packfiles->isShared(all[i])) {
+            LOG("repack: skipping shared packfile %u", all[i]);
+            continue;
+        }
+        ids.push_back(all[i]);
+    }
+
+    index.forEach([&](const IndexEntry &e) {
+        live[e.packfile].first += e.packed_size;
+        live[e.packfile].second++;
+    });
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (!packfiles->getAccess(ids[i]).ordered) {
+            srcs.insert(ids[i]);
+            changed = true;
+        }
+    }
+    if (!changed) {
+        LOG("repack: packfiles are already ordered");
+        return 0;
     }
+    for (size_t i = 0; i < ids.size(); i++) {
+        const pair<uint64_t, size_t> &l = live[ids[i]];
+        if (l.first < PACKFILE_MAXSIZE * REPACK_UNDERSIZED &&
+            l.second < PACKFILE_MAXOBJS * REPACK_UNDERSIZED)
+            srcs.insert(ids[i]);
+    }
+
+    auto visit = [&](const ObjectHash &hash) -> bool {
+        if (hash.isEmpty() || !seen.insert(hash).second)
+            return false;
+        if (!index.hasObject(hash))
+            return false;
+
+        IndexEntry e = index.getEntry(hash);
+        if (srcs.count(e.packfile))
+            streams[_getStream(e.info.type)].push_back(e);
+        return true;
+    };
+
+    function<void(const ObjectHash &)> visitTree;
+    visitTree = [&](const ObjectHash &treeHash) {
+        if (!visit(treeHash))
+            return;
+
+        Tree t = getTree(treeHash);
+        for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                it != t.tree.end();
+                it++) {
+            const TreeEntry &te = (*it).second;
+            if (te.type == TreeEntry::Blob) {
+                visit(te.hash);
+            } else if (te.type == TreeEntry::LargeBlob && visit(te.hash)) {
+                LargeBlob lb(this);
+                lb.fromBlob(getPayload(te.hash));
+                for (map<uint64_t, LBlobEntry>::iterator pit =
+                        lb.parts.begin();
+                        pit != lb.parts.end();
+                        pit++) {
+                    visit((*pit).second.hash);
+                }
+            }
+        }
+        for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                it != t.tree.end();
+                it++) {
+            if ((*it).second.type == TreeEntry::Tree)
+                visitTree((*it).second.hash);
+        }
+    };
 
-    for (std::set<packid_t>::iterator it = purgePacks.begin();
-            it != purgePacks.end();
+    vector<Commit> commits = listCommits();
+    for (vector<Commit>::reverse_iterator it = commits.rbegin();
+            it != commits.rend();
             it++) {
-        Packfile::sp pack = packfiles->getPackfile((*it));
-        pack->purge(purged, &index);
+        visit((*it).hash());
+        visitTree((*it).getTree());
     }
 
-    purged.clear();
+    index.forEach([&](const IndexEntry &e) {
+        if (srcs.count(e.packfile) && seen.count(e.info.hash) == 0)
+            streams[_getStream(e.info.type)].push_back(e);
+    });
+
+    PackfileCompactor compactor(packfiles.get(), &index);
+    size_t moved = compactor.repack(streams,
+            vector<packid_t>(srcs.begin(), srcs.end()));
+    LOG("repack: rewrote %lu objects from %lu packfiles", moved, srcs.size());
+
+    return moved;
+}
+
+/*
+ * Recompress packfiles that have not been read for PACKFILE_COLD_AGE with
+ * LZMA, trading decompression speed for space on data nobody reads.
+ */
+size_t
+LocalRepo::recompress()
+{
+    _commitTransactions();
+    for (int i = 0; i < PACKSTREAM_MAX; i++)
+        _retirePackfile((PackStream)i);
+
+    if (!zipstream::isSupported(ObjectInfo::ZIPALGO_LZMA)) {
+        LOG("recompress: LZMA support not compiled in");
+        return 0;
+    }
+
+    PackfileCompactor compactor(packfiles.get(), &index);
+    size_t n = compactor.recompress(time(NULL) - PACKFILE_COLD_AGE,
+                                    ObjectInfo::ZIPALGO_LZMA);
+    packfiles->saveAccess();
+    LOG("recompress: rewrote %lu packfiles", n);
+
+    return n;
+}
+
+/*
+ * Store whole every live object that is a delta against one of bases so
+ * that the bases can be removed.  The packfiles holding the old copies are
+ * added to srcPacks.
+ */
+void
+LocalRepo::_expandDeltas(const set<ObjectHash> &bases,
+                         set<packid_t> &srcPacks)
+{
+    vector<IndexEntry> deltas;
+    Packfile::sp pf;
+    PfTransaction::sp tr;
+    size_t expanded = 0;
+
+    if (bases.empty())
+        return;
+
+    index.forEach([&](const IndexEntry &e) {
+        if (e.info.isDelta() && bases.find(e.info.hash) == bases.end())
+            deltas.push_back(e);
+    });
+
+    for (size_t i = 0; i < deltas.size(); i++) {
+        const IndexEntry &ie = deltas[i];
+        Packfile::sp src = packfiles->getPackfile(ie.packfile);
+
+        if (bases.find(src->getDeltaBase(ie)) == bases.end())
+            continue;
+
+        bytestream::ap bs(src->getPayload(ie));
+        string payload = bs->readAll();
+
+        if (!tr.get() || tr->full()) {
+            if (tr.get()) {
+                tr->commit();
+                pf->seal();
+            }
+            pf = packfiles->newPackfile();
+            tr = pf->begin(&index, compressPool.get());
+            tr->replace = true;
+        }
+
+        ObjectInfo info = ie.info;
+        info.setDeltaDepth(0);
+        tr->addPayload(info, payload,
+                       compression.select(info.type, payload.size()));
+        srcPacks.insert(ie.packfile);
+        expanded++;
+    }
+
+    if (tr.get()) {
+        tr->commit();
+        pf->seal();
+    }
+    if (expanded > 0)
+        LOG("gc: stored %lu delta objects whole", expanded);
 }
 
 /*
@@ -1478,7 +2205,7 @@ LocalRepo::gc()
 bool
 LocalRepo::isObjectStored(const ObjectHash &objId)
 {
-    if (currTransaction.get() && currTransaction->has(objId)) {
+    if (_findTransaction(objId).get()) {
         return true;
     }
 
@@ -1615,14 +2342,14 @@ LocalRepo::purgeObject(const ObjectHash &objId)
 {
     ASSERT(metadata.getRefCount(objId) == 0);
 
-    if (currTransaction.get())
-        currTransaction.reset();
+    _commitTransactions();
 
     /*const IndexEntry &ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
     packfile->purge(objId);*/
 
     purged.insert(objId);
+    objectCache.invalidate(objId);
 
     return true;
 }
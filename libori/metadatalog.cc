@@ -24,8 +24,10 @@
 #include <errno.h>
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <memory>
+#include <algorithm>
 #include <unordered_map>
 
 #include <oriutil/debug.h>
@@ -34,8 +36,23 @@
 #include <oriutil/systemexception.h>
 #include <ori/metadatalog.h>
 
+#include "tuneables.h"
+
 using namespace std;
 
+/// Reference count checkpoint
+#define METADATALOG_TABLE_EXT ".tbl"
+/// Checkpoint records are [hash][refcount]
+#define METADATALOG_RECSIZE (ObjectHash::SIZE + 4)
+
+static refcount_t
+decodeCount(const uint8_t *rec)
+{
+    rec += ObjectHash::SIZE;
+    return (refcount_t)(((uint32_t)rec[0] << 24) | ((uint32_t)rec[1] << 16) |
+                        ((uint32_t)rec[2] << 8) | (uint32_t)rec[3]);
+}
+
 MdTransaction::MdTransaction(MetadataLog *log)
     : log(log)
 {
@@ -56,7 +73,7 @@ void MdTransaction::addRef(const ObjectHash &hash)
 void MdTransaction::decRef(const ObjectHash &hash)
 {
     counts[hash] -= 1;
-    ASSERT(log->refcounts[hash] + counts[hash] >= 0);
+    ASSERT(log->getRefCount(hash) + counts[hash] >= 0);
 }
 
 void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
@@ -72,13 +89,15 @@ void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
  */
 
 MetadataLog::MetadataLog()
-    : fd(-1)
+    : fd(-1), durability(DurabilityPolicy::getDefault()), generation(0),
+      tailEntries(0)
 {
 }
 
 MetadataLog::~MetadataLog()
 {
     if (fd != -1) {
+        durability->release(fd);
         ::close(fd);
     }
 }
@@ -87,6 +106,13 @@ MetadataLog::~MetadataLog()
 void
 MetadataLog::open(const string &filename)
 {
+    // Map the checkpoint, throws on corruption
+    snapshot.open(filename + METADATALOG_TABLE_EXT);
+    const uint8_t *genRec = snapshot.lookup(ObjectHash());
+    generation = genRec != NULL ? decodeCount(genRec) : 0;
+    // Logs written before the first checkpoint carry no generation
+    refcount_t logGeneration = 0;
+
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
     if (fd < 0) {
         WARNING("MetadataLog open failed!");
@@ -137,8 +163,13 @@ MetadataLog::open(const string &filename)
             ss.readHash(hash);
 
             refcount_t refcount = ss.readInt32();
-            refcounts[hash] = refcount;
+            if (hash.isEmpty())
+                logGeneration = refcount;
+            else if (logGeneration == generation)
+                refcounts[hash] = refcount;
         }
+        if (logGeneration == generation)
+            tailEntries += num_rc;
 
         //fprintf(stderr, "Reading %u metadata entries\n", num_md);
         for (size_t i = 0; i < num_md; i++) {
@@ -154,43 +185,167 @@ MetadataLog::open(const string &filename)
             }
         }
     }
+
+    // Delete temporary files of an interrupted checkpoint
+    if (OriFile_Exists(filename + ".tmp"))
+        OriFile_Delete(filename + ".tmp");
+    if (OriFile_Exists(filename + METADATALOG_TABLE_EXT ".tmp"))
+        OriFile_Delete(filename + METADATALOG_TABLE_EXT ".tmp");
+
+    // We crashed between replacing the table and the log, or lost the log
+    if (logGeneration != generation) {
+        if (readSoFar != 0)
+            WARNING("Metadata log is older than its checkpoint, "
+                    "discarding its reference counts");
+        refcounts.clear();
+        tailEntries = 0;
+        rewrite();
+    }
 }
 
 void
 MetadataLog::sync()
 {
-    ::fsync(fd);
+    durability->commit(fd);
+}
+
+void
+MetadataLog::setDurability(DurabilityPolicy::sp policy)
+{
+    durability = policy;
 }
 
+/*
+ * Checkpoint the reference counts into a new sorted table of the next
+ * generation and restart the log with the generation and the object
+ * metadata.  The table is replaced first, if we crash before the log is
+ * replaced the old log is only used for its metadata.
+ *
+ * When refs is given it replaces all counts (used when rebuilding them).
+ */
 void
 MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
 {
-    if (refs == NULL)
-        refs = &refcounts;
     if (data == NULL)
         data = &metadata;
 
+    _writeSnapshot(refs == NULL ? refcounts : *refs, refs == NULL,
+                   generation + 1);
+    generation++;
+
     string tmpFilename = filename + ".tmp";
-    int newFd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (newFd < 0) {
-        perror("MetadataLog::rewrite open");
-        throw SystemException();
+    int newFd = -1;
+    try {
+        newFd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT | O_TRUNC |
+                       O_APPEND, 0644);
+        if (newFd < 0) {
+            perror("MetadataLog::rewrite open");
+            throw SystemException();
+        }
+
+        _writeLog(newFd, _encodeTransaction(_generationMarker(generation),
+                                            *data));
+        DurabilityPolicy::syncFd(newFd);
+
+        int status = OriFile_Rename(tmpFilename, filename);
+        if (status < 0)
+            throw SystemException(-status);
+    } catch (SystemException &e) {
+        if (newFd >= 0) {
+            ::close(newFd);
+            OriFile_Delete(tmpFilename);
+        }
+        // Counts appended to the old log from now on belong to the new
+        // table
+        _writeLog(fd, _encodeTransaction(_generationMarker(generation),
+                                         MetadataMap()));
+        durability->written(fd);
+        if (refs != NULL)
+            refcounts.clear();
+        tailEntries = refcounts.size();
+        throw;
     }
 
-    int oldFd = fd;
+    durability->release(fd);
+    ::close(fd);
     fd = newFd;
 
-    ftruncate(fd, 0);
-    lseek(fd, 0, SEEK_SET);
-    MdTransaction::sp tr = begin();
-    tr->counts = *refs;
-    tr->metadata = *data;
-
+    if (data != &metadata)
+        metadata = *data;
     refcounts.clear();
-    metadata.clear();
+    tailEntries = 0;
+}
+
+/*
+ * Write a new checkpoint table with the counts in refs, merged with the
+ * current checkpoint if merge is set.  Objects with no references are
+ * dropped.
+ */
+void
+MetadataLog::_writeSnapshot(const RefcountMap &refs, bool merge,
+                            refcount_t newGeneration)
+{
+    vector<pair<ObjectHash, refcount_t> > updates(refs.begin(), refs.end());
+    string path = filename + METADATALOG_TABLE_EXT;
+
+    sort(updates.begin(), updates.end());
+    if (!updates.empty() && updates[0].first.isEmpty())
+        updates.erase(updates.begin());
+
+    SortedTableWriter writer(path, METADATALOG_RECSIZE, 0);
+    uint64_t i = 0;
+    uint64_t tableSize = merge ? snapshot.size() : 0;
+    size_t j = 0;
+
+    // The empty hash sorts first
+    {
+        strwstream ss;
+        ss.writeHash(ObjectHash());
+        ss.writeInt32(newGeneration);
+        writer.append(ss.str());
+    }
+    if (i < tableSize && snapshot.key(i).isEmpty())
+        i++;
+
+    while (i < tableSize || j < updates.size()) {
+        if (j == updates.size() ||
+            (i < tableSize && snapshot.key(i) < updates[j].first)) {
+            writer.append(snapshot.record(i++));
+            continue;
+        }
+
+        if (i < tableSize && snapshot.key(i) == updates[j].first)
+            i++; // Log entry supersedes the checkpoint
+        if (updates[j].second != 0) {
+            strwstream ss;
+            ss.writeHash(updates[j].first);
+            ss.writeInt32(updates[j].second);
+            writer.append(ss.str());
+        }
+        j++;
+    }
+
+    writer.commit();
+    snapshot.open(path);
+}
 
-    OriFile_Rename(tmpFilename, filename);
-    ::close(oldFd);
+void
+MetadataLog::_writeLog(int logFd, const string &buf)
+{
+    uint32_t nbytes = buf.size();
+    string rec((const char *)&nbytes, sizeof(uint32_t));
+    size_t off = 0;
+
+    rec += buf;
+    while (off < rec.size()) {
+        ssize_t status = ::write(logFd, rec.data() + off, rec.size() - off);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        off += status;
+    }
 }
 
 void
@@ -207,9 +362,17 @@ refcount_t
 MetadataLog::getRefCount(const ObjectHash &hash) const
 {
     RefcountMap::const_iterator it = refcounts.find(hash);
-    if (it == refcounts.end())
+    if (it != refcounts.end())
+        return (*it).second;
+
+    if (hash.isEmpty())
         return 0;
-    return (*it).second;
+
+    const uint8_t *rec = snapshot.lookup(hash);
+    if (rec == NULL)
+        return 0;
+
+    return decodeCount(rec);
 }
 
 string
@@ -239,29 +402,83 @@ MetadataLog::commit(MdTransaction *tr)
     
     DLOG("Committing %u refcount changes, %u metadata entries", num_rc, num_md);
 
-    //write(fd, &num, sizeof(uint32_t));
-
-    strwstream ws(36*num_rc + 8);
-    ws.writeUInt32(num_rc);
-    ws.writeUInt32(num_md);
-
+    // The log holds the final counts
+    RefcountMap finalCounts;
     for (RefcountMap::iterator it = tr->counts.begin();
             it != tr->counts.end();
             it++) {
         const ObjectHash &hash = (*it).first;
         ASSERT(!hash.isEmpty());
 
-        ws.writeHash(hash);
-        refcount_t final_count = refcounts[hash] + (*it).second;
+        refcount_t final_count = getRefCount(hash) + (*it).second;
         ASSERT(final_count >= 0);
-
-        refcounts[hash] = final_count;
-        ws.writeInt32(final_count);
+        finalCounts[hash] = final_count;
     }
 
+    _writeLog(fd, _encodeTransaction(finalCounts, tr->metadata));
+    durability->written(fd);
+
+    for (RefcountMap::iterator it = finalCounts.begin();
+            it != finalCounts.end();
+            it++) {
+        refcounts[(*it).first] = (*it).second;
+    }
     for (MetadataMap::iterator it = tr->metadata.begin();
             it != tr->metadata.end();
             it++) {
+        for (ObjMetadata::iterator mit =
+                (*it).second.begin();
+                mit != (*it).second.end();
+                mit++) {
+            metadata[(*it).first][(*mit).first] = (*mit).second;
+        }
+    }
+    tailEntries += num_rc;
+
+    tr->counts.clear();
+    tr->metadata.clear();
+
+    if (tailEntries >= METADATALOG_CHECKPOINT_ENTRIES) {
+        DLOG("Checkpointing the metadata log (%lu entries)", tailEntries);
+        try {
+            rewrite();
+        } catch (SystemException &e) {
+            // The log is still complete, retry on the next commit
+            WARNING("Could not checkpoint the metadata log: %s", e.what());
+        }
+    }
+}
+
+RefcountMap
+MetadataLog::_generationMarker(refcount_t gen)
+{
+    RefcountMap marker;
+
+    marker[ObjectHash()] = gen;
+    return marker;
+}
+
+string
+MetadataLog::_encodeTransaction(const RefcountMap &counts,
+                                const MetadataMap &data)
+{
+    uint32_t num_rc = counts.size();
+    uint32_t num_md = data.size();
+
+    strwstream ws(36*num_rc + 8);
+    ws.writeUInt32(num_rc);
+    ws.writeUInt32(num_md);
+
+    for (RefcountMap::const_iterator it = counts.begin();
+            it != counts.end();
+            it++) {
+        ws.writeHash((*it).first);
+        ws.writeInt32((*it).second);
+    }
+
+    for (MetadataMap::const_iterator it = data.begin();
+            it != data.end();
+            it++) {
         const ObjectHash &hash = (*it).first;
         ASSERT(!hash.isEmpty());
 
@@ -269,26 +486,16 @@ MetadataLog::commit(MdTransaction *tr)
         uint32_t num_mde = (*it).second.size();
         ws.writeUInt32(num_mde);
 
-        for (ObjMetadata::iterator mit =
+        for (ObjMetadata::const_iterator mit =
                 (*it).second.begin();
                 mit != (*it).second.end();
                 mit++) {
-            metadata[hash][(*mit).first] = (*mit).second;
             ws.writePStr((*mit).first);
             ws.writePStr((*mit).second);
         }
     }
 
-    //ObjectHash commitHash = Util_HashString(ws.str());
-    //ws.write(commitHash.data(), commitHash.size());
-
-    const string &str = ws.str();
-    uint32_t nbytes = str.size();
-    write(fd, &nbytes, sizeof(uint32_t));
-    write(fd, str.data(), str.size());
-
-    tr->counts.clear();
-    tr->metadata.clear();
+    return ws.str();
 }
 
 void
@@ -297,6 +504,15 @@ MetadataLog::dumpRefs() const
     RefcountMap::const_iterator it;
 
     cout << "Reference Counts:" << endl;
+    for (uint64_t i = 0; i < snapshot.size(); i++)
+    {
+        ObjectHash hash = snapshot.key(i);
+
+        if (hash.isEmpty() || refcounts.find(hash) != refcounts.end())
+            continue;
+
+        cout << hash.hex() << ": " << getRefCount(hash) << endl;
+    }
     for (it = refcounts.begin(); it != refcounts.end(); it++)
     {
         cout << (*it).first.hex() << ": " << (*it).second << endl;
@@ -46,6 +46,13 @@
 
 using namespace std;
 
+bytestream *Object::getPayloadStreamAt(size_t offset) {
+    bytestream *bs = getPayloadStream();
+    if (bs != NULL)
+        bs->skip(offset);
+    return bs;
+}
+
 std::string Object::getPayload() {
     bytestream::ap bs(getPayloadStream());
     return bs->readAll();
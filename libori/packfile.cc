@@ -18,8 +18,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <string>
 #include <set>
@@ -30,6 +33,9 @@
 #include <algorithm>
 #include <iostream>
 #include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include "tuneables.h"
 
@@ -38,13 +44,23 @@
 #include <oriutil/orifile.h>
 #include <oriutil/scan.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/runtimeexception.h>
+#include <oriutil/oricrypt.h>
 #include <ori/packfile.h>
 #include <ori/index.h>
 
+extern "C" {
+#include <libdiffmerge/delta.h>
+};
+
 using namespace std;
 
-PfTransaction::PfTransaction(Packfile *pf, Index *idx)
-    : totalSize(0), committed(false), pf(pf), idx(idx)
+#define PACKFILE_TRAILER_MAGIC "ORIT"
+
+PfTransaction::PfTransaction(Packfile *pf, Index *idx, ThreadPool *pool)
+    : totalSize(0), committed(false), replace(false), pf(pf), idx(idx),
+      pool(pool), lock(), doneCV(), outstanding(0), inflight(),
+      deltaPayloads()
 {
 }
 
@@ -56,81 +72,148 @@ PfTransaction::~PfTransaction()
 
 bool PfTransaction::full() const
 {
+    unique_lock<mutex> l(lock);
+
     return infos.size() >= PACKFILE_MAXOBJS ||
         totalSize >= PACKFILE_MAXSIZE;
 }
 
-float
-PfTransaction::_checkCompressionRatio(const string &payload)
+/*
+ * Compress the payload with algo if it looks compressible.  Sets the
+ * algorithm in info and returns true if out holds the compressed payload.
+ */
+bool
+PfTransaction::compress(ObjectInfo &info, const string &payload,
+                        ObjectInfo::ZipAlgo algo, string &out)
 {
-    return 1.5f;
+    if (algo != ObjectInfo::ZIPALGO_NONE &&
+        payload.size() > ZIP_MINIMUM_SIZE) {
+        zipstream ls(new strstream(payload), COMPRESS, 0, algo);
+        uint8_t buf[COMPCHECK_BYTES];
+        size_t compSize = ls.read(buf, COMPCHECK_BYTES);
+        if (ls.error()) {
+            WARNING("Compression failed: %s", ls.error());
+        } else if (ls.inputConsumed() > 0 &&
+                   (float)compSize / (float)ls.inputConsumed()
+                        <= COMPCHECK_RATIO) {
+            // Okay to compress
+            info.setAlgo(algo);
+            // Reuse compression test data
+            strwstream ss(string((char*)buf, compSize));
+            ss.copyFrom(&ls);
+
+            out = ss.str();
+            return true;
+        }
+    }
+
+    info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    return false;
 }
 
 void
-PfTransaction::addPayload(ObjectInfo info, const string &payload)
+PfTransaction::addPayload(ObjectInfo info, const string &payload,
+                          ObjectInfo::ZipAlgo algo)
 {
     if (committed) {
         throw runtime_error("Adding payload to already-committed transaction!");
     }
 
 #if DEBUG
-    for (size_t i = 0; i < infos.size(); i++) {
-        if (infos[i].hash == info.hash) {
-            fprintf(stderr, "WARNING: duplicate addPayload %s!\n",
-                    info.hash.hex().c_str());
-            info.print(cerr);
+    {
+        unique_lock<mutex> l(lock);
+        for (size_t i = 0; i < infos.size(); i++) {
+            if (infos[i].hash == info.hash) {
+                fprintf(stderr, "WARNING: duplicate addPayload %s!\n",
+                        info.hash.hex().c_str());
+                info.print(cerr);
+            }
         }
     }
 #endif
 
-    ObjectInfo::ZipAlgo defaultAlgo = ObjectInfo::ZIPALGO_FASTLZ;
-    switch (defaultAlgo) {
-        case ObjectInfo::ZIPALGO_NONE:
-        {
-            info.setAlgo(defaultAlgo);
+    if (pool == NULL) {
+        string out;
+        if (compress(info, payload, algo, out)) {
+            payloads.push_back(out);
+        } else {
             payloads.push_back(payload);
-            totalSize += payload.size();
-            break;
         }
-        case ObjectInfo::ZIPALGO_FASTLZ:
-        {
-            zipstream ls(new strstream(payload), COMPRESS);
-            uint8_t buf[COMPCHECK_BYTES];
-            size_t compSize = 0;
-            bool compress = false;
-
-            if (payload.size() > ZIP_MINIMUM_SIZE) {
-                compSize = ls.read(buf, COMPCHECK_BYTES);
-                float ratio = (float)compSize / (float)ls.inputConsumed();
-
-                if (ratio <= COMPCHECK_RATIO) {
-                    compress = true;
-                }
-            }
+        totalSize += payloads.back().size();
+        infos.push_back(info);
+        hashToIx[info.hash] = infos.size()-1;
+        return;
+    }
 
-            if (compress) {
-                // Okay to compress
-                info.setAlgo(defaultAlgo);
-                // Reuse compression test data
-                strwstream ss(string((char*)buf, compSize));
-                ss.copyFrom(&ls);
-
-                payloads.push_back(ss.str());
-                totalSize += ss.str().size();
-            } else {
-                info.setAlgo(ObjectInfo::ZIPALGO_NONE);
-                payloads.push_back(payload);
-                totalSize += payload.size();
-            }
-            break;
-        }
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+    // Store the object uncompressed until the job completes
+    shared_ptr<string> raw(new string(payload));
+    size_t ix;
+    {
+        unique_lock<mutex> l(lock);
+
+        ix = infos.size();
+        ObjectInfo uncompressed = info;
+        uncompressed.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        infos.push_back(uncompressed);
+        payloads.push_back(string());
+        inflight[ix] = raw;
+        totalSize += raw->size();
+        outstanding++;
+    }
+    hashToIx[info.hash] = ix;
+
+    pool->enqueue(bind(&PfTransaction::_compressJob, this, ix, info, algo,
+                       raw));
+}
+
+void
+PfTransaction::addDelta(ObjectInfo info, const string &payload,
+                        const string &delta, ObjectInfo::ZipAlgo algo)
+{
+    ASSERT(info.isDelta());
+    ASSERT(info.payload_size == payload.size());
+    // The stored size of framed codecs is self describing, plain FastLZ
+    // needs the decompressed size which is not known for a delta
+    ASSERT(algo != ObjectInfo::ZIPALGO_FASTLZ);
+
+    {
+        unique_lock<mutex> l(lock);
+        deltaPayloads[infos.size()] = payload;
+    }
+
+    addPayload(info, delta, algo);
+}
+
+void
+PfTransaction::_compressJob(size_t ix, ObjectInfo info,
+                            ObjectInfo::ZipAlgo algo, shared_ptr<string> raw)
+{
+    string out;
+    bool compressed;
+
+    try {
+        compressed = compress(info, *raw, algo, out);
+    } catch (exception &e) {
+        WARNING("Compression failed: %s", e.what());
+        info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        compressed = false;
     }
 
-    infos.push_back(info);
-    hashToIx[info.hash] = infos.size()-1;
+    unique_lock<mutex> l(lock);
+
+    if (compressed) {
+        payloads[ix].swap(out);
+        totalSize -= raw->size();
+        totalSize += payloads[ix].size();
+    } else {
+        payloads[ix].swap(*raw);
+    }
+    infos[ix] = info;
+    inflight.erase(ix);
+
+    outstanding--;
+    if (outstanding == 0)
+        doneCV.notify_all();
 }
 
 bool PfTransaction::has(const ObjectHash &hash) const
@@ -138,8 +221,49 @@ bool PfTransaction::has(const ObjectHash &hash) const
     return hashToIx.find(hash) != hashToIx.end();
 }
 
+ObjectInfo
+PfTransaction::getInfo(size_t ix) const
+{
+    unique_lock<mutex> l(lock);
+
+    return infos[ix];
+}
+
+bytestream *
+PfTransaction::getPayloadStream(size_t ix) const
+{
+    unique_lock<mutex> l(lock);
+
+    unordered_map<size_t, string>::const_iterator dit = deltaPayloads.find(ix);
+    if (dit != deltaPayloads.end())
+        return new strstream((*dit).second);
+
+    unordered_map<size_t, shared_ptr<string> >::const_iterator it;
+    it = inflight.find(ix);
+    if (it != inflight.end())
+        return new strstream(*(*it).second);
+
+    ObjectInfo::ZipAlgo algo = infos[ix].getAlgo();
+    if (algo == ObjectInfo::ZIPALGO_NONE)
+        return new strstream(payloads[ix]);
+    return new zipstream(new strstream(payloads[ix]), DECOMPRESS,
+                         infos[ix].payload_size, algo);
+}
+
+void
+PfTransaction::wait()
+{
+    unique_lock<mutex> l(lock);
+
+    while (outstanding != 0) {
+        doneCV.wait(l);
+    }
+}
+
 void PfTransaction::commit()
 {
+    // Objects are written in the order they were added
+    wait();
     pf->commit(this, idx);
     if (!committed) {
         throw runtime_error("Unknown error committing PfTransaction");
@@ -147,12 +271,33 @@ void PfTransaction::commit()
 }
 
 
-// stored length + offset
-#define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-Packfile::Packfile(const string &filename, packid_t id)
-    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0)
+/*
+ * A read-only mapping of a packfile.  Mappings are reference counted so that
+ * spans handed out remain valid after the packfile switches to a new one.
+ */
+class PackfileMap
 {
+public:
+    PackfileMap(uint8_t *addr, size_t len) : addr(addr), len(len) { }
+    ~PackfileMap() { munmap(addr, len); }
+    uint8_t *addr;
+    size_t len;
+};
+
+Packfile::Packfile(const string &filename, packid_t id,
+                   DurabilityPolicy::sp durability, PackfileManager *mgr)
+    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0),
+      sealed(false), dataEnd(0), writtenFrom(0), durability(durability),
+      mgr(mgr), reads(),
+      mapLock(), mapping()
+{
+    if (mgr != NULL)
+        reads = mgr->_getReads(id);
+
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
         perror("Packfile open");
@@ -166,26 +311,139 @@ Packfile::Packfile(const string &filename, packid_t id)
     }
 
     fileSize = sb.st_size;
-    
-    // TODO: check for corruption?
+    dataEnd = fileSize;
+    writtenFrom = fileSize;
+
+    // The trailer is checked when it is read
+    _readFooter();
 }
 
 Packfile::~Packfile()
 {
-    if (fd > 0)
+    if (fd > 0) {
+        durability->release(fd);
         close(fd);
+    }
+}
+
+packid_t
+Packfile::getPackfileID() const
+{
+    return packid;
+}
+
+size_t
+Packfile::getFileSize() const
+{
+    return fileSize;
 }
 
 bool Packfile::full() const
 {
-    return numObjects >= PACKFILE_MAXOBJS ||
+    return sealed || numObjects >= PACKFILE_MAXOBJS ||
         fileSize >= PACKFILE_MAXSIZE;
 }
 
+bool
+Packfile::isSealed() const
+{
+    return sealed;
+}
+
+/*
+ * Write the trailer.  The headers are collected by walking the groups, which
+ * only reads the group headers.
+ */
+void
+Packfile::seal()
+{
+    vector<IndexEntry> entries;
+    strwstream ss;
+
+    ASSERT(!sealed);
+    if (fileSize == 0)
+        return;
+
+    if (_scanGroups(entries) != fileSize) {
+        WARNING("Not sealing packfile %u, it has a torn group", packid);
+        return;
+    }
+
+    sort(entries.begin(), entries.end(),
+         [](const IndexEntry &a, const IndexEntry &b) {
+            return a.info.hash < b.info.hash;
+         });
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        ss.write(entries[i].info.toString().data(), ObjectInfo::SIZE);
+        ss.writeUInt32(entries[i].packed_size);
+        ss.writeUInt32(entries[i].offset);
+    }
+    ss.writeUInt32(entries.size());
+    ss.writeUInt32(fileSize);
+    ss.writeUInt32(OriCrypt_CRC32C((const uint8_t *)ss.str().data(),
+                                   ss.str().size()));
+    ss.write(PACKFILE_TRAILER_MAGIC, 4);
+
+    vector<struct iovec> iov(1);
+    iov[0].iov_base = (void *)ss.str().data();
+    iov[0].iov_len = ss.str().size();
+    lseek(fd, 0, SEEK_END);
+    _writeVec(iov);
+    durability->commit(fd, DurabilityPolicy::DURABILITY_DATA);
+
+    dataEnd = fileSize;
+    fileSize += ss.str().size();
+    numObjects = entries.size();
+    sealed = true;
+
+    // The scan faulted pages in through the mapping, which keeps them
+    // cached until they are unmapped
+    if (_isStreaming()) {
+        unique_lock<mutex> l(mapLock);
+        if (mapping.get())
+            madvise(mapping->addr, mapping->len, MADV_DONTNEED);
+        l.unlock();
+        _dropWritten();
+        OriFile_DropCache(fd, 0, fileSize);
+    }
+}
+
+/*
+ * Recognize a sealed packfile by its footer.
+ */
+void
+Packfile::_readFooter()
+{
+    uint8_t footer[PACKFILE_FOOTER_SIZE];
+
+    if (fileSize < PACKFILE_FOOTER_SIZE)
+        return;
+
+    ssize_t status = pread(fd, footer, PACKFILE_FOOTER_SIZE,
+                           fileSize - PACKFILE_FOOTER_SIZE);
+    if (status != PACKFILE_FOOTER_SIZE)
+        throw SystemException();
+    if (memcmp(footer + 12, PACKFILE_TRAILER_MAGIC, 4) != 0)
+        return;
+
+    strstream ss(string((const char *)footer, PACKFILE_FOOTER_SIZE));
+    uint64_t count = ss.readUInt32();
+    uint64_t end = ss.readUInt32();
+    if (end + count * ENTRYSIZE + PACKFILE_FOOTER_SIZE != fileSize) {
+        WARNING("Packfile %u has an invalid trailer", packid);
+        return;
+    }
+
+    numObjects = count;
+    dataEnd = end;
+    sealed = true;
+}
+
 PfTransaction::sp
-Packfile::begin(Index *idx)
+Packfile::begin(Index *idx, ThreadPool *pool)
 {
-    return PfTransaction::sp(new PfTransaction(this, idx));
+    return PfTransaction::sp(new PfTransaction(this, idx, pool));
 }
 
 void
@@ -194,6 +452,11 @@ Packfile::commit(PfTransaction *t, Index *idx)
     if (t->infos.size() != t->payloads.size()) {
         throw runtime_error("PfTransaction infos.size() != payloads.size())");
     }
+    ASSERT(!sealed);
+    if (t->infos.size() == 0) {
+        t->committed = true;
+        return;
+    }
 
     lseek(fd, 0, SEEK_END);
     vector<offset_t> offsets;
@@ -213,11 +476,24 @@ Packfile::commit(PfTransaction *t, Index *idx)
         off += t->payloads[i].size();
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
+    // Write the headers and all payloads with as few syscalls as possible
+    vector<struct iovec> iov;
+    struct iovec v;
+    iov.reserve(t->payloads.size() + 1);
+    v.iov_base = (void *)headers_ss.str().data();
+    v.iov_len = headers_ss.str().size();
+    iov.push_back(v);
+    for (size_t i = 0; i < t->payloads.size(); i++) {
+        v.iov_base = (void *)t->payloads[i].data();
+        v.iov_len = t->payloads[i].size();
+        iov.push_back(v);
+    }
+    _writeVec(iov);
     fileSize += headers_ss.str().size();
 
+    vector<IndexEntry> entries;
+    entries.reserve(t->payloads.size());
     for (size_t i = 0; i < t->payloads.size(); i++) {
-        write(fd, t->payloads[i].data(), t->payloads[i].size());
         fileSize += t->payloads[i].size();
         numObjects++;
 
@@ -227,128 +503,642 @@ Packfile::commit(PfTransaction *t, Index *idx)
         ie.packed_size = t->payloads[i].size();
         ie.packfile = packid;
 
-        idx->updateEntry(ie.info.hash, ie);
+        entries.push_back(ie);
     }
 
-    ::fsync(fd);
+    // Make the data durable before the index refers to it
+    durability->commit(fd, DurabilityPolicy::DURABILITY_DATA);
+    _dropWritten();
+    if (t->replace)
+        idx->relocateEntries(entries);
+    else
+        idx->updateEntries(entries);
     t->committed = true;
 }
 
+/*
+ * Append the buffers to the packfile, handling short writes.
+ */
+void
+Packfile::_writeVec(vector<struct iovec> &iov)
+{
+    size_t i = 0;
+    size_t total = 0;
+
+    for (size_t j = 0; j < iov.size(); j++)
+        total += iov[j].iov_len;
+
+    while (i < iov.size()) {
+        int cnt = (int)MIN(iov.size() - i, (size_t)IOV_MAX);
+        ssize_t status = ::writev(fd, &iov[i], cnt);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Packfile writev");
+            throw SystemException();
+        }
+        durability->written(fd, DurabilityPolicy::DURABILITY_DATA);
+
+        // Skip completed buffers and adjust a partially written one
+        size_t done = status;
+        while (i < iov.size() && done >= iov[i].iov_len) {
+            done -= iov[i].iov_len;
+            i++;
+        }
+        if (done > 0) {
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + done;
+            iov[i].iov_len -= done;
+        }
+    }
+
+    // Bulk imports should not push the working set out of the cache, the
+    // pages are dropped once the commit has waited for them
+    if (_isStreaming()) {
+        off_t end = lseek(fd, 0, SEEK_CUR);
+        OriFile_StartWriteback(fd, end - total, total);
+    }
+}
+
+/*
+ * Packfiles follow the ingest mode of the repository that opened them.
+ */
+bool
+Packfile::_isStreaming() const
+{
+    return mgr != NULL && mgr->streaming;
+}
+
+/*
+ * Drop the pages appended since the last call from the page cache in
+ * streaming mode, waiting for their writeback to complete.
+ */
+void
+Packfile::_dropWritten()
+{
+    if (!_isStreaming())
+        return;
+
+    if (fileSize > writtenFrom)
+        OriFile_DropCache(fd, writtenFrom, fileSize - writtenFrom, true);
+    writtenFrom = fileSize;
+}
+
+/*
+ * Returns a mapping that covers at least the first end bytes of the file or
+ * NULL if the file cannot be mapped.  The mapping is rounded up so that a
+ * growing packfile is not remapped on every commit, the pages past the end
+ * of the file are never touched.
+ */
+shared_ptr<PackfileMap>
+Packfile::_getMap(size_t end)
+{
+    unique_lock<mutex> l(mapLock);
+
+    if (mapping.get() && mapping->len >= end)
+        return mapping;
+    if (end == 0 || end > fileSize)
+        return shared_ptr<PackfileMap>();
+
+    size_t len = (fileSize + PACKFILE_MAP_GROWTH - 1) / PACKFILE_MAP_GROWTH *
+                 PACKFILE_MAP_GROWTH;
+    void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        WARNING("Packfile mmap failed: %s", strerror(errno));
+        return shared_ptr<PackfileMap>();
+    }
+
+    mapping.reset(new PackfileMap((uint8_t *)addr, len));
+    return mapping;
+}
+
+/*
+ * Stream over stored bytes, read from the mapping when possible.
+ */
+bytestream *
+Packfile::_getStored(offset_t off, size_t len)
+{
+    shared_ptr<PackfileMap> m = _getMap(off + len);
+
+    if (m.get())
+        return new memstream(m->addr + off, len, m);
+    return new fdstream(fd, off, len);
+}
+
+bool
+Packfile::getSpan(const IndexEntry &entry, PayloadSpan &span)
+{
+    ASSERT(entry.packfile == packid);
+    _recordRead();
+
+    if (entry.info.getAlgo() != ObjectInfo::ZIPALGO_NONE ||
+        entry.info.isDelta())
+        return false;
+
+    if (entry.packed_size == 0) {
+        span.data = NULL;
+        span.len = 0;
+        span.owner.reset();
+        return true;
+    }
+
+    shared_ptr<PackfileMap> m = _getMap(entry.offset + entry.packed_size);
+    if (!m.get())
+        return false;
+
+    span.data = m->addr + entry.offset;
+    span.len = entry.packed_size;
+    span.owner = m;
+    return true;
+}
+
 bytestream *Packfile::getPayload(const IndexEntry &entry)
 {
     ASSERT(entry.packfile == packid);
-    bytestream *stored = new fdstream(fd, entry.offset, entry.packed_size);
+    _recordRead();
+    if (entry.info.isDelta())
+        return _getDeltaPayload(entry);
+
+    bytestream *stored = _getStored(entry.offset, entry.packed_size);
    
-    switch (entry.info.getAlgo()) {
-        case ObjectInfo::ZIPALGO_NONE:
-            return stored;
-        case ObjectInfo::ZIPALGO_FASTLZ:
-            return new zipstream(stored, DECOMPRESS, entry.info.payload_size);
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
-    }
-    return 0;
+    ObjectInfo::ZipAlgo algo = entry.info.getAlgo();
+    if (algo == ObjectInfo::ZIPALGO_NONE)
+        return stored;
+    return new zipstream(stored, DECOMPRESS, entry.info.payload_size, algo);
 }
 
-bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
+bytestream *Packfile::getPayload(const IndexEntry &entry, size_t offset)
 {
-    PfTransaction::sp tr = begin(idx);
-    
-    // Read the current contents
-    lseek(fd, 0, SEEK_SET);
-    vector<uint32_t> storedSizes;
+    ASSERT(entry.packfile == packid);
 
-    fdstream fs(fd, 0);
-    while (!fs.ended()) {
-        string payload;
-        set<size_t> skip;
+    size_t storedOff = 0;
+    size_t frameOff = 0;
+    if (entry.info.getAlgo() == ObjectInfo::ZIPALGO_FASTLZ_FRAMED &&
+        !entry.info.isDelta() && offset > 0 && entry.packed_size >= 8) {
+        string tail(8, '\0');
+        off_t end = entry.offset + entry.packed_size;
+        if (pread(fd, &tail[0], 8, end - 8) != 8)
+            throw SystemException();
 
-        numobjs_t num;
-        try {
-            num = fs.readUInt32();
+        size_t len = zipstream::trailerSize(tail);
+        if (len == 0 || len > entry.packed_size) {
+            WARNING("Object %s has a corrupt frame table",
+                    entry.info.hash.hex().c_str());
+            throw RuntimeException(ORIEC_INDEXCORRUPT, "Corrupt frame table");
         }
-        catch (ios_base::failure &e) {
-            break;
+        tail.resize(len);
+        if (pread(fd, &tail[0], len, end - len) != (ssize_t)len)
+            throw SystemException();
+
+        if (!zipstream::findFrame(tail, offset, storedOff, frameOff)) {
+            storedOff = 0;
+            frameOff = 0;
         }
+    }
 
-        storedSizes.resize(num);
+    bytestream *bs;
+    if (frameOff > 0) {
+        _recordRead();
+        bytestream *stored = _getStored(entry.offset + storedOff,
+                                        entry.packed_size - storedOff);
+        bs = new zipstream(stored, DECOMPRESS,
+                           entry.info.payload_size - frameOff,
+                           ObjectInfo::ZIPALGO_FASTLZ_FRAMED);
+    } else {
+        bs = getPayload(entry);
+    }
 
-        // Read headers
-        for (size_t i = 0; i < num; i++) {
-            ObjectInfo info;
-            fs.readInfo(info);
-            uint32_t ssize = fs.readUInt32();
-            offset_t off = fs.readUInt32();
-            (void)off;
+    // Errors are left on the stream for the reader
+    bs->skip(offset - frameOff);
+
+    return bs;
+}
+
+bytestream *
+Packfile::getStoredPayload(const IndexEntry &entry)
+{
+    ASSERT(entry.packfile == packid);
+    return _getStored(entry.offset, entry.packed_size);
+}
 
-            storedSizes[i] = ssize;
+/*
+ * Only the hash prefix of the stored payload is decompressed.
+ */
+ObjectHash
+Packfile::getDeltaBase(const IndexEntry &entry)
+{
+    ASSERT(entry.packfile == packid);
+    ASSERT(entry.info.isDelta());
+
+    ObjectHash base;
+    bytestream *bs = _getStored(entry.offset, entry.packed_size);
+    ObjectInfo::ZipAlgo algo = entry.info.getAlgo();
+    if (algo != ObjectInfo::ZIPALGO_NONE)
+        bs = new zipstream(bs, DECOMPRESS, 0, algo);
+    bytestream::ap stored(bs);
+
+    bool ok;
+    try {
+        ok = stored->readExact(base.hash, ObjectHash::SIZE);
+    } catch (std::ios_base::failure &e) {
+        ok = false;
+    }
+    if (!ok) {
+        WARNING("Object %s has a corrupt delta",
+                entry.info.hash.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt delta");
+    }
 
-            if (hset.find(info.hash) != hset.end()) {
-                skip.insert(i);
+    return base;
+}
+
+/*
+ * Returns the stored payload decompressed, which is the delta for delta
+ * objects.
+ */
+string
+Packfile::_getDecoded(const IndexEntry &entry)
+{
+    ASSERT(entry.packfile == packid);
+
+    bytestream *bs = _getStored(entry.offset, entry.packed_size);
+    ObjectInfo::ZipAlgo algo = entry.info.getAlgo();
+    if (algo != ObjectInfo::ZIPALGO_NONE)
+        bs = new zipstream(bs, DECOMPRESS,
+                           entry.info.isDelta() ? 0 : entry.info.payload_size,
+                           algo);
+    bytestream::ap stored(bs);
+
+    string buf = stored->readAll();
+    if (stored->error() || (!entry.info.isDelta() &&
+                            buf.size() != entry.info.payload_size)) {
+        WARNING("Object %s could not be decoded",
+                entry.info.hash.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt object");
+    }
+
+    return buf;
+}
+
+/*
+ * The stored payload of a delta object is the hash of its base followed by
+ * a fossil delta, compressed together.
+ */
+void
+Packfile::_readDelta(const IndexEntry &entry, ObjectHash &base,
+                     string &delta)
+{
+    ASSERT(entry.info.isDelta());
+
+    string buf = _getDecoded(entry);
+    if (buf.size() < ObjectHash::SIZE) {
+        WARNING("Object %s has a corrupt delta",
+                entry.info.hash.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt delta");
+    }
+
+    memcpy(base.hash, buf.data(), ObjectHash::SIZE);
+    delta.assign(buf, ObjectHash::SIZE, string::npos);
+}
+
+bytestream *
+Packfile::_getDeltaPayload(const IndexEntry &entry)
+{
+    ObjectHash base;
+    string delta;
+
+    _readDelta(entry, base, delta);
+    if (mgr == NULL) {
+        WARNING("Cannot resolve delta object %s without an index",
+                entry.info.hash.hex().c_str());
+        throw RuntimeException(ORIEC_INVALIDARGS, "No delta base");
+    }
+
+    string src = mgr->_getDeltaBase(base, entry.info.getDeltaDepth());
+    int len = delta_output_size(delta.data(), delta.size());
+    if (len < 0 || (size_t)len != entry.info.payload_size) {
+        WARNING("Object %s has a corrupt delta",
+                entry.info.hash.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt delta");
+    }
+
+    string payload(len, '\0');
+    if (delta_apply(src.data(), src.size(), delta.data(), delta.size(),
+                    &payload[0]) != len) {
+        WARNING("Object %s does not apply to its base %s",
+                entry.info.hash.hex().c_str(), base.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt delta");
+    }
+
+    return new strstream(payload);
+}
+
+/*
+ * Append stored objects of other packfiles to this packfile in groups of at
+ * most PACKFILE_MAXOBJS.  Stored payloads are copied as is through a bounded
+ * staging buffer so that memory use does not depend on the packfile size.
+ */
+void
+Packfile::appendFrom(const vector<IndexEntry> &objs,
+                     vector<IndexEntry> &moved)
+{
+    string staging;
+    vector<struct iovec> iov(1);
+    size_t first = 0;
+    Packfile::sp src;
+
+    ASSERT(!sealed);
+    ASSERT(mgr != NULL);
+    lseek(fd, 0, SEEK_END);
+    staging.reserve(PACKFILE_STAGING_BUFSZ);
+    while (first < objs.size()) {
+        size_t num = MIN(objs.size() - first, (size_t)PACKFILE_MAXOBJS);
+        offset_t off = fileSize + sizeof(numobjs_t) + num * ENTRYSIZE;
+
+        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+        strwstream headers_ss;
+        headers_ss.writeUInt32(num);
+        for (size_t i = first; i < first + num; i++) {
+            const IndexEntry &e = objs[i];
+
+            ASSERT(e.packfile != packid);
+            if (!src.get() || src->packid != e.packfile)
+                src = mgr->getPackfile(e.packfile);
+            if ((size_t)e.offset + e.packed_size > src->fileSize) {
+                WARNING("Object %s is past the end of packfile %u",
+                        e.info.hash.hex().c_str(), src->packid);
+                throw RuntimeException(ORIEC_INDEXCORRUPT,
+                                       "Object past end of packfile");
             }
-            else {
-                tr->infos.push_back(info);
+
+            headers_ss.write(e.info.toString().data(), ObjectInfo::SIZE);
+            headers_ss.writeUInt32(e.packed_size);
+            headers_ss.writeUInt32(off);
+
+            IndexEntry ie = e;
+            ie.offset = off;
+            ie.packfile = packid;
+            moved.push_back(ie);
+
+            off += e.packed_size;
+        }
+        staging = headers_ss.str();
+
+        for (size_t i = first; i < first + num; i++) {
+            size_t done = 0;
+
+            if (src->packid != objs[i].packfile)
+                src = mgr->getPackfile(objs[i].packfile);
+
+            while (done < objs[i].packed_size) {
+                size_t len = MIN(objs[i].packed_size - done,
+                                 (size_t)COPYFILE_BUFSZ);
+                size_t pos = staging.size();
+
+                staging.resize(pos + len);
+                ssize_t status = pread(src->fd, &staging[pos], len,
+                                       objs[i].offset + done);
+                if (status < 0) {
+                    if (errno == EINTR) {
+                        staging.resize(pos);
+                        continue;
+                    }
+                    throw SystemException();
+                }
+                if (status == 0)
+                    throw RuntimeException(ORIEC_INDEXCORRUPT,
+                                           "Packfile truncated");
+                staging.resize(pos + status);
+                done += status;
+
+                if (staging.size() >= PACKFILE_STAGING_BUFSZ) {
+                    iov[0].iov_base = (void *)staging.data();
+                    iov[0].iov_len = staging.size();
+                    _writeVec(iov);
+                    fileSize += staging.size();
+                    staging.clear();
+                }
             }
+            numObjects++;
         }
 
-        // Read payloads
+        if (staging.size() > 0) {
+            iov[0].iov_base = (void *)staging.data();
+            iov[0].iov_len = staging.size();
+            _writeVec(iov);
+            fileSize += staging.size();
+            staging.clear();
+        }
+
+        first += num;
+    }
+}
+
+/*
+ * Copy objects of other packfiles of the manager, compressing each with algo
+ * if the result is smaller than the stored payload.  Objects keep their delta
+ * encoding.  Groups are compressed in memory before they are written since
+ * the headers precede the payloads.
+ */
+void
+Packfile::recompressFrom(const vector<IndexEntry> &objs,
+                         ObjectInfo::ZipAlgo algo, vector<IndexEntry> &moved)
+{
+    vector<struct iovec> iov;
+    size_t first = 0;
+    Packfile::sp src;
+
+    ASSERT(!sealed);
+    ASSERT(mgr != NULL);
+    // Plain FastLZ cannot encode deltas
+    ASSERT(algo != ObjectInfo::ZIPALGO_FASTLZ);
+    lseek(fd, 0, SEEK_END);
+    while (first < objs.size()) {
+        size_t num = MIN(objs.size() - first, (size_t)PACKFILE_MAXOBJS);
+        offset_t off = fileSize + sizeof(numobjs_t) + num * ENTRYSIZE;
+        vector<string> payloads(num);
+        strwstream headers_ss;
+
+        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+        headers_ss.writeUInt32(num);
         for (size_t i = 0; i < num; i++) {
-            payload.resize(storedSizes[i]);
-            fs.read((uint8_t*)&payload[0], storedSizes[i]);
+            const IndexEntry &e = objs[first + i];
+            IndexEntry ie = e;
+
+            ASSERT(e.packfile != packid);
+            if (!src.get() || src->packid != e.packfile)
+                src = mgr->getPackfile(e.packfile);
+
+            bytestream::ap bs(src->getStoredPayload(e));
+            payloads[i] = bs->readAll();
+            if (bs->error() || payloads[i].size() != e.packed_size) {
+                WARNING("Could not read object %s from packfile %u",
+                        e.info.hash.hex().c_str(), src->packid);
+                throw RuntimeException(ORIEC_INDEXCORRUPT,
+                                       "Object past end of packfile");
+            }
 
-            if (skip.find(i) != skip.end()) {
-                continue;
+            if (e.info.getAlgo() != algo) {
+                string out;
+                if (PfTransaction::compress(ie.info, src->_getDecoded(e),
+                                            algo, out) &&
+                    out.size() < payloads[i].size()) {
+                    payloads[i].swap(out);
+                } else {
+                    ie.info = e.info;
+                }
             }
 
-            tr->payloads.push_back(payload);
+            headers_ss.write(ie.info.toString().data(), ObjectInfo::SIZE);
+            headers_ss.writeUInt32(payloads[i].size());
+            headers_ss.writeUInt32(off);
+
+            ie.offset = off;
+            ie.packed_size = payloads[i].size();
+            ie.packfile = packid;
+            moved.push_back(ie);
+
+            off += payloads[i].size();
         }
-    }
 
-    // Make a tempfile
-    string tmpFilename = filename + ".tmp";
-    int oldFd = fd;
-    fd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("Packfile::purge open");
-        throw SystemException();
+        iov.resize(num + 1);
+        iov[0].iov_base = (void *)headers_ss.str().data();
+        iov[0].iov_len = headers_ss.str().size();
+        for (size_t i = 0; i < num; i++) {
+            iov[i + 1].iov_base = (void *)payloads[i].data();
+            iov[i + 1].iov_len = payloads[i].size();
+        }
+        _writeVec(iov);
+        fileSize = off;
+        numObjects += num;
+
+        first += num;
     }
+}
 
-    ::close(oldFd);
-    OriFile_Rename(tmpFilename, filename);
+void
+Packfile::sync()
+{
+    DurabilityPolicy::syncFd(fd);
+}
 
-    // Commit the transaction
-    bool empty = tr->payloads.size() == 0;
-    tr.reset();
+void
+Packfile::_recordRead()
+{
+    if (mgr == NULL || !mgr->trackReads.load(memory_order_relaxed))
+        return;
 
-    return empty;
+    reads->count.fetch_add(1, memory_order_relaxed);
+    reads->last.store(time(NULL), memory_order_relaxed);
 }
 
 void
 Packfile::readEntries(ReadEntryCb cb, void *arg)
 {
-    offset_t groupOffset = 0;
-    
-    while (groupOffset < fileSize) {
-        fdstream readStream(fd, groupOffset);
-        numobjs_t objs = readStream.readUInt32();
+    vector<IndexEntry> entries;
 
-        for (size_t i = 0; i < objs; i++) {
-            ObjectInfo info;
-            uint32_t size;
-            offset_t off;
+    if (!readTrailer(entries))
+        _scanGroups(entries);
+    sort(entries.begin(), entries.end(),
+         [](const IndexEntry &a, const IndexEntry &b) {
+            return a.offset < b.offset;
+         });
 
-            ASSERT(sizeof(offset_t) == sizeof(uint32_t));
+    for (size_t i = 0; i < entries.size(); i++) {
+        cb(entries[i], arg);
+    }
+}
+
+bool
+Packfile::readTrailer(vector<IndexEntry> &entries)
+{
+    if (!sealed)
+        return false;
+
+    size_t len = fileSize - dataEnd;
+    bytestream::ap bs(_getStored(dataEnd, len));
+    string trailer = bs->readAll();
+    if (trailer.size() != len) {
+        WARNING("Could not read the trailer of packfile %u", packid);
+        return false;
+    }
+
+    strstream crcss(trailer.substr(len - 8, 4));
+    uint32_t crc = OriCrypt_CRC32C((const uint8_t *)trailer.data(), len - 8);
+    if (crcss.readUInt32() != crc) {
+        WARNING("Packfile %u has a corrupt trailer", packid);
+        return false;
+    }
 
-            readStream.readInfo(info);
-            size = readStream.readUInt32();
-            off = readStream.readUInt32();
-            cb(info, off, arg);
+    strstream ss(trailer);
+    entries.reserve(entries.size() + numObjects);
+    for (size_t i = 0; i < numObjects; i++) {
+        IndexEntry ie;
+
+        ss.readInfo(ie.info);
+        ie.packed_size = ss.readUInt32();
+        ie.offset = ss.readUInt32();
+        ie.packfile = packid;
+        entries.push_back(ie);
+    }
 
-            ASSERT(groupOffset <= size + off);
-            groupOffset = size + off;
+    return true;
+}
+
+/*
+ * Collect the headers of all groups and return where the last valid group
+ * ends.  A group that does not fit in the file or whose offsets are not
+ * contiguous was torn by a crash and ends the walk.
+ */
+size_t
+Packfile::_scanGroups(vector<IndexEntry> &entries)
+{
+    size_t end = sealed ? dataEnd : fileSize;
+    size_t groupOffset = 0;
+
+    while (groupOffset < end) {
+        if (groupOffset + sizeof(numobjs_t) > end)
+            break;
+
+        bytestream::ap hs(_getStored(groupOffset, sizeof(numobjs_t)));
+        numobjs_t objs = hs->readUInt32();
+        size_t hdrEnd = groupOffset + sizeof(numobjs_t) +
+                        (size_t)objs * ENTRYSIZE;
+        if (hdrEnd > end)
+            break;
+        if (objs == 0) {
+            groupOffset = hdrEnd;
+            continue;
         }
+
+        bytestream::ap bs(_getStored(groupOffset + sizeof(numobjs_t),
+                                     hdrEnd - groupOffset -
+                                     sizeof(numobjs_t)));
+        vector<IndexEntry> group;
+        size_t next = hdrEnd;
+        for (size_t i = 0; i < objs; i++) {
+            IndexEntry ie;
+
+            bs->readInfo(ie.info);
+            ie.packed_size = bs->readUInt32();
+            ie.offset = bs->readUInt32();
+            ie.packfile = packid;
+            if (ie.offset != next)
+                break;
+            next += ie.packed_size;
+            group.push_back(ie);
+        }
+        if (group.size() != objs || next > end)
+            break;
+
+        entries.insert(entries.end(), group.begin(), group.end());
+        groupOffset = next;
     }
+
+    if (groupOffset != end)
+        WARNING("Packfile %u has a torn group at offset %lu",
+                packid, groupOffset);
+
+    return groupOffset;
 }
 
 bool
@@ -360,6 +1150,8 @@ _offsetCmp(const IndexEntry &ie1, const IndexEntry &ie2)
 void
 Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
 {
+    _recordRead();
+
     // Find contiguous blocks
     sort(objects.begin(), objects.end(), _offsetCmp);
     map<offset_t, offset_t> blocks;
@@ -425,14 +1217,23 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     bs->writeUInt32(totalObjs);
     bs->write(infos_ss.str().data(), infos_ss.str().size());
 
-    // Transmit objects
+    // Transmit objects straight from the mapping if possible
+    shared_ptr<PackfileMap> m;
+    if (blocks.size() > 0)
+        m = _getMap((*blocks.rbegin()).second);
+
     vector<uint8_t> buf;
     for (map<offset_t, offset_t>::iterator it = blocks.begin();
             it != blocks.end();
             it++) {
-        lseek(fd, (*it).first, SEEK_SET);
 	ASSERT((*it).second >= (*it).first);
         ssize_t len = (*it).second - (*it).first;
+        if (m.get()) {
+            bs->write(m->addr + (*it).first, len);
+            continue;
+        }
+
+        lseek(fd, (*it).first, SEEK_SET);
         buf.resize(len);
         ssize_t n = read(fd, &buf[0], len);
         if (n < 0 || n != len) {
@@ -447,55 +1248,120 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
 }
 
 
+/*
+ * Receive a batch of objects.  Commits and trees are written to metaPf if
+ * it is given, the rest to this packfile.  The payloads of tiny whole
+ * objects are also cached in the index.
+ */
 bool
-Packfile::receive(bytestream *bs, Index *idx)
+Packfile::receive(bytestream *bs, Index *idx,
+                  const function<Packfile *()> &metaPf)
 {
     ASSERT(sizeof(uint32_t) == sizeof(numobjs_t));
     numobjs_t num = bs->readUInt32();
     if (num == 0) return false;
 
-    lseek(fd, 0, SEEK_END);
-    size_t headers_size = num * ENTRYSIZE;
-    offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
-    vector<size_t> obj_sizes;
-    
-    strwstream headers_ss;
-    ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
-    headers_ss.writeUInt32(num);
+    Packfile *dests[2] = { this, this };
+    vector<string> infoStrs(num);
+    vector<uint32_t> obj_sizes(num);
+    vector<int> route(num);
+    vector<bool> tiny(num);
+    size_t counts[2] = { 0, 0 };
+
     for (size_t i = 0; i < num; i++) {
-        string info_str(ObjectInfo::SIZE, '\0');
-        bs->readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
+        infoStrs[i].assign(ObjectInfo::SIZE, '\0');
+        bs->readExact((uint8_t*)&infoStrs[i][0], ObjectInfo::SIZE);
+        obj_sizes[i] = bs->readUInt32();
+
         ObjectInfo info;
-        info.fromString(info_str);
-        //info.print();
+        info.fromString(infoStrs[i]);
+        tiny[i] = obj_sizes[i] <= INDEX_INLINE_MAX && !info.isDelta() &&
+                  info.getAlgo() == ObjectInfo::ZIPALGO_NONE &&
+                  info.payload_size == obj_sizes[i];
+        route[i] = (metaPf && (info.type == ObjectInfo::Commit ||
+                               info.type == ObjectInfo::Tree)) ? 1 : 0;
+        counts[route[i]]++;
+    }
+    if (counts[1] != 0)
+        dests[1] = metaPf();
+
+    // Each destination gets one group, headers first
+    vector<IndexEntry> entries;
+    string staging[2];
+    offset_t off[2];
+    for (int d = 0; d < 2; d++) {
+        if (counts[d] == 0)
+            continue;
+        ASSERT(!dests[d]->sealed);
 
-        uint32_t obj_size = bs->readUInt32();
-        obj_sizes.push_back(obj_size);
+        lseek(dests[d]->fd, 0, SEEK_END);
+        off[d] = dests[d]->fileSize + sizeof(numobjs_t) +
+                 counts[d] * ENTRYSIZE;
 
-        headers_ss.write(info_str.data(), ObjectInfo::SIZE);
-        headers_ss.writeUInt32(obj_size);
-        ASSERT(sizeof(offset_t) == sizeof(uint32_t));
-        headers_ss.writeUInt32(off);
+        strwstream headers_ss;
+        ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
+        headers_ss.writeUInt32(counts[d]);
+        for (size_t i = 0; i < num; i++) {
+            if (route[i] != d)
+                continue;
 
-        IndexEntry ie = {info, off, obj_size, packid};
-        idx->updateEntry(info.hash, ie);
+            headers_ss.write(infoStrs[i].data(), ObjectInfo::SIZE);
+            headers_ss.writeUInt32(obj_sizes[i]);
+            ASSERT(sizeof(offset_t) == sizeof(uint32_t));
+            headers_ss.writeUInt32(off[d]);
 
-        off += obj_size;
-    }
+            IndexEntry ie;
+            ie.info.fromString(infoStrs[i]);
+            ie.offset = off[d];
+            ie.packed_size = obj_sizes[i];
+            ie.packfile = dests[d]->packid;
+            entries.push_back(ie);
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
+            off[d] += obj_sizes[i];
+        }
+        staging[d] = headers_ss.str();
+        staging[d].reserve(PACKFILE_STAGING_BUFSZ);
+    }
 
-    vector<uint8_t> data;
+    // Stage the headers and payloads so that small objects are written in
+    // large chunks
+    vector<struct iovec> iov(1);
+    auto flush = [&](int d) {
+        iov[0].iov_base = (void *)staging[d].data();
+        iov[0].iov_len = staging[d].size();
+        dests[d]->_writeVec(iov);
+        dests[d]->fileSize += staging[d].size();
+        staging[d].clear();
+    };
     for (size_t i = 0; i < num; i++) {
         //fprintf(stderr, "Reading %lu packed size %lu\n", i, obj_sizes[i]);
-        data.resize(obj_sizes[i]);
-        bs->readExact(&data[0], obj_sizes[i]);
-        
-        write(fd, &data[0], obj_sizes[i]);
-        fileSize += obj_sizes[i];
-        numObjects++;
+        int d = route[i];
+        size_t pos = staging[d].size();
+        staging[d].resize(pos + obj_sizes[i]);
+        bs->readExact((uint8_t *)&staging[d][pos], obj_sizes[i]);
+        dests[d]->numObjects++;
+
+        if (tiny[i]) {
+            ObjectInfo info;
+            info.fromString(infoStrs[i]);
+            idx->addInline(info, staging[d].substr(pos, obj_sizes[i]));
+        }
+
+        if (staging[d].size() >= PACKFILE_STAGING_BUFSZ)
+            flush(d);
+    }
+
+    // Index the batch only once its data is in the packfiles
+    for (int d = 0; d < 2; d++) {
+        if (staging[d].size() > 0)
+            flush(d);
+        if (counts[d] != 0) {
+            dests[d]->durability->commit(dests[d]->fd,
+                                         DurabilityPolicy::DURABILITY_DATA);
+            dests[d]->_dropWritten();
+        }
     }
+    idx->updateEntries(entries);
 
     return true;
 }
@@ -507,25 +1373,31 @@ Packfile::receive(bytestream *bs, Index *idx)
  * PackfileManager
  */
 
-PackfileManager::PackfileManager(const string &rootPath)
-    : rootPath(rootPath)
+PackfileManager::PackfileManager(const string &rootPath,
+                                 DurabilityPolicy::sp durability)
+    : rootPath(rootPath), durability(durability), idx(NULL),
+      accessLock(), access(), accessDirty(false), trackReads(true),
+      streaming(false), accessSaved(time(NULL))
 {
     if (!_loadFreeList()) {
         _recomputeFreeList();
         _writeFreeList();
     }
+    _loadAccess();
 }
 
 PackfileManager::~PackfileManager()
 {
     _writeFreeList();
+    saveAccess();
 }
 
 Packfile::sp
 PackfileManager::getPackfile(packid_t id)
 {
     if (!_packfileCache.hasKey(id)) {
-        Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+        Packfile::sp pf(new Packfile(_getPackfileName(id), id, durability,
+                                     this));
 
         _packfileCache.put(id, pf);
         return pf;
@@ -539,7 +1411,7 @@ PackfileManager::newPackfile()
 {
     ASSERT(freeList.size() > 0);
     packid_t id = freeList[0];
-    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    Packfile::sp pf(new Packfile(_getPackfileName(id), id, durability, this));
     if (freeList.size() == 1) {
         freeList[0] += 1;
     }
@@ -549,6 +1421,306 @@ PackfileManager::newPackfile()
     return pf;
 }
 
+void
+PackfileManager::setIndex(Index *idx)
+{
+    this->idx = idx;
+}
+
+/*
+ * Returns the payload of the base of a delta object.  Bases always have a
+ * shorter chain than the objects encoded against them, checking this
+ * bounds the recursion even if the packfiles are corrupt.
+ */
+string
+PackfileManager::_getDeltaBase(const ObjectHash &base, uint32_t depth)
+{
+    if (idx == NULL || !idx->hasObject(base)) {
+        WARNING("Delta base %s is missing", base.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Missing delta base");
+    }
+
+    IndexEntry ie = idx->getEntry(base);
+    if (ie.info.getDeltaDepth() >= depth) {
+        WARNING("Delta base %s has a longer chain than its delta",
+                base.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt delta chain");
+    }
+
+    string payload;
+    bool error = false;
+    if (ie.info.payload_size > INDEX_INLINE_MAX ||
+        !idx->getInline(base, payload)) {
+        Packfile::sp pf = getPackfile(ie.packfile);
+        bytestream::ap bs(pf->getPayload(ie));
+        payload = bs->readAll();
+        error = bs->error() != NULL;
+    }
+    if (error || payload.size() != ie.info.payload_size) {
+        WARNING("Could not read delta base %s", base.hex().c_str());
+        throw RuntimeException(ORIEC_OBJECTCORRUPT, "Corrupt delta base");
+    }
+
+    return payload;
+}
+
+/*
+ * Delete a packfile that no index entry refers to.  The id is reused by
+ * newPackfile before any new id is allocated.
+ */
+void
+PackfileManager::removePackfile(packid_t id)
+{
+    if (_packfileCache.hasKey(id))
+        _packfileCache.invalidate(id);
+
+    if (OriFile_Delete(_getPackfileName(id)) < 0) {
+        WARNING("Could not delete packfile %u", id);
+    }
+
+    {
+        unique_lock<mutex> l(accessLock);
+        pendingReads.erase(id);
+        if (access.erase(id) != 0)
+            accessDirty = true;
+    }
+
+    // Ids at or past the last entry are already free
+    ASSERT(freeList.size() > 0);
+    if (id < freeList.back()) {
+        deque<packid_t>::iterator it = lower_bound(freeList.begin(),
+                                                   freeList.end() - 1, id);
+        if (*it != id)
+            freeList.insert(it, id);
+    }
+    _writeFreeList();
+}
+
+/*
+ * Access tracking.  Packfiles count their reads in a PackReads without
+ * locking, the counts are folded into the records whenever the records are
+ * used.  Records are kept in memory and written by saveAccess(), losing some
+ * of them only makes packfiles look colder.
+ */
+
+void
+PackfileManager::setTrackReads(bool enable)
+{
+    trackReads = enable;
+}
+
+void
+PackfileManager::setStreaming(bool enable)
+{
+    streaming = enable;
+}
+
+PackAccess
+PackfileManager::getAccess(packid_t id)
+{
+    unique_lock<mutex> l(accessLock);
+
+    _foldReads();
+    return _getAccess(id);
+}
+
+void
+PackfileManager::inheritAccess(packid_t dest,
+                               const unordered_map<packid_t, uint64_t> &srcBytes)
+{
+    unique_lock<mutex> l(accessLock);
+    PackAccess a;
+    double lastRead = 0.0;
+    double reads = 0.0;
+    double total = 0.0;
+
+    _foldReads();
+    a.recompressed = !srcBytes.empty();
+    a.ordered = srcBytes.size() == 1;
+    for (unordered_map<packid_t, uint64_t>::const_iterator it =
+            srcBytes.begin();
+         it != srcBytes.end();
+         it++) {
+        PackAccess s = _getAccess((*it).first);
+        // Empty objects still carry some weight
+        double w = (double)((*it).second + 1);
+
+        lastRead += w * (double)s.lastRead;
+        reads += w * (double)s.reads;
+        total += w;
+        a.recompressed = a.recompressed && s.recompressed;
+        a.ordered = a.ordered && s.ordered;
+    }
+    a.lastRead = total > 0.0 ? (time_t)(lastRead / total) : 0;
+    a.reads = total > 0.0 ? (uint64_t)(reads / total) : 0;
+
+    access[dest] = a;
+    accessDirty = true;
+}
+
+void
+PackfileManager::setRecompressed(packid_t id)
+{
+    unique_lock<mutex> l(accessLock);
+
+    PackAccess a = _getAccess(id);
+    a.recompressed = true;
+    access[id] = a;
+    accessDirty = true;
+}
+
+void
+PackfileManager::setOrdered(packid_t id)
+{
+    unique_lock<mutex> l(accessLock);
+
+    PackAccess a = _getAccess(id);
+    a.ordered = true;
+    access[id] = a;
+    accessDirty = true;
+}
+
+void
+PackfileManager::saveAccess(bool force)
+{
+    unique_lock<mutex> l(accessLock);
+
+    if (!force && time(NULL) - accessSaved < PFMGR_ACCESS_INTERVAL)
+        return;
+
+    _foldReads();
+    _saveAccess();
+}
+
+/*
+ * Returns the read counter of a packfile that is being opened.
+ */
+shared_ptr<PackReads>
+PackfileManager::_getReads(packid_t id)
+{
+    unique_lock<mutex> l(accessLock);
+
+    shared_ptr<PackReads> &r = pendingReads[id];
+    if (!r)
+        r.reset(new PackReads());
+    return r;
+}
+
+/*
+ * Move the reads counted by the packfiles into their access records.
+ */
+void
+PackfileManager::_foldReads()
+{
+    for (unordered_map<packid_t, shared_ptr<PackReads> >::iterator it =
+            pendingReads.begin();
+         it != pendingReads.end();
+         it++) {
+        uint64_t n = (*it).second->count.exchange(0);
+        if (n == 0)
+            continue;
+
+        PackAccess a = _getAccess((*it).first);
+        a.reads += n;
+        a.lastRead = MAX(a.lastRead, (*it).second->last.load());
+        access[(*it).first] = a;
+        accessDirty = true;
+    }
+}
+
+PackAccess
+PackfileManager::_getAccess(packid_t id)
+{
+    unordered_map<packid_t, PackAccess>::iterator it = access.find(id);
+    if (it != access.end())
+        return (*it).second;
+
+    struct stat sb;
+    PackAccess a;
+    a.lastRead = 0;
+    a.reads = 0;
+    a.recompressed = false;
+    a.ordered = false;
+    if (::stat(_getPackfileName(id).c_str(), &sb) == 0)
+        a.lastRead = sb.st_mtime;
+    return a;
+}
+
+/*
+ * Layout: [count] followed by [id][last read][reads][flags] per packfile,
+ * flags are 1 for recompressed and 2 for ordered.
+ */
+void
+PackfileManager::_loadAccess()
+{
+    string path = rootPath + PFMGR_ACCESS;
+    string buf;
+
+    if (!OriFile_Exists(path))
+        return;
+
+    try {
+        buf = OriFile_ReadFile(path);
+    } catch (SystemException &e) {
+        WARNING("Could not read packfile access records: %s", e.what());
+        return;
+    }
+
+    if (buf.size() < 4) {
+        WARNING("Ignoring truncated packfile access records");
+        return;
+    }
+
+    strstream ss(buf);
+    uint32_t num = ss.readUInt32();
+    if (buf.size() != 4 + (size_t)num * 24) {
+        WARNING("Ignoring corrupt packfile access records");
+        return;
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        packid_t id = ss.readUInt32();
+        PackAccess a;
+
+        a.lastRead = (time_t)ss.readUInt64();
+        a.reads = ss.readUInt64();
+        uint32_t flags = ss.readUInt32();
+        a.recompressed = (flags & 1) != 0;
+        a.ordered = (flags & 2) != 0;
+        access[id] = a;
+    }
+}
+
+void
+PackfileManager::_saveAccess()
+{
+    strwstream ss;
+
+    if (!accessDirty)
+        return;
+
+    ss.writeUInt32(access.size());
+    for (unordered_map<packid_t, PackAccess>::iterator it = access.begin();
+            it != access.end();
+            it++) {
+        ss.writeUInt32((*it).first);
+        ss.writeUInt64((uint64_t)(*it).second.lastRead);
+        ss.writeUInt64((*it).second.reads);
+        ss.writeUInt32(((*it).second.recompressed ? 1 : 0) |
+                       ((*it).second.ordered ? 2 : 0));
+    }
+
+    string path = rootPath + PFMGR_ACCESS;
+    if (!OriFile_WriteFile(ss.str(), path + ".tmp") ||
+        OriFile_Rename(path + ".tmp", path) < 0) {
+        WARNING("Could not write packfile access records");
+        return;
+    }
+
+    accessDirty = false;
+    accessSaved = time(NULL);
+}
+
 bool
 PackfileManager::hasPackfile(packid_t id)
 {
@@ -568,14 +1740,60 @@ static int _freeListCB(vector<packid_t> *existing, const string &cpath)
 
 vector<packid_t>
 PackfileManager::getPackfileList()
+{
+    return listPackfiles(rootPath);
+}
+
+vector<packid_t>
+PackfileManager::listPackfiles(const string &dir)
 {
     vector<packid_t> existing;
 
-    DirIterate(rootPath.c_str(), &existing, _freeListCB);
+    DirIterate(dir.c_str(), &existing, _freeListCB);
 
     return existing;
 }
 
+/*
+ * Sealed packfiles are never written again, so repositories on the same
+ * filesystem can share them through hard links.  The link count is the
+ * reference count of the shared file and each repository only ever removes
+ * its own link.
+ */
+bool
+PackfileManager::linkPackfile(const string &path, packid_t &id)
+{
+    ASSERT(freeList.size() > 0);
+    id = freeList[0];
+
+    if (::link(path.c_str(), _getPackfileName(id).c_str()) < 0) {
+        if (errno == EXDEV || errno == EPERM || errno == EMLINK ||
+            errno == ENOENT)
+            return false;
+        throw SystemException();
+    }
+
+    if (freeList.size() == 1) {
+        freeList[0] += 1;
+    } else {
+        freeList.pop_front();
+    }
+    _writeFreeList();
+
+    return true;
+}
+
+bool
+PackfileManager::isShared(packid_t id)
+{
+    struct stat sb;
+
+    if (::stat(_getPackfileName(id).c_str(), &sb) < 0)
+        return false;
+
+    return sb.st_nlink > 1;
+}
+
 void
 PackfileManager::_recomputeFreeList()
 {
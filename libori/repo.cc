@@ -21,6 +21,11 @@
 #include <set>
 #include <queue>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
 
 #include "tuneables.h"
 
@@ -29,6 +34,7 @@
 #include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/dag.h>
+#include <oriutil/stream.h>
 
 #include <ori/object.h>
 #include <ori/largeblob.h>
@@ -53,7 +59,9 @@ ObjectHash::fromHex("c8877087da56e072870daa843f176e9453115929094c3a40c463a196c29
  * Repo
  */
 
-Repo::Repo() {
+Repo::Repo()
+    : filePool()
+{
 }
 
 Repo::~Repo() {
@@ -96,6 +104,19 @@ Repo::addBlob(ObjectType type, const string &blob)
     return hash;
 }
 
+int
+Repo::addChunk(const ObjectHash &hash, const string &payload)
+{
+    return addObject(ObjectInfo::Blob, hash, payload);
+}
+
+int
+Repo::addDeltaObject(ObjectType type, const ObjectHash &hash,
+                     const string &payload, const ObjectHash &base)
+{
+    return addObject(type, hash, payload);
+}
+
 
 bytestream *
 Repo::getObjects(const std::deque<ObjectHash> &objs)
@@ -112,10 +133,17 @@ Repo::getObjects(const std::deque<ObjectHash> &objs)
  * Add a file to the repository. This is a low-level interface.
  */
 ObjectHash
-Repo::addSmallFile(const string &path)
+Repo::addSmallFile(const string &path, const ObjectHash &prev)
 {
     diskstream ds(path);
-    return addBlob(ObjectInfo::Blob, ds.readAll());
+    string blob = ds.readAll();
+
+    if (prev.isEmpty())
+        return addBlob(ObjectInfo::Blob, blob);
+
+    ObjectHash hash = OriCrypt_HashString(blob);
+    addDeltaObject(ObjectInfo::Blob, hash, blob, prev);
+    return hash;
 }
 
 /*
@@ -149,14 +177,119 @@ Repo::addLargeFile(const string &path)
  * work to addLargeFile or addSmallFile based on our size threshold.
  */
 pair<ObjectHash, ObjectHash>
-Repo::addFile(const string &path)
+Repo::addFile(const string &path, const ObjectHash &prev)
 {
     size_t sz = OriFile_GetSize(path);
 
     if (sz > LARGEFILE_MINIMUM)
         return addLargeFile(path);
     else
-        return make_pair(addSmallFile(path), ObjectHash());
+        return make_pair(addSmallFile(path, prev), ObjectHash());
+}
+
+/*
+ * A file read and hashed by a worker for addFiles.  Large files are only
+ * flagged, they are chunked in turn by the calling thread.
+ */
+struct AddFilesJob
+{
+    typedef std::shared_ptr<AddFilesJob> sp;
+    AddFilesJob(const string &path)
+        : path(path), large(false), blob(), hash(), error(), lock(), cv(),
+          done(false)
+    {
+    }
+    void run()
+    {
+        try {
+            size_t sz = OriFile_GetSize(path);
+
+            if (sz > LARGEFILE_MINIMUM) {
+                large = true;
+            } else {
+                diskstream ds(path);
+                blob = ds.readAll();
+                hash = OriCrypt_HashString(blob);
+            }
+        } catch (...) {
+            error = current_exception();
+        }
+
+        unique_lock<mutex> l(lock);
+        done = true;
+        cv.notify_all();
+    }
+    void wait()
+    {
+        unique_lock<mutex> l(lock);
+        while (!done)
+            cv.wait(l);
+    }
+    const string path;
+    bool large;
+    string blob;
+    ObjectHash hash;
+    exception_ptr error;
+private:
+    mutex lock;
+    condition_variable cv;
+    bool done;
+};
+
+/*
+ * Add several files to the repository.  Small files are read and hashed on
+ * a thread pool up to ADDFILES_INFLIGHT files ahead of the file being
+ * added, which bounds the memory used to ADDFILES_INFLIGHT small files.
+ * The objects are added on the calling thread in the order of paths so the
+ * packfiles do not depend on the scheduling.
+ */
+vector<pair<ObjectHash, ObjectHash> >
+Repo::addFiles(const vector<string> &paths, const vector<ObjectHash> &prevs)
+{
+    vector<pair<ObjectHash, ObjectHash> > rval(paths.size());
+    deque<AddFilesJob::sp> pending;
+    size_t next = 0;
+
+    ASSERT(prevs.empty() || prevs.size() == paths.size());
+
+    // Not worth handing to the pool
+    if (paths.size() == 1) {
+        rval[0] = addFile(paths[0], prevs.empty() ? ObjectHash() : prevs[0]);
+        return rval;
+    }
+
+    if (!filePool.get() && !paths.empty())
+        filePool.reset(new ThreadPool(ADDFILES_THREADS));
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        ObjectHash prev = prevs.empty() ? ObjectHash() : prevs[i];
+
+        for (; next < paths.size() && next < i + ADDFILES_INFLIGHT; next++) {
+            AddFilesJob::sp job(new AddFilesJob(paths[next]));
+
+            pending.push_back(job);
+            filePool->enqueue(bind(&AddFilesJob::run, job));
+        }
+
+        AddFilesJob::sp job = pending.front();
+        pending.pop_front();
+        job->wait();
+
+        if (job->error)
+            rethrow_exception(job->error);
+
+        if (job->large) {
+            rval[i] = addLargeFile(paths[i]);
+        } else {
+            if (prev.isEmpty())
+                addObject(ObjectInfo::Blob, job->hash, job->blob);
+            else
+                addDeltaObject(ObjectInfo::Blob, job->hash, job->blob, prev);
+            rval[i] = make_pair(job->hash, ObjectHash());
+        }
+    }
+
+    return rval;
 }
 
 
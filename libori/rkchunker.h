@@ -30,7 +30,7 @@ private:
     //uint64_t hashLen;
     uint64_t b;
     uint64_t bTok;
-    uint8_t lut[256];
+    uint64_t lut[256];
 };
 
 //#define b (31)
@@ -85,12 +85,15 @@ fastPath:
      */
     for (; off + max < len;) {
         for (; off < start + min && off < len; off++)
-            hash = (hash - lut[in[off-hashLen]]) * b + in[off];
+            hash = hash * b - lut[in[off-hashLen]] + in[off];
 
         for (; off < start + max && off < len; off++) {
-            hash = (hash - lut[in[off-hashLen]]) * b + in[off];
-            if (hash % target == 1)
+            hash = hash * b - lut[in[off-hashLen]] + in[off];
+            if (hash % target == 1) {
+                // The trigger byte ends the chunk and must not be rehashed
+                off++;
                 break;
+            }
         }
 
         cb->match(in + start, off - start);
@@ -103,11 +106,11 @@ fastPath:
     }
 
     for (; off < len; off++) {
-        hash = (hash - lut[in[off-hashLen]]) * b + in[off];
-        if (((off - start > min) && (hash % target == 1))
-                || (off - start >= max)) {
-            cb->match(in + start, off - start);
-            start = off;
+        hash = hash * b - lut[in[off-hashLen]] + in[off];
+        if (((off - start >= min) && (hash % target == 1))
+                || (off + 1 - start >= max)) {
+            cb->match(in + start, off + 1 - start);
+            start = off + 1;
         }
     }
 
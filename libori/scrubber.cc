@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/orifile.h>
+#include <oriutil/oristr.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/stream.h>
+#include <ori/localrepo.h>
+#include <ori/scrubber.h>
+
+using namespace std;
+
+#define SCRUBBER_MAGIC "ORSC"
+
+static void
+scrubEntryCb(const IndexEntry &entry, void *arg)
+{
+    vector<IndexEntry> *entries = (vector<IndexEntry> *)arg;
+
+    entries->push_back(entry);
+}
+
+Scrubber::Scrubber(LocalRepo *repo)
+    : repo(repo), bytesPerSec(SCRUB_BYTES_PER_SEC),
+      cpuPercent(SCRUB_CPU_PERCENT), packid(0), offset(0),
+      passStart(time(NULL)), passes(0), pf(), entries(), next(0), corrupt(),
+      cursorPath(repo->getRootPath() + ORI_PATH_SCRUB),
+      badPath(repo->getRootPath() + ORI_PATH_SCRUBBAD)
+{
+    _loadCursor();
+
+    if (OriFile_Exists(badPath)) {
+        vector<string> lines = OriStr_Split(OriFile_ReadFile(badPath), '\n');
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (lines[i].size() >= 2 * ObjectHash::SIZE)
+                corrupt.insert(ObjectHash::fromHex(
+                        lines[i].substr(0, 2 * ObjectHash::SIZE)));
+        }
+    }
+}
+
+Scrubber::~Scrubber()
+{
+    _saveCursor();
+}
+
+/*
+ * The current packfile is reloaded from the index of the new instance, the
+ * repository may have changed while it was closed.
+ */
+void
+Scrubber::setRepo(LocalRepo *repo)
+{
+    this->repo = repo;
+    pf.reset();
+    entries.clear();
+    next = 0;
+}
+
+void
+Scrubber::setBudget(uint64_t bytesPerSec, int cpuPercent)
+{
+    ASSERT(bytesPerSec > 0);
+    ASSERT(cpuPercent > 0 && cpuPercent <= 100);
+
+    this->bytesPerSec = bytesPerSec;
+    this->cpuPercent = cpuPercent;
+}
+
+uint32_t
+Scrubber::step(uint32_t sliceMS)
+{
+    Stopwatch sw;
+    uint64_t bytes = 0;
+    uint64_t maxBytes;
+    bool passDone = false;
+    time_t now = time(NULL);
+
+    if (sliceMS == 0)
+        sliceMS = SCRUB_SLICE_MS;
+    maxBytes = bytesPerSec * sliceMS / 1000;
+
+    // Waiting for the next pass
+    if (passStart > now)
+        return (uint32_t)min((time_t)SCRUB_PASS_INTERVAL,
+                             passStart - now) * 1000;
+
+    // Scrubbing must not make cold packfiles look hot
+    repo->packfiles->setTrackReads(false);
+    sw.start();
+    while (sw.getElapsedMS() < sliceMS && bytes < maxBytes) {
+        if (next == entries.size() && !_nextPackfile()) {
+            passDone = true;
+            break;
+        }
+
+        const IndexEntry &e = entries[next++];
+        _verify(e);
+        bytes += e.packed_size;
+        offset = e.offset + 1;
+    }
+    sw.stop();
+    repo->packfiles->setTrackReads(true);
+
+    if (passDone) {
+        passes++;
+        LOG("scrub: pass %" PRIu64 " done in %lu seconds, %lu corrupt objects",
+            passes, (size_t)(time(NULL) - passStart), corrupt.size());
+        packid = 0;
+        offset = 0;
+        passStart = time(NULL) + SCRUB_PASS_INTERVAL;
+        pf.reset();
+        _saveCursor();
+        return SCRUB_PASS_INTERVAL * 1000;
+    }
+    _saveCursor();
+
+    // Wait long enough for both the byte and the CPU budget
+    uint64_t ms = sw.getElapsedMS();
+    uint64_t byteWait = bytes * 1000 / bytesPerSec;
+    uint64_t cpuWait = ms * (100 - cpuPercent) / cpuPercent;
+
+    byteWait = (byteWait > ms) ? byteWait - ms : 0;
+    return (uint32_t)max(byteWait, cpuWait);
+}
+
+vector<ObjectHash>
+Scrubber::getCorrupt() const
+{
+    return vector<ObjectHash>(corrupt.begin(), corrupt.end());
+}
+
+/*
+ * Load the live entries of the first packfile at or after the cursor.  The
+ * packfiles currently being written are left for the next pass.
+ */
+bool
+Scrubber::_nextPackfile()
+{
+    vector<packid_t> ids = repo->packfiles->getPackfileList();
+    Index &index = repo->index;
+
+    pf.reset();
+    entries.clear();
+    next = 0;
+
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        packid_t id = ids[i];
+        bool active = false;
+
+        if (id < packid)
+            continue;
+        for (int s = 0; s < LocalRepo::PACKSTREAM_MAX; s++) {
+            if (repo->currPackfile[s] &&
+                repo->currPackfile[s]->getPackfileID() == id)
+                active = true;
+        }
+        if (active)
+            continue;
+
+        if (id != packid)
+            offset = 0;
+        packid = id;
+        pf = repo->packfiles->getPackfile(id);
+
+        vector<IndexEntry> all;
+        if (pf->isSealed() && !pf->readTrailer(all)) {
+            WARNING("scrub: packfile %u has a corrupt trailer", id);
+            all.clear();
+        }
+        if (all.empty())
+            pf->readEntries(scrubEntryCb, (void *)&all);
+
+        for (size_t j = 0; j < all.size(); j++) {
+            const ObjectHash &hash = all[j].info.hash;
+            if (all[j].offset < offset || !index.hasObject(hash))
+                continue;
+
+            // Copies that the index no longer points at are dead
+            IndexEntry e = index.getEntry(hash);
+            if (e.packfile == id && e.offset == all[j].offset)
+                entries.push_back(e);
+        }
+        sort(entries.begin(), entries.end(),
+             [](const IndexEntry &a, const IndexEntry &b) {
+                return a.offset < b.offset;
+             });
+
+        if (!entries.empty())
+            return true;
+        packid = id + 1;
+        offset = 0;
+        pf.reset();
+    }
+
+    return false;
+}
+
+bool
+Scrubber::_verify(const IndexEntry &entry)
+{
+    if (entry.info.type == ObjectInfo::Purged)
+        return true;
+
+    try {
+        bytestream::ap bs(pf->getPayload(entry));
+        string payload = bs->readAll();
+
+        if (bs->error() || payload.size() != entry.info.payload_size) {
+            _recordCorrupt(entry.info.hash, "short read");
+            return false;
+        }
+        if (OriCrypt_HashString(payload) != entry.info.hash) {
+            _recordCorrupt(entry.info.hash, "hash mismatch");
+            return false;
+        }
+    } catch (exception &e) {
+        _recordCorrupt(entry.info.hash, e.what());
+        return false;
+    }
+
+    return true;
+}
+
+void
+Scrubber::_recordCorrupt(const ObjectHash &hash, const string &why)
+{
+    WARNING("scrub: object %s in packfile %u is corrupt: %s",
+            hash.hex().c_str(), packid, why.c_str());
+
+    if (!corrupt.insert(hash).second)
+        return;
+    if (!OriFile_Append(hash.hex() + "\n", badPath))
+        WARNING("scrub: could not record corrupt object %s",
+                hash.hex().c_str());
+}
+
+/*
+ * The cursor is [magic][packid][offset][pass start][passes].
+ */
+void
+Scrubber::_loadCursor()
+{
+    if (!OriFile_Exists(cursorPath))
+        return;
+
+    string buf = OriFile_ReadFile(cursorPath);
+    if (buf.size() != 4 + 4 + 8 + 8 + 8 ||
+        memcmp(buf.data(), SCRUBBER_MAGIC, 4) != 0) {
+        WARNING("scrub: ignoring corrupt cursor");
+        return;
+    }
+
+    strstream ss(buf.substr(4));
+    packid = ss.readUInt32();
+    offset = ss.readUInt64();
+    passStart = (time_t)ss.readUInt64();
+    passes = ss.readUInt64();
+}
+
+void
+Scrubber::_saveCursor()
+{
+    strwstream ss;
+    string tmpPath = cursorPath + ".tmp";
+
+    ss.write(SCRUBBER_MAGIC, 4);
+    ss.writeUInt32(packid);
+    ss.writeUInt64(offset);
+    ss.writeUInt64((uint64_t)passStart);
+    ss.writeUInt64(passes);
+
+    if (!OriFile_WriteFile(ss.str(), tmpPath) ||
+        OriFile_Rename(tmpPath, cursorPath) < 0)
+        WARNING("scrub: could not save the cursor");
+}
+
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/runtimeexception.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/orifile.h>
+#include <oriutil/stream.h>
+#include <ori/sortedtable.h>
+
+using namespace std;
+
+#define SORTEDTABLE_MAGIC       "ORIS"
+#define SORTEDTABLE_VERSION     1
+#define SORTEDTABLE_BUFSZ       (1024 * 1024)
+
+SortedTable::SortedTable()
+    : map(NULL), mapSize(0), recSize(0), keyOffset(0), count(0), fanout()
+{
+}
+
+SortedTable::~SortedTable()
+{
+    close();
+}
+
+bool
+SortedTable::open(const string &path)
+{
+    int fd;
+    struct stat sb;
+
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return false;
+        throw SystemException();
+    }
+
+    if (::fstat(fd, &sb) < 0) {
+        int errcode = errno;
+        ::close(fd);
+        throw SystemException(errcode);
+    }
+
+    if ((size_t)sb.st_size < HEADER_SIZE) {
+        ::close(fd);
+        WARNING("Sorted table %s is truncated!", path.c_str());
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Sorted table truncated");
+    }
+
+    mapSize = sb.st_size;
+    void *addr = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        mapSize = 0;
+        throw SystemException();
+    }
+    map = (uint8_t *)addr;
+
+    strstream ss(string((const char *)map, HEADER_SIZE));
+    char magic[4];
+    ss.read((uint8_t *)magic, 4);
+    uint32_t version = ss.readUInt32();
+    recSize = ss.readUInt32();
+    keyOffset = ss.readUInt32();
+    count = ss.readUInt64();
+
+    if (memcmp(magic, SORTEDTABLE_MAGIC, 4) != 0 ||
+        version != SORTEDTABLE_VERSION) {
+        close();
+        WARNING("Sorted table %s has an unknown format!", path.c_str());
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Unknown sorted table format");
+    }
+
+    bool monotonic = true;
+    fanout.resize(256);
+    for (int i = 0; i < 256; i++) {
+        fanout[i] = ss.readUInt32();
+        if (i > 0 && fanout[i] < fanout[i - 1])
+            monotonic = false;
+    }
+
+    if (!monotonic || recSize == 0 ||
+        keyOffset + ObjectHash::SIZE > recSize ||
+        fanout[255] != count ||
+        HEADER_SIZE + count * recSize != mapSize) {
+        close();
+        WARNING("Sorted table %s is corrupt!", path.c_str());
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Sorted table corrupt");
+    }
+
+    madvise(map, mapSize, MADV_RANDOM);
+
+    return true;
+}
+
+void
+SortedTable::close()
+{
+    if (map != NULL) {
+        munmap(map, mapSize);
+        map = NULL;
+        mapSize = 0;
+    }
+    count = 0;
+    fanout.clear();
+}
+
+const uint8_t *
+SortedTable::record(uint64_t i) const
+{
+    ASSERT(i < count);
+    return map + HEADER_SIZE + i * recSize;
+}
+
+ObjectHash
+SortedTable::key(uint64_t i) const
+{
+    ObjectHash hash;
+    memcpy(hash.hash, record(i) + keyOffset, ObjectHash::SIZE);
+    return hash;
+}
+
+const uint8_t *
+SortedTable::lookup(const ObjectHash &k) const
+{
+    uint64_t lo, hi;
+
+    if (map == NULL)
+        return NULL;
+
+    lo = (k.hash[0] == 0) ? 0 : fanout[k.hash[0] - 1];
+    hi = fanout[k.hash[0]];
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const uint8_t *rec = map + HEADER_SIZE + mid * recSize;
+        int cmp = memcmp(rec + keyOffset, k.hash, ObjectHash::SIZE);
+
+        if (cmp == 0)
+            return rec;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/*
+ * SortedTableWriter
+ */
+
+SortedTableWriter::SortedTableWriter(const string &path, size_t recSize,
+                                     size_t keyOffset)
+    : fd(-1), path(path), tmpPath(path + ".tmp"), recSize(recSize),
+      keyOffset(keyOffset), count(0), fanout(256, 0), buf(), lastKey()
+{
+    ASSERT(keyOffset + ObjectHash::SIZE <= recSize);
+
+    fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        WARNING("Could not create %s", tmpPath.c_str());
+        throw SystemException();
+    }
+
+    // Reserve space for the header, it is written on commit
+    buf.assign(SortedTable::HEADER_SIZE, '\0');
+}
+
+SortedTableWriter::~SortedTableWriter()
+{
+    if (fd != -1) {
+        // Never committed
+        ::close(fd);
+        OriFile_Delete(tmpPath);
+    }
+}
+
+void
+SortedTableWriter::append(const string &rec)
+{
+    ASSERT(rec.size() == recSize);
+    append((const uint8_t *)rec.data());
+}
+
+void
+SortedTableWriter::append(const uint8_t *rec)
+{
+    const uint8_t *k = rec + keyOffset;
+
+    ASSERT(fd != -1);
+    if (count > 0 && memcmp(lastKey.hash, k, ObjectHash::SIZE) >= 0) {
+        WARNING("SortedTableWriter: records out of order");
+        PANIC();
+    }
+    memcpy(lastKey.hash, k, ObjectHash::SIZE);
+
+    buf.append((const char *)rec, recSize);
+    fanout[k[0]]++;
+    count++;
+
+    if (buf.size() >= SORTEDTABLE_BUFSZ)
+        flush();
+}
+
+void
+SortedTableWriter::flush()
+{
+    size_t off = 0;
+
+    while (off < buf.size()) {
+        ssize_t status = ::write(fd, buf.data() + off, buf.size() - off);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        off += status;
+    }
+    buf.clear();
+}
+
+void
+SortedTableWriter::commit()
+{
+    strwstream ss;
+    uint64_t total = 0;
+
+    flush();
+
+    ss.write(SORTEDTABLE_MAGIC, 4);
+    ss.writeUInt32(SORTEDTABLE_VERSION);
+    ss.writeUInt32(recSize);
+    ss.writeUInt32(keyOffset);
+    ss.writeUInt64(count);
+    for (int i = 0; i < 256; i++) {
+        total += fanout[i];
+        ss.writeUInt32(total);
+    }
+
+    const string &hdr = ss.str();
+    ASSERT(hdr.size() == SortedTable::HEADER_SIZE);
+    if (pwrite(fd, hdr.data(), hdr.size(), 0) != (ssize_t)hdr.size())
+        throw SystemException();
+
+    if (fsync(fd) < 0)
+        throw SystemException();
+    ::close(fd);
+    fd = -1;
+
+    int status = OriFile_Rename(tmpPath, path);
+    if (status < 0)
+        throw SystemException(-status);
+}
+
@@ -256,7 +256,7 @@ static int _diffToDirHelper(_scanHelperData *sd, const string &path)
         if (info.payload_size != newAttrs.getAs<size_t>(ATTR_FILESIZE) ||
                 newAttrs.getAs<time_t>(ATTR_MTIME) >= sd->commit->getTime()) {
 
-            ObjectHash newHash = OriCrypt_HashFile(fullPath);
+            ObjectHash newHash = OriCrypt_HashFile(fullPath, sd->repo->isStreaming());
             modified = newHash != te.hash;
         }
     }
@@ -267,7 +267,7 @@ static int _diffToDirHelper(_scanHelperData *sd, const string &path)
         if (lb.totalSize() != newAttrs.getAs<size_t>(ATTR_FILESIZE) ||
                 newAttrs.getAs<time_t>(ATTR_MTIME) >= sd->commit->getTime()) {
 
-            ObjectHash newHash = OriCrypt_HashFile(fullPath);
+            ObjectHash newHash = OriCrypt_HashFile(fullPath, sd->repo->isStreaming());
             modified = newHash != te.largeHash;
         }
     }
@@ -749,6 +749,31 @@ TreeDiff::applyTo(Tree::Flat *flat) const
 Tree
 TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
 {
+    // Add the new and modified files in one batch
+    vector<string> paths;
+    vector<ObjectHash> prevs;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const TreeDiffEntry &tde = entries[i];
+        ObjectHash prev;
+
+        if (tde.newFilename == "")
+            continue;
+        if (tde.type == TreeDiffEntry::Modified) {
+            // The previous version is a good delta base
+            Tree::Flat::iterator it = flat.find(tde.filepath);
+            if (it != flat.end() && it->second.type == TreeEntry::Blob)
+                prev = it->second.hash;
+        } else if (tde.type != TreeDiffEntry::NewFile) {
+            continue;
+        }
+
+        paths.push_back(tde.newFilename);
+        prevs.push_back(prev);
+    }
+    vector<pair<ObjectHash, ObjectHash> > added = dest_repo->addFiles(paths,
+                                                                      prevs);
+    size_t nextAdded = 0;
+
     for (size_t i = 0; i < entries.size(); i++) {
         const TreeDiffEntry &tde = entries[i];
         if (tde.type == TreeDiffEntry::Noop) continue;
@@ -762,7 +787,7 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
             if (tde.newFilename == "") {
                 hashes = tde.hashes;
             } else {
-                hashes = dest_repo->addFile(tde.newFilename);
+                hashes = added[nextAdded++];
             }
             TreeEntry te(hashes.first, hashes.second);
             te.attrs.mergeFrom(tde.newAttrs);
@@ -799,7 +824,7 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
         else if (tde.type == TreeDiffEntry::Modified) {
             TreeEntry te = flat[tde.filepath];
             if (tde.newFilename != "") {
-                pair<ObjectHash, ObjectHash> hashes = dest_repo->addFile(tde.newFilename);
+                pair<ObjectHash, ObjectHash> hashes = added[nextAdded++];
                 te.hash = hashes.first;
                 te.largeHash = hashes.second;
                 te.type = (!hashes.second.isEmpty()) ? TreeEntry::LargeBlob :
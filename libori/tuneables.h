@@ -20,6 +20,23 @@
 #define COPYFILE_BUFSZ	(256 * 1024)
 
 #define LARGEFILE_MINIMUM (1024 * 1024)
+// Large files are read in buffers of this size, LARGEBLOB_BUFFERS at a time
+#define LARGEBLOB_BUFSZ (8 * 1024 * 1024)
+#define LARGEBLOB_BUFFERS 4
+// Room in front of each buffer for the unchunked tail of the previous one,
+// at least the largest chunk plus the hash window
+#define LARGEBLOB_HEADROOM (1024 * 1024)
+// Chunk bytes hashed per job and the hashing threads (0 for one per processor)
+#define LARGEBLOB_HASH_BATCH (1024 * 1024)
+#define LARGEBLOB_HASH_THREADS 0
+// Files of at least these sizes are chunked with 16 KB and 64 KB average
+// chunks instead of 4 KB
+#define LARGEBLOB_TIER_MEDIUM (256ULL * 1024 * 1024)
+#define LARGEBLOB_TIER_HUGE (4ULL * 1024 * 1024 * 1024)
+// Small files read ahead by Repo::addFiles and the threads reading them
+// (0 for one per processor)
+#define ADDFILES_INFLIGHT 64
+#define ADDFILES_THREADS 0
 
 // Minimum compressable object (FastLZ requires 66 bytes)
 #define ZIP_MINIMUM_SIZE 512
@@ -27,11 +44,62 @@
 #define COMPCHECK_BYTES 1024
 // Maximum compression ratio (0.8 means compressed file is 80% size of original)
 #define COMPCHECK_RATIO 0.95
+// Blobs up to this size use Snappy under the adaptive compression policy
+#define COMPRESSION_SMALLBLOB_SIZE (64 * 1024)
 
 // These are soft maximums ("heuristics")
 // 64 MB
 #define PACKFILE_MAXSIZE (1024*1024*64)
 #define PACKFILE_MAXOBJS (2048)
+// Packfile mappings are sized in multiples of this
+#define PACKFILE_MAP_GROWTH (8 * 1024 * 1024)
+// Staging buffer used when receiving objects into a packfile
+#define PACKFILE_STAGING_BUFSZ (4 * 1024 * 1024)
+// Garbage collection rewrites packfiles with at least this fraction unused
+#define GC_COMPACT_THRESHOLD 0.3
+// Repack merges ordered packfiles with less than this fraction of
+// PACKFILE_MAXSIZE and PACKFILE_MAXOBJS live into the new objects
+#define REPACK_UNDERSIZED 0.5
+// Packfiles not read for this long are recompressed with LZMA (30 days)
+#define PACKFILE_COLD_AGE (30 * 24 * 3600)
+// How often packfile access records are written (seconds)
+#define PFMGR_ACCESS_INTERVAL 300
+
+// Blobs of at least this size are stored as a delta against the previous
+// version of the file when the delta is at most DELTA_MAX_RATIO of the blob
+#define DELTA_MINIMUM_SIZE (4 * 1024)
+#define DELTA_MAX_RATIO 0.5
+// Longest chain of deltas to reconstruct an object (at most 15)
+#define DELTA_MAX_DEPTH 8
+
+// Payloads of objects up to this size are also cached in the index
+// (at most 255)
+#define INDEX_INLINE_MAX 48
+
+// Objects per request when copying what could not be hard linked
+#define LINK_COPY_BATCH 4096
+
+// Threads scanning packfiles in rebuildindex (0 for one per processor)
+#define REBUILDINDEX_THREADS 0
+// Interval between rebuildindex progress messages in milliseconds
+#define REBUILDINDEX_REPORT_MS 5000
+
+// Default scrubber budget: packfile bytes read per second and the share of
+// time spent scrubbing, done in slices of at most SCRUB_SLICE_MS
+#define SCRUB_BYTES_PER_SEC (8 * 1024 * 1024)
+#define SCRUB_CPU_PERCENT 10
+#define SCRUB_SLICE_MS 250
+// Pause between full scrubbing passes (1 week)
+#define SCRUB_PASS_INTERVAL (7 * 24 * 3600)
+
+// Checkpoint the reference counts after this many log records
+#define METADATALOG_CHECKPOINT_ENTRIES (256 * 1024)
+
+// Default memory budget of the decompressed object cache
+#define OBJCACHE_BUDGET (64 * 1024 * 1024)
+
+// Group commit interval in milliseconds
+#define DURABILITY_GROUP_INTERVAL 100
 
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
@@ -40,11 +108,10 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
-//#define ORI_USE_LZMA
-//#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
+// Default compression mode (none, fastlz, snappy, lzma or adaptive), may be
+// overridden per repository with the compression variable
+#ifndef ORI_DEFAULT_COMPRESSION
+#define ORI_DEFAULT_COMPRESSION "fastlz"
 #endif
 
 #endif /* __TUNEABLES_H__ */
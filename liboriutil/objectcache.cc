@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/objectcache.h>
+
+#include "tuneables.h"
+
+using namespace std;
+
+class ObjectCacheShard
+{
+public:
+    typedef list<ObjectHash> lru_list;
+    typedef unordered_map<ObjectHash,
+            pair<ObjectCache::Payload, lru_list::iterator> > lru_cache;
+
+    ObjectCacheShard()
+        : budget(0), bytes(0), hits(0), misses(0), evictions(0)
+    {
+    }
+
+    bool get(const ObjectHash &hash, ObjectCache::Payload &payload) {
+        unique_lock<mutex> l(lock);
+
+        lru_cache::iterator it = cache.find(hash);
+        if (it == cache.end()) {
+            misses++;
+            return false;
+        }
+
+        lru.splice(lru.end(), lru, (*it).second.second);
+        payload = (*it).second.first;
+        hits++;
+        return true;
+    }
+    void put(const ObjectHash &hash, const ObjectCache::Payload &payload) {
+        unique_lock<mutex> l(lock);
+
+        if (cache.find(hash) != cache.end())
+            return;
+
+        lru_list::iterator p = lru.insert(lru.end(), hash);
+        cache[hash] = make_pair(payload, p);
+        bytes += payload->size();
+        evict();
+    }
+    void invalidate(const ObjectHash &hash) {
+        unique_lock<mutex> l(lock);
+
+        lru_cache::iterator it = cache.find(hash);
+        if (it == cache.end())
+            return;
+
+        remove(it);
+    }
+    void clear() {
+        unique_lock<mutex> l(lock);
+
+        lru.clear();
+        cache.clear();
+        bytes = 0;
+    }
+    void setBudget(size_t b) {
+        unique_lock<mutex> l(lock);
+
+        budget = b;
+        evict();
+    }
+    void addStats(ObjectCache::Stats &stats) {
+        unique_lock<mutex> l(lock);
+
+        stats.hits += hits;
+        stats.misses += misses;
+        stats.evictions += evictions;
+        stats.entries += cache.size();
+        stats.bytes += bytes;
+    }
+private:
+    void evict() {
+        while (bytes > budget && !lru.empty()) {
+            remove(cache.find(lru.front()));
+            evictions++;
+        }
+    }
+    void remove(lru_cache::iterator it) {
+        bytes -= (*it).second.first->size();
+        lru.erase((*it).second.second);
+        cache.erase(it);
+    }
+
+    mutex lock;
+    lru_list lru;
+    lru_cache cache;
+    size_t budget;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+ObjectCache::ObjectCache(size_t budget)
+    : shards(), budget(0)
+{
+    for (int i = 0; i < OBJCACHE_SHARDS; i++)
+        shards.push_back(new ObjectCacheShard());
+    setBudget(budget);
+}
+
+ObjectCache::~ObjectCache()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        delete shards[i];
+}
+
+void
+ObjectCache::setBudget(size_t b)
+{
+    budget = b;
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->setBudget(budget / shards.size());
+}
+
+size_t
+ObjectCache::getBudget() const
+{
+    return budget;
+}
+
+size_t
+ObjectCache::maxObjectSize() const
+{
+    // Keep a single object from flushing a whole shard
+    return budget / shards.size() / 4;
+}
+
+ObjectCacheShard *
+ObjectCache::getShard(const ObjectHash &hash) const
+{
+    // Hashes are uniformly distributed so any byte will do
+    return shards[hash.hash[1] % shards.size()];
+}
+
+bool
+ObjectCache::get(const ObjectHash &hash, Payload &payload)
+{
+    if (budget == 0)
+        return false;
+
+    return getShard(hash)->get(hash, payload);
+}
+
+void
+ObjectCache::put(const ObjectHash &hash, const Payload &payload)
+{
+    if (payload->size() > maxObjectSize())
+        return;
+
+    getShard(hash)->put(hash, payload);
+}
+
+void
+ObjectCache::invalidate(const ObjectHash &hash)
+{
+    getShard(hash)->invalidate(hash);
+}
+
+void
+ObjectCache::clear()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->clear();
+}
+
+ObjectCache::Stats
+ObjectCache::getStats() const
+{
+    Stats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->addStats(stats);
+
+    return stats;
+}
+
+static ObjectHash
+ObjectCacheTestHash(int i)
+{
+    ObjectHash hash;
+
+    memset(hash.hash, 0, ObjectHash::SIZE);
+    memcpy(hash.hash, &i, sizeof(i));
+    hash.hash[ObjectHash::SIZE - 1] = 1;
+    return hash;
+}
+
+int
+ObjectCache_selfTest(void)
+{
+    ObjectCache cache(OBJCACHE_SHARDS * 4096);
+    ObjectCache::Payload p;
+
+    cout << "Testing ObjectCache ..." << endl;
+
+    // Every key below maps to the first shard
+    ObjectHash a = ObjectCacheTestHash(0);
+    ObjectHash b = ObjectCacheTestHash(OBJCACHE_SHARDS << 8);
+    ObjectHash c = ObjectCacheTestHash(2 * OBJCACHE_SHARDS << 8);
+
+    cache.put(a, ObjectCache::Payload(new string(1000, 'a')));
+    cache.put(b, ObjectCache::Payload(new string(1000, 'b')));
+    assert(cache.get(a, p) && *p == string(1000, 'a'));
+    assert(cache.get(b, p) && *p == string(1000, 'b'));
+
+    // Objects over a quarter of a shard are not cached
+    cache.put(c, ObjectCache::Payload(new string(2000, 'c')));
+    assert(!cache.get(c, p));
+
+    // Byte budget evicts the least recently used entry
+    cache.get(a, p);
+    cache.put(c, ObjectCache::Payload(new string(1000, 'c')));
+    cache.put(ObjectCacheTestHash(3 * OBJCACHE_SHARDS << 8),
+              ObjectCache::Payload(new string(1000, 'd')));
+    cache.put(ObjectCacheTestHash(4 * OBJCACHE_SHARDS << 8),
+              ObjectCache::Payload(new string(1000, 'e')));
+    assert(cache.get(a, p));
+    assert(!cache.get(b, p));
+
+    cache.invalidate(a);
+    assert(!cache.get(a, p));
+
+    ObjectCache::Stats stats = cache.getStats();
+    assert(stats.entries == 3);
+    assert(stats.bytes == 3000);
+    assert(stats.evictions == 1);
+    assert(stats.hits == 4);
+
+    cache.clear();
+    assert(cache.getStats().bytes == 0);
+
+    // A zero budget disables the cache
+    cache.setBudget(0);
+    cache.put(a, ObjectCache::Payload(new string(10, 'a')));
+    assert(!cache.get(a, p));
+
+    return 0;
+}
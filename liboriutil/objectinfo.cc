@@ -113,6 +113,10 @@ ObjectInfo::getAlgo() const {
             return ZIPALGO_FASTLZ;
         case ORI_FLAG_LZMA:
             return ZIPALGO_LZMA;
+        case ORI_FLAG_SNAPPY:
+            return ZIPALGO_SNAPPY;
+        case ORI_FLAG_FASTLZ_FRAMED:
+            return ZIPALGO_FASTLZ_FRAMED;
         default:
             return ZIPALGO_UNKNOWN;
     }
@@ -121,6 +125,7 @@ ObjectInfo::getAlgo() const {
 void
 ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
 {
+    flags &= ~ORI_FLAG_ZIPMASK;
     switch (algo) {
         case ZIPALGO_NONE:
             flags |= ORI_FLAG_UNCOMPRESSED;
@@ -131,6 +136,12 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
         case ZIPALGO_LZMA:
             flags |= ORI_FLAG_LZMA;
             break;
+        case ZIPALGO_SNAPPY:
+            flags |= ORI_FLAG_SNAPPY;
+            break;
+        case ZIPALGO_FASTLZ_FRAMED:
+            flags |= ORI_FLAG_FASTLZ_FRAMED;
+            break;
         case ZIPALGO_UNKNOWN:
         default:
             NOT_IMPLEMENTED(false);
@@ -138,6 +149,26 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
     }
 }
 
+bool
+ObjectInfo::isDelta() const
+{
+    return (flags & ORI_FLAG_DELTAMASK) != 0;
+}
+
+uint32_t
+ObjectInfo::getDeltaDepth() const
+{
+    return (flags & ORI_FLAG_DELTAMASK) >> ORI_FLAG_DELTASHIFT;
+}
+
+void
+ObjectInfo::setDeltaDepth(uint32_t depth)
+{
+    ASSERT(depth <= (ORI_FLAG_DELTAMASK >> ORI_FLAG_DELTASHIFT));
+    flags &= ~ORI_FLAG_DELTAMASK;
+    flags |= depth << ORI_FLAG_DELTASHIFT;
+}
+
 bool ObjectInfo::operator <(const ObjectInfo &other) const {
     if (hash < other.hash) return true;
     if (type < other.type) return true;
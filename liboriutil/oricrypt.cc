@@ -40,6 +40,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
 
 #include "tuneables.h"
@@ -97,7 +98,7 @@ OriCrypt_HashBlob(const uint8_t *data, size_t len)
  * Compute SHA 256 hash for a file.
  */
 ObjectHash
-OriCrypt_HashFile(const string &path)
+OriCrypt_HashFile(const string &path, bool streaming)
 {
     int fd;
     char buf[HASHFILE_BUFSZ];
@@ -119,6 +120,9 @@ OriCrypt_HashFile(const string &path)
         return ObjectHash();
     }
 
+    if (streaming)
+        OriFile_AdviseSequential(fd);
+
     bytesLeft = sb.st_size;
     while(bytesLeft > 0) {
         bytesRead = read(fd, buf, MIN(bytesLeft, HASHFILE_BUFSZ));
@@ -130,8 +134,13 @@ OriCrypt_HashFile(const string &path)
         }
 
         SHA256_Update(&state, buf, bytesRead);
+        if (streaming)
+            OriFile_DropCache(fd, sb.st_size - bytesLeft, bytesRead);
         bytesLeft -= bytesRead;
     }
+    // Pages still being read ahead may have been skipped above
+    if (streaming)
+        OriFile_DropCache(fd, 0, sb.st_size);
 
     SHA256_Final(hash.hash, &state);
 
@@ -142,6 +151,91 @@ OriCrypt_HashFile(const string &path)
 
 #endif
 
+/*
+ * CRC32C (Castagnoli) used to protect on-disk metadata blocks.  This is not a
+ * cryptographic hash, it only detects torn or corrupt writes cheaply.  We use
+ * the SSE 4.2 crc32 instruction when the processor supports it.
+ */
+#define CRC32C_POLY     0x82F63B78
+
+static uint32_t crc32cTable[256];
+
+static bool
+crc32cInitTable()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        crc32cTable[i] = crc;
+    }
+    return true;
+}
+
+static bool crc32cTableReady = crc32cInitTable();
+
+static uint32_t
+crc32cSoftware(uint32_t crc, const uint8_t *data, size_t len)
+{
+    while (len--) {
+        crc = crc32cTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cHardware(uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        len--;
+    }
+    while (len >= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)data);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        len--;
+    }
+
+    return (uint32_t)crc64;
+}
+
+static bool
+crc32cDetectHardware()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static bool crc32cHasHardware = crc32cDetectHardware();
+#endif
+
+/*
+ * Compute the CRC32C of a buffer, crc is the result of a previous call when
+ * checksumming data in pieces.
+ */
+uint32_t
+OriCrypt_CRC32C(const uint8_t *data, size_t len, uint32_t crc)
+{
+    ASSERT(crc32cTableReady);
+
+    crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (crc32cHasHardware)
+        return ~crc32cHardware(crc, data, len);
+#endif
+    return ~crc32cSoftware(crc, data, len);
+}
+
 
 /*
  * Encrypts the plaintext given a key and a randomly generated salt. The salt 
@@ -246,6 +340,18 @@ OriCrypt_selfTest()
 
     cout << "Testing OriCrypt ..." << endl;
 
+    const uint8_t crcVector[] = "123456789";
+    if (OriCrypt_CRC32C(crcVector, 9) != 0xE3069283 ||
+        crc32cSoftware(~0U, crcVector, 9) != ~0xE3069283) {
+        cout << "Error CRC32C does not match test vector!" << endl;
+        return -1;
+    }
+    if (OriCrypt_CRC32C(crcVector + 4, 5, OriCrypt_CRC32C(crcVector, 4))
+            != 0xE3069283) {
+        cout << "Error CRC32C does not compose!" << endl;
+        return -1;
+    }
+
     while (tests[i] != "") {
         c = OriCrypt_Encrypt(tests[i], key);
         p = OriCrypt_Decrypt(c, key);
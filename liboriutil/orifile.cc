@@ -353,6 +353,51 @@ OriFile_Rename(const std::string &from, const std::string &to)
     return 0;
 }
 
+void
+OriFile_AdviseSequential(int fd)
+{
+#if defined(__APPLE__)
+    // No fadvise, bypass the cache instead
+    fcntl(fd, F_NOCACHE, 1);
+#elif defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+void
+OriFile_StartWriteback(int fd, off_t off, off_t len)
+{
+    if (len == 0)
+        return;
+
+#if defined(__linux__)
+    sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+/*
+ * Dirty pages are not dropped by POSIX_FADV_DONTNEED, so written ranges are
+ * written back and waited for before they are dropped.
+ */
+void
+OriFile_DropCache(int fd, off_t off, off_t len, bool written)
+{
+    if (len == 0)
+        return;
+
+#if defined(POSIX_FADV_DONTNEED)
+    if (written) {
+#if defined(__linux__)
+        sync_file_range(fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+        fsync(fd);
+#endif
+    }
+    posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
 std::string
 OriFile_Basename(const std::string &path)
 {
@@ -27,9 +27,8 @@
 #include <fcntl.h>
 #endif
 
-#ifdef ORI_USE_FASTLZ
 #include "fastlz.h"
-#endif /* ORI_USE_FASTLZ */
+#include "snappy.h"
 
 #include <string>
 
@@ -119,6 +118,21 @@ bool bytestream::readExact(uint8_t *buf, size_t n)
     return true;
 }
 
+bool bytestream::skip(size_t n)
+{
+    uint8_t buf[COMPFILE_BUFSZ];
+
+    while (n > 0) {
+        size_t readBytes = read(buf, MIN(n, sizeof(buf)));
+        if (error() || readBytes == 0)
+            return false;
+        n -= readBytes;
+        skipped += readBytes;
+    }
+
+    return true;
+}
+
 std::string bytestream::readAll() {
     std::string rval;
 
@@ -138,8 +152,9 @@ std::string bytestream::readAll() {
         return rval;
     }
     else {
-        rval.resize(sizeHint());
-        readExact((uint8_t*)&rval[0], sizeHint());
+        ASSERT(skipped <= sizeHint());
+        rval.resize(sizeHint() - skipped);
+        readExact((uint8_t*)&rval[0], rval.size());
         if (error()) {
             return "";
         }
@@ -436,6 +451,33 @@ size_t strstream::sizeHint() const
     return len;
 }
 
+/*
+ * memstream
+ */
+
+memstream::memstream(const uint8_t *buf, size_t len,
+                     std::shared_ptr<const void> owner)
+    : buf(buf), off(0), len(len), owner(owner)
+{
+}
+
+bool memstream::ended() {
+    return off >= len;
+}
+
+size_t memstream::read(uint8_t *out, size_t n)
+{
+    size_t to_read = MIN(n, len - off);
+    memcpy(out, buf + off, to_read);
+    off += to_read;
+    return to_read;
+}
+
+size_t memstream::sizeHint() const
+{
+    return len;
+}
+
 /*
  * fdstream
  */
@@ -520,41 +562,403 @@ size_t diskstream::sizeHint() const {
     return source->sizeHint();
 }
 
-#ifdef ORI_USE_LZMA
-
 /*
- * LZMA zipstream
+ * zipstream
  */
 
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source), size_hint(size_hint), output_ended(false)
+zipstream::zipstream(bytestream *source, bool compress, size_t size_hint,
+                     ObjectInfo::ZipAlgo algo)
+    : source(source),
+      size_hint(size_hint),
+      algo(algo),
+      compress(compress),
+      output_ended(false),
+
+      input_processed(false),
+      offset(0),
+      consumed(0),
+      frame_input(0)
 {
     assert(source != NULL);
 
-    lzma_stream strm2 = LZMA_STREAM_INIT;
-    memcpy(&strm, &strm2, sizeof(lzma_stream));
-
-    if (compress) {
-        lzma_ret ret = lzma_easy_encoder(&strm, 0, LZMA_CHECK_NONE);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_easy_encoder", ret);
-    }
-    else {
-        lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_stream_decoder", ret);
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+            break;
+        case ObjectInfo::ZIPALGO_FASTLZ:
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            if (size_hint > 0 && !compress) {
+                output.resize(size_hint);
+            }
+            break;
+        case ObjectInfo::ZIPALGO_FASTLZ_FRAMED:
+            break;
+        case ObjectInfo::ZIPALGO_LZMA:
+        {
+#ifdef ORI_USE_LZMA
+            lzma_stream strm2 = LZMA_STREAM_INIT;
+            memcpy(&strm, &strm2, sizeof(lzma_stream));
+            in_buf.resize(COMPFILE_BUFSZ);
+
+            if (compress) {
+                lzma_ret ret = lzma_easy_encoder(&strm, 0, LZMA_CHECK_NONE);
+                if (ret != LZMA_OK)
+                    setLzmaErr("lzma_easy_encoder", ret);
+            }
+            else {
+                lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+                if (ret != LZMA_OK)
+                    setLzmaErr("lzma_stream_decoder", ret);
+            }
+#else
+            last_error = "LZMA support was not compiled in";
+#endif /* ORI_USE_LZMA */
+            break;
+        }
+        case ObjectInfo::ZIPALGO_UNKNOWN:
+            last_error = "Unknown compression algorithm";
+            break;
     }
 }
 
 zipstream::~zipstream() {
+#ifdef ORI_USE_LZMA
+    if (algo == ObjectInfo::ZIPALGO_LZMA && !output_ended)
+        lzma_end(&strm);
+#endif /* ORI_USE_LZMA */
     delete source;
 }
 
+bool
+zipstream::isSupported(ObjectInfo::ZipAlgo algo)
+{
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+        case ObjectInfo::ZIPALGO_FASTLZ:
+        case ObjectInfo::ZIPALGO_SNAPPY:
+        case ObjectInfo::ZIPALGO_FASTLZ_FRAMED:
+            return true;
+        case ObjectInfo::ZIPALGO_LZMA:
+#ifdef ORI_USE_LZMA
+            return true;
+#else
+            return false;
+#endif /* ORI_USE_LZMA */
+        case ObjectInfo::ZIPALGO_UNKNOWN:
+            return false;
+    }
+    return false;
+}
+
 bool zipstream::ended() {
+    if (algo == ObjectInfo::ZIPALGO_NONE)
+        return source->ended();
     return output_ended || error();
 }
 
 size_t zipstream::read(uint8_t *buf, size_t n) {
+    if (error()) return 0;
+
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+        {
+            size_t read_bytes = source->read(buf, n);
+            inheritError(source);
+            offset += read_bytes;
+            return read_bytes;
+        }
+        case ObjectInfo::ZIPALGO_FASTLZ:
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return readBlock(buf, n);
+        case ObjectInfo::ZIPALGO_FASTLZ_FRAMED:
+            return readFramed(buf, n);
+        case ObjectInfo::ZIPALGO_LZMA:
+#ifdef ORI_USE_LZMA
+            return readLzma(buf, n);
+#endif /* ORI_USE_LZMA */
+        case ObjectInfo::ZIPALGO_UNKNOWN:
+            break;
+    }
+
+    return 0;
+}
+
+size_t zipstream::sizeHint() const {
+    return size_hint;
+}
+
+size_t zipstream::inputConsumed() const {
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+            return offset;
+        case ObjectInfo::ZIPALGO_FASTLZ_FRAMED:
+            if (!compress || output.size() == 0)
+                return consumed;
+            // Input behind the part of the current frame already read
+            return consumed - frame_input +
+                (size_t)((offset / (float)output.size()) * frame_input);
+        case ObjectInfo::ZIPALGO_LZMA:
+#ifdef ORI_USE_LZMA
+            return strm.total_in;
+#else
+            return 0;
+#endif /* ORI_USE_LZMA */
+        default:
+            if (output.size() == 0)
+                return 0;
+            return (size_t)((offset / (float)output.size()) * input.size());
+    }
+}
+
+/*
+ * FastLZ and Snappy compress the whole input in one call.
+ */
+size_t zipstream::readBlock(uint8_t *buf, size_t n) {
+    if (output_ended) return 0;
+
+    if (!input_processed) {
+        input = source->readAll();
+        if (inheritError(source)) return 0;
+
+        if (algo == ObjectInfo::ZIPALGO_FASTLZ) {
+            if (output.size() == 0) {
+                NOT_IMPLEMENTED(compress);
+                // FastLZ may expand the input by up to 5%, min 66 bytes
+                output.resize(MAX(input.size() * 1.3, 66));
+            }
+
+            int finalSize = 0;
+            if (compress) {
+                finalSize = fastlz_compress(&input[0], input.size(),
+                                            &output[0]);
+                if (finalSize == 0) {
+                    last_error = "FastLZ couldn't compress";
+                    return 0;
+                }
+            } else {
+                finalSize = fastlz_decompress(&input[0], input.size(),
+                                              &output[0], output.size());
+                if (finalSize == 0) {
+                    last_error = "FastLZ couldn't decompress";
+                    return 0;
+                }
+            }
+            output.resize(finalSize);
+        } else {
+            string result;
+            if (compress) {
+                snappy::Compress(input.data(), input.size(), &result);
+            } else if (!snappy::Uncompress(input.data(), input.size(),
+                                           &result)) {
+                last_error = "Snappy couldn't decompress";
+                return 0;
+            }
+            output.assign(result.begin(), result.end());
+        }
+
+        input_processed = true;
+    }
+
+    size_t to_copy = MIN(n, output.size() - offset);
+    if (to_copy > 0)
+        memcpy(buf, &output[offset], to_copy);
+    offset += to_copy;
+
+    if (offset == output.size())
+        output_ended = true;
+
+    return to_copy;
+}
+
+/*
+ * Framed FastLZ, each call to compressFrame or decompressFrame replaces the
+ * contents of output with the next piece of the stream.
+ */
+#define ZIPFRAME_RAW    0x80000000
+
+size_t zipstream::readFramed(uint8_t *buf, size_t n) {
+    size_t total = 0;
+
+    while (total < n && !output_ended) {
+        if (offset == output.size()) {
+            output.clear();
+            offset = 0;
+
+            bool more = compress ? compressFrame() : decompressFrame();
+            if (error()) return 0;
+            if (!more && output.size() == 0) {
+                output_ended = true;
+                break;
+            }
+        }
+
+        size_t to_copy = MIN(n - total, output.size() - offset);
+        memcpy(buf + total, &output[offset], to_copy);
+        offset += to_copy;
+        total += to_copy;
+    }
+
+    return total;
+}
+
+/*
+ * Appends the next frame to output, or the terminator and trailer once the
+ * source is exhausted.  Returns false after the trailer.
+ */
+bool zipstream::compressFrame() {
+    if (input_processed)
+        return false;
+
+    frame.resize(ZIPFRAME_SIZE);
+    size_t len = 0;
+    while (len < ZIPFRAME_SIZE && !source->ended()) {
+        size_t read_bytes = source->read(&frame[len], ZIPFRAME_SIZE - len);
+        if (inheritError(source)) return false;
+        if (read_bytes == 0)
+            break;
+        len += read_bytes;
+    }
+    consumed += len;
+    frame_input = len;
+
+    strwstream ss;
+    if (len == 0) {
+        ss.writeUInt32(0);
+        for (size_t i = 0; i < frame_table.size(); i++)
+            ss.writeUInt32(frame_table[i]);
+        ss.writeUInt32(ZIPFRAME_SIZE);
+        ss.writeUInt32(frame_table.size());
+        input_processed = true;
+    } else {
+        // FastLZ may expand the input by up to 5%, min 66 bytes
+        string comp(MAX(len * 1.05, 66), '\0');
+        int compLen = 0;
+        if (len >= 16)
+            compLen = fastlz_compress(&frame[0], len, &comp[0]);
+
+        if (compLen > 0 && (size_t)compLen < len) {
+            ss.writeUInt32(compLen);
+            ss.write(comp.data(), compLen);
+        } else {
+            ss.writeUInt32(ZIPFRAME_RAW | len);
+            ss.write(&frame[0], len);
+        }
+        frame_table.push_back(ss.str().size());
+    }
+
+    const string &str = ss.str();
+    output.assign(str.begin(), str.end());
+    return !input_processed;
+}
+
+/*
+ * Decompresses the next frame into output.  Returns false at the terminator.
+ */
+bool zipstream::decompressFrame() {
+    uint8_t hdr[4];
+    size_t len = 0;
+
+    while (len < 4) {
+        size_t read_bytes = source->read(hdr + len, 4 - len);
+        if (inheritError(source)) return false;
+        if (read_bytes == 0) {
+            last_error = "Framed stream truncated";
+            return false;
+        }
+        len += read_bytes;
+    }
+
+    uint32_t header = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+                      ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3];
+    if (header == 0)
+        return false;
+
+    size_t stored = header & ~ZIPFRAME_RAW;
+    if (stored > ZIPFRAME_SIZE) {
+        last_error = "Framed stream corrupt";
+        return false;
+    }
+
+    frame.resize(stored);
+    len = 0;
+    while (len < stored) {
+        size_t read_bytes = source->read(&frame[len], stored - len);
+        if (inheritError(source)) return false;
+        if (read_bytes == 0) {
+            last_error = "Framed stream truncated";
+            return false;
+        }
+        len += read_bytes;
+    }
+    consumed += 4 + stored;
+
+    if (header & ZIPFRAME_RAW) {
+        output.assign(frame.begin(), frame.end());
+    } else {
+        output.resize(ZIPFRAME_SIZE);
+        int finalSize = fastlz_decompress(&frame[0], stored, &output[0],
+                                          output.size());
+        if (finalSize == 0) {
+            last_error = "FastLZ couldn't decompress";
+            return false;
+        }
+        output.resize(finalSize);
+    }
+
+    return true;
+}
+
+size_t
+zipstream::trailerSize(const string &last8)
+{
+    if (last8.size() != 8)
+        return 0;
+
+    strstream ss(last8);
+    uint32_t frameSize = ss.readUInt32();
+    uint32_t count = ss.readUInt32();
+    if (frameSize == 0)
+        return 0;
+
+    return 4 * (size_t)count + 8;
+}
+
+size_t
+zipstream::frameSize()
+{
+    return ZIPFRAME_SIZE;
+}
+
+bool
+zipstream::findFrame(const string &tail, size_t offset, size_t &storedOff,
+                     size_t &frameOff)
+{
+    if (tail.size() < 8)
+        return false;
+
+    strstream ss(tail);
+    vector<uint32_t> table((tail.size() - 8) / 4);
+    for (size_t i = 0; i < table.size(); i++)
+        table[i] = ss.readUInt32();
+    uint32_t frameSize = ss.readUInt32();
+    uint32_t count = ss.readUInt32();
+    if (frameSize == 0 || count != table.size())
+        return false;
+
+    size_t ix = offset / frameSize;
+    if (ix >= count)
+        return false;
+
+    storedOff = 0;
+    for (size_t i = 0; i < ix; i++)
+        storedOff += table[i];
+    frameOff = ix * frameSize;
+
+    return true;
+}
+
+#ifdef ORI_USE_LZMA
+
+size_t zipstream::readLzma(uint8_t *buf, size_t n) {
     if (output_ended) return 0;
 
     lzma_action action = source->ended() ? LZMA_FINISH : LZMA_RUN;
@@ -566,11 +970,11 @@ size_t zipstream::read(uint8_t *buf, size_t n) {
         if (output_ended) break;
 
         if (strm.avail_in == 0) {
-            size_t read_bytes = source->read(in_buf, COMPFILE_BUFSZ);
+            size_t read_bytes = source->read(&in_buf[0], in_buf.size());
             if (inheritError(source)) return 0;
             action = read_bytes == 0 ? LZMA_FINISH : LZMA_RUN;
 
-            strm.next_in = in_buf;
+            strm.next_in = &in_buf[0];
             strm.avail_in = read_bytes;
         }
 
@@ -588,14 +992,6 @@ size_t zipstream::read(uint8_t *buf, size_t n) {
     return strm.total_out - begin_total;
 }
 
-size_t zipstream::sizeHint() const {
-    return size_hint;
-}
-
-size_t zipstream::inputConsumed() const {
-    return strm.total_in;
-}
-
 const char *lzma_ret_str(lzma_ret ret) {
     switch (ret) {
     case LZMA_STREAM_END:
@@ -635,86 +1031,6 @@ void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
 
 #endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
-
-/*
- * FastLZ zipstream
- */
-
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source),
-      size_hint(size_hint),
-
-      compress(compress),
-      input_processed(false),
-
-      offset(0),
-      output_ended(false)
-{
-    assert(source != NULL);
-    if (size_hint > 0) {
-        output.resize(size_hint);
-    }
-}
-
-zipstream::~zipstream() {
-    delete source;
-}
-
-bool zipstream::ended() {
-    return output_ended; // || error();
-}
-
-size_t zipstream::read(uint8_t *buf, size_t n) {
-    if (output_ended) return 0;
-
-    if (!input_processed) {
-        input = source->readAll();
-        if (output.size() == 0) {
-            NOT_IMPLEMENTED(compress);
-            output.resize(input.size() * 1.3);
-        }
-
-        int finalSize = 0;
-	if (compress) {
-	    finalSize = fastlz_compress(&input[0], input.size(), &output[0]);
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't compress";
-                return 0;
-            }
-	} else {
-	    finalSize = fastlz_decompress(&input[0], input.size(), &output[0],
-                    output.size());
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't decompress";
-                return 0;
-            }
-	}
-
-        output.resize(finalSize);
-	input_processed = true;
-    }
-
-    size_t to_copy = MIN(n, output.size() - offset);
-    memcpy(buf, &output[offset], to_copy);
-    offset += to_copy;
-
-    if (offset == output.size())
-	output_ended = true;
-
-    return to_copy;
-}
-
-size_t zipstream::sizeHint() const {
-    return size_hint;
-}
-
-size_t zipstream::inputConsumed() const {
-    return (size_t)((offset / (float)output.size()) * input.size());
-}
-
-#endif /* ORI_USE_FASTLZ */
-
 /*
  * bytewstream
  */
@@ -25,6 +25,8 @@ int LRUCache_selfTest(void);
 int KVSerializer_selfTest(void);
 int OriCrypt_selfTest(void);
 int Key_selfTest(void);
+int ThreadPool_selfTest(void);
+int ObjectCache_selfTest(void);
 
 int
 main(int argc, const char *argv[])
@@ -36,6 +38,8 @@ main(int argc, const char *argv[])
     result += LRUCache_selfTest();
     result += KVSerializer_selfTest();
     result += OriCrypt_selfTest();
+    result += ThreadPool_selfTest();
+    result += ObjectCache_selfTest();
     //result += Key_selfTest();
 
     if (result == 0) {
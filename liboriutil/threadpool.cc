@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <unistd.h>
+
+#include <iostream>
+#include <atomic>
+#include <stdexcept>
+#include <exception>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include <oriutil/debug.h>
+#include <oriutil/thread.h>
+#include <oriutil/threadpool.h>
+
+#include "tuneables.h"
+
+using namespace std;
+
+class ThreadPoolWorker : public Thread
+{
+public:
+    ThreadPoolWorker(ThreadPool *pool)
+        : Thread("ThreadPoolWorker"), pool(pool)
+    {
+    }
+    void run() {
+        pool->workerLoop();
+    }
+private:
+    ThreadPool *pool;
+};
+
+ThreadPool::ThreadPool(int threads, size_t maxQueued)
+    : lock(), jobCV(), spaceCV(), idleCV(), jobs(), workers(),
+      maxQueued(maxQueued), running(0), stopping(false), error()
+{
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (int)cpus : 1;
+    }
+    if (this->maxQueued == 0) {
+        this->maxQueued = threads * THREADPOOL_QUEUE_PER_THREAD;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        ThreadPoolWorker *w = new ThreadPoolWorker(this);
+        workers.push_back(w);
+        w->start();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        unique_lock<mutex> l(lock);
+        stopping = true;
+    }
+    jobCV.notify_all();
+
+    // Workers drain the queue before exiting
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+
+    if (error)
+        WARNING("ThreadPool: a job failed and nobody waited for it");
+}
+
+void
+ThreadPool::enqueue(const Job &job)
+{
+    unique_lock<mutex> l(lock);
+
+    ASSERT(!stopping);
+    while (jobs.size() >= maxQueued) {
+        spaceCV.wait(l);
+    }
+    jobs.push_back(job);
+    jobCV.notify_one();
+}
+
+void
+ThreadPool::waitIdle()
+{
+    unique_lock<mutex> l(lock);
+
+    while (!jobs.empty() || running != 0) {
+        idleCV.wait(l);
+    }
+
+    if (error) {
+        exception_ptr e = error;
+        error = exception_ptr();
+        rethrow_exception(e);
+    }
+}
+
+int
+ThreadPool::getThreads() const
+{
+    return (int)workers.size();
+}
+
+void
+ThreadPool::workerLoop()
+{
+    unique_lock<mutex> l(lock);
+
+    while (true) {
+        while (jobs.empty() && !stopping) {
+            jobCV.wait(l);
+        }
+        if (jobs.empty())
+            break;
+
+        Job job = jobs.front();
+        jobs.pop_front();
+        running++;
+        spaceCV.notify_one();
+
+        l.unlock();
+        try {
+            job();
+        } catch (...) {
+            l.lock();
+            if (!error)
+                error = current_exception();
+            l.unlock();
+        }
+        l.lock();
+
+        running--;
+        if (jobs.empty() && running == 0)
+            idleCV.notify_all();
+    }
+}
+
+int
+ThreadPool_selfTest(void)
+{
+    atomic<int> count(0);
+
+    cout << "Testing ThreadPool ..." << endl;
+
+    {
+        ThreadPool pool(4, 2);
+        for (int i = 0; i < 1000; i++) {
+            pool.enqueue([&count]() { count++; });
+        }
+        pool.waitIdle();
+        assert(count == 1000);
+
+        // Destruction runs the remaining jobs
+        for (int i = 0; i < 100; i++) {
+            pool.enqueue([&count]() { ::usleep(100); count++; });
+        }
+    }
+    assert(count == 1100);
+
+    // Failed jobs are reported once by waitIdle
+    {
+        ThreadPool pool(4, 2);
+        bool thrown = false;
+
+        count = 0;
+        for (int i = 0; i < 100; i++) {
+            pool.enqueue([&count, i]() {
+                count++;
+                if (i % 10 == 0)
+                    throw runtime_error("job failed");
+            });
+        }
+        try {
+            pool.waitIdle();
+        } catch (runtime_error &e) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(count == 100);
+        pool.waitIdle();
+    }
+
+    return 0;
+}
+
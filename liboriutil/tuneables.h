@@ -20,6 +20,14 @@
 #define COPYFILE_BUFSZ	(256 * 1024)
 #define HASHFILE_BUFSZ	(256 * 1024)
 #define COMPFILE_BUFSZ  (16 * 1024)
+// Uncompressed size of each frame in framed FastLZ streams
+#define ZIPFRAME_SIZE   (64 * 1024)
+
+// Pending jobs allowed per ThreadPool worker before enqueue blocks
+#define THREADPOOL_QUEUE_PER_THREAD 4
+
+// Independently locked partitions of an ObjectCache
+#define OBJCACHE_SHARDS 16
 
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
@@ -28,12 +36,8 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
+// FastLZ and Snappy are always available, LZMA requires liblzma
 //#define ORI_USE_LZMA
-//#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
-#endif
 
 #endif /* __TUNEABLES_H__ */
 
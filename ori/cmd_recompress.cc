@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <iostream>
+
+#include <ori/udsclient.h>
+#include <ori/udsrepo.h>
+
+using namespace std;
+
+extern UDSRepo repository;
+
+/*
+ * Recompress packfiles that have not been read for a long time.
+ */
+int
+cmd_recompress(int argc, char * const argv[])
+{
+    strwstream req;
+
+    req.writePStr("recompress");
+
+    strstream resp = repository.callExt("FUSE", req.str());
+    if (resp.ended()) {
+        cout << "recompress failed with an unknown error!" << endl;
+        return 1;
+    }
+
+    if (resp.readUInt8() != 0) {
+        string msg;
+        resp.readPStr(msg);
+        cout << msg << endl;
+        return 1;
+    }
+
+    cout << "Recompressed " << resp.readUInt64() << " packfiles" << endl;
+
+    return 0;
+}
+
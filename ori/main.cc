@@ -85,10 +85,12 @@ int cmd_newfs(int argc, char * const argv[]);
 int cmd_pull(int argc, char * const argv[]);
 int cmd_rebuildindex(int argc, char * const argv[]);
 int cmd_rebuildrefs(int argc, char * const argv[]);
+int cmd_recompress(int argc, char * const argv[]);
 int cmd_remote(int argc, char * const argv[]);
 void usage_removefs();
 int cmd_removefs(int argc, char * const argv[]);
 int cmd_removekey(int argc, char * const argv[]);
+int cmd_repack(int argc, char * const argv[]);
 void usage_replicate(void);
 int cmd_replicate(int argc, char * const argv[]);
 int cmd_setkey(int argc, char * const argv[]);
@@ -234,6 +236,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_FUSE | CMD_DEBUG,
     },
+    {
+        "recompress",
+        "Recompress packfiles that are rarely read",
+        cmd_recompress,
+        NULL,
+        CMD_NEED_FUSE,
+    },
     {
         "remote",
         "Remote connection management",
@@ -255,6 +264,13 @@ static Cmd commands[] = {
         NULL,
         CMD_EXPERIMENTAL,
     },
+    {
+        "repack",
+        "Rewrite packfiles in snapshot order",
+        cmd_repack,
+        NULL,
+        CMD_NEED_FUSE,
+    },
     {
         "replicate",
         "Create a local replica",
@@ -44,6 +44,7 @@
 #include <ori/version.h>
 #include <ori/repostore.h>
 #include <ori/localrepo.h>
+#include <ori/scrubber.h>
 #include <ori/httpserver.h>
 
 using namespace std;
@@ -62,6 +63,7 @@ usage()
     cout << "    -m         Enable mDNS (default)" << endl;
     cout << "    -n         Disable mDNS" << endl;
 #endif
+    cout << "    -s         Scrub the repository in the background" << endl;
     cout << "    -h         Show this message" << endl;
 }
 
@@ -70,10 +72,11 @@ main(int argc, char *argv[])
 {
     int ch;
     bool mDNS_flag = true;
+    bool scrub_flag = false;
     unsigned long port = 8080;
     string rootPath;
 
-    while ((ch = getopt(argc, argv, "p:mnh")) != -1) {
+    while ((ch = getopt(argc, argv, "p:mnsh")) != -1) {
         switch (ch) {
             case 'p':
             {
@@ -92,6 +95,9 @@ main(int argc, char *argv[])
             case 'n':
                 mDNS_flag = false;
                 break;
+            case 's':
+                scrub_flag = true;
+                break;
             case 'h':
                 usage();
                 return 0;
@@ -124,9 +130,16 @@ main(int argc, char *argv[])
     ori_open_log(repository.getLogPath());
     LOG("libevent %s", event_get_version());
 
+    Scrubber *scrubber = NULL;
     HTTPServer server = HTTPServer(repository, port);
+    if (scrub_flag) {
+        scrubber = new Scrubber(&repository);
+        server.setScrubber(scrubber);
+    }
     server.start(mDNS_flag);
 
+    delete scrubber;
+
     return 0;
 }
 
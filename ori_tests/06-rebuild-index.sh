@@ -0,0 +1,41 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+# Tiny objects are also cached in the index, they must survive losing it
+cd $TEST_FS
+touch empty.txt
+for i in `seq 1 50`; do
+    echo -n "tiny $i" > tiny$i.txt
+done
+ln -s tiny1.txt link
+mkdir dir
+echo "Hello World" > dir/hello.txt
+$ORI_EXE snapshot
+cd ..
+
+rm -rf $TEMP_DIR/tiny_copy
+cp -a $TEST_FS $TEMP_DIR/tiny_copy
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+rm -f index index.tbl index.inl
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$TEMP_DIR/tiny_copy" "$TEST_FS"
+
+$UMOUNT $TEST_FS
+rm -rf $TEMP_DIR/tiny_copy
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
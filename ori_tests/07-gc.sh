@@ -0,0 +1,51 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+# Files only referenced by the purged snapshot are reclaimed by gc
+cd $TEST_FS
+for i in `seq 1 20`; do
+    seq 1 $((i * 200)) > keep$i.txt
+    seq $i $((i * 300)) > purge$i.txt
+done
+seq 1 3000 > edited.txt
+$ORI_EXE snapshot
+OLDREV=`$ORI_EXE tip`
+rm purge*.txt
+# Stored as a delta against a blob of the purged snapshot
+sed -i 's/^1500$/edited/' edited.txt
+echo "Hello World" > hello.txt
+$ORI_EXE snapshot
+$ORI_EXE purgesnapshot $OLDREV
+cd ..
+
+rm -rf $TEMP_DIR/gc_copy
+cp -a $TEST_FS $TEMP_DIR/gc_copy
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE gc
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+# Stale copies of expanded deltas must not come back
+rm -f index index.tbl index.inl
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$TEMP_DIR/gc_copy" "$TEST_FS"
+
+$UMOUNT $TEST_FS
+rm -rf $TEMP_DIR/gc_copy
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
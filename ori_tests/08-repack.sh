@@ -0,0 +1,46 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+mkdir a b
+for s in `seq 1 5`; do
+    for i in `seq 1 20`; do
+        seq $s $((i * 100 + s)) > a/f$i.txt
+        echo "small $s $i" > b/f$i.txt
+    done
+    $ORI_EXE snapshot
+done
+$ORI_EXE repack
+# A second repack has nothing left to order
+$ORI_EXE repack
+cd ..
+
+rm -rf $TEMP_DIR/repack_copy
+cp -a $TEST_FS $TEMP_DIR/repack_copy
+
+$UMOUNT $TEST_FS
+
+# The index rebuilt from the repacked packfiles must find every object
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+rm -f index index.tbl index.inl
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$TEMP_DIR/repack_copy" "$TEST_FS"
+
+$UMOUNT $TEST_FS
+rm -rf $TEMP_DIR/repack_copy
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
@@ -0,0 +1,43 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORI_EXE replicate $TEST_FS $TEST_FS2
+
+$ORIFS_EXE $TEST_FS
+$ORIFS_EXE $TEST_FS2
+
+sleep 1
+
+# Small edits to files of a few KB are stored as deltas
+cd $TEST_FS
+seq 1 3000 > edited.txt
+seq 1 1000 > other.txt
+$ORI_EXE snapshot
+for i in `seq 1 10`; do
+    sed -i "s/^$((i * 100))\$/edit $i/" edited.txt
+    echo "line $i" >> other.txt
+    $ORI_EXE snapshot
+done
+cd ..
+
+cd $TEST_FS2
+$ORI_EXE pull
+cd ..
+
+$PYTHON $SCRIPTS/compare.py "$TEST_FS" "$TEST_FS2"
+
+$UMOUNT $TEST_FS
+$UMOUNT $TEST_FS2
+
+# The edits were stored and pulled as deltas
+cd ~/.ori/$TEST_FS.ori
+test `$ORIDBG_EXE stats | awk '/Delta Blobs/ { print $3 }'` -gt 0
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+test `$ORIDBG_EXE stats | awk '/Delta Blobs/ { print $3 }'` -gt 0
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2
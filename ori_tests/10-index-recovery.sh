@@ -0,0 +1,49 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+for i in `seq 1 20`; do
+    seq 1 $((i * 100)) > file$i.txt
+done
+$ORI_EXE snapshot
+cd ..
+
+rm -rf $TEMP_DIR/recovery_copy
+cp -a $TEST_FS $TEMP_DIR/recovery_copy
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+
+# A crash may leave the index log extended with zeros or with a torn
+# block at the end, both are dropped on open
+truncate -s +8192 index
+$ORIDBG_EXE verify
+printf '\000\000\000\005torn' >> index
+$ORIDBG_EXE verify
+
+# A corrupt index is refused and rebuilt from the packfiles
+printf 'CORRUPT!' | dd of=index bs=1 conv=notrunc
+if $ORIDBG_EXE verify; then
+    exit 1
+fi
+rm -f index index.tbl index.inl
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$TEMP_DIR/recovery_copy" "$TEST_FS"
+
+$UMOUNT $TEST_FS
+rm -rf $TEMP_DIR/recovery_copy
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
@@ -37,6 +37,7 @@ cmd_stats(int argc, char * const argv[])
     uint64_t commits = 0;
     uint64_t trees = 0;
     uint64_t blobs = 0;
+    uint64_t deltaBlobs = 0;
     uint64_t danglingBlobs = 0;
     uint64_t blobRefs = 0;
     uint64_t largeBlobs = 0;
@@ -59,6 +60,8 @@ cmd_stats(int argc, char * const argv[])
         case ObjectInfo::Blob:
         {
             blobs++;
+            if (it.isDelta())
+                deltaBlobs++;
             refcount_t refcount = repository.getMetadata().getRefCount(it.hash);
             if (refcount == 0) {
                 danglingBlobs++;
@@ -90,6 +93,7 @@ cmd_stats(int argc, char * const argv[])
     cout << left << setw(40) << "Trees" << trees << endl;
     cout << left << setw(40) << "Blobs" << blobs << endl;
     cout << left << setw(40) << "  Dangling Blobs" << danglingBlobs << endl;
+    cout << left << setw(40) << "  Delta Blobs" << deltaBlobs << endl;
     cout << left << setw(40) << "  Dedup Ratio"
          << fixed << setprecision(2)
          << 100.0 * (float)blobs/(float)blobRefs << "%" << endl;
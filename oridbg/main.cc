@@ -68,8 +68,10 @@ int cmd_listkeys(int argc, char * const argv[]);
 int cmd_log(int argc, char * const argv[]);
 int cmd_rebuildindex(int argc, char * const argv[]);
 int cmd_rebuildrefs(int argc, char * const argv[]);
+int cmd_recompress(int argc, char * const argv[]);
 int cmd_remote(int argc, char * const argv[]);
 int cmd_removekey(int argc, char * const argv[]);
+int cmd_repack(int argc, char * const argv[]);
 int cmd_setkey(int argc, char * const argv[]);
 int cmd_show(int argc, char * const argv[]);
 int cmd_snapshots(int argc, char * const argv[]);
@@ -165,6 +167,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "recompress",
+        "Recompress packfiles that are rarely read",
+        cmd_recompress,
+        NULL,
+        CMD_NEED_REPO,
+    },
     {
         "remote",
         "Remote connection management",
@@ -179,6 +188,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "repack",
+        "Rewrite packfiles in snapshot order",
+        cmd_repack,
+        NULL,
+        CMD_NEED_REPO,
+    },
     {
         "setkey",
         "Set the repository private key for signing commits",
@@ -28,6 +28,7 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <mutex>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
@@ -90,6 +91,12 @@ OriCommand::process(const string &data)
         return cmd_version(str);
     if (cmd == "purgesnapshot")
 	return cmd_purgesnapshot(str);
+    if (cmd == "repack")
+        return cmd_repack(str);
+    if (cmd == "recompress")
+        return cmd_recompress(str);
+    if (cmd == "scrub")
+        return cmd_scrub(str);
 
     // Makes debugging easier when a bad request comes in
     return "UNSUPPORTED REQUEST";
@@ -567,3 +574,61 @@ OriCommand::cmd_purgesnapshot(strstream &str)
     return resp.str();
 }
 
+string
+OriCommand::cmd_repack(strstream &str)
+{
+    FUSE_PLOG("Command: repack");
+
+    LocalRepo *repo = priv->getRepo();
+    strwstream resp;
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    size_t moved = repo->repack();
+    lock.reset();
+
+    resp.writeUInt8(0);
+    resp.writeUInt64(moved);
+    return resp.str();
+}
+
+string
+OriCommand::cmd_recompress(strstream &str)
+{
+    FUSE_PLOG("Command: recompress");
+
+    LocalRepo *repo = priv->getRepo();
+    strwstream resp;
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    size_t packs = repo->recompress();
+    lock.reset();
+
+    resp.writeUInt8(0);
+    resp.writeUInt64(packs);
+    return resp.str();
+}
+
+/*
+ * Runs one slice of the background scrubber, the response is the time in
+ * milliseconds until the next slice should run.
+ */
+string
+OriCommand::cmd_scrub(strstream &str)
+{
+    FUSE_PLOG("Command: scrub");
+
+    uint32_t sliceMS = str.readUInt32();
+    strwstream resp;
+
+    // Scrubbing only reads, writers are kept out while file reads go on
+    RWKey::sp lock = priv->nsLock.readLock();
+    unique_lock<mutex> scrubKey(priv->scrubLock);
+    uint32_t wait = priv->getScrubber()->step(sliceMS);
+    scrubKey.unlock();
+    lock.reset();
+
+    resp.writeUInt8(0);
+    resp.writeUInt32(wait);
+    return resp.str();
+}
+
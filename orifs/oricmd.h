@@ -38,6 +38,9 @@ private:
     std::string cmd_branch(strstream &str);
     std::string cmd_version(strstream &str);
     std::string cmd_purgesnapshot(strstream &str);
+    std::string cmd_repack(strstream &str);
+    std::string cmd_recompress(strstream &str);
+    std::string cmd_scrub(strstream &str);
     OriPriv *priv;
 };
 
@@ -124,6 +124,7 @@ OriPriv::OriPriv(const std::string &repoPath,
                  Repo *remoteRepo)
 {
     repo = new LocalRepo(repoPath);
+    scrubber = NULL;
     nextId = ORIPRIVID_INVALID + 1;
     nextFH = 1;
 
@@ -505,8 +506,20 @@ OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
 
     ObjectType type = repo->getObjectType(info->hash);
     if (type == ObjectInfo::Blob) {
+        // Copy straight out of the packfile or cache when possible
+        LocalObject::sp o = repo->getLocalObject(info->hash);
+        PayloadSpan span;
+        if (o && o->getPayloadSpan(span)) {
+            if ((size_t)offset >= span.len)
+                return 0;
+
+            size_t real_read = min(size, span.len - offset);
+            memcpy(buf, span.data + offset, real_read);
+
+            return real_read;
+        }
+
         string payload = repo->getPayload(info->hash);
-        // XXX: Cache
 
         size_t left = payload.size() - offset;
         if (left > payload.size())
@@ -833,6 +846,39 @@ OriPriv::commitTreeHelper(const string &path)
         dirty = true;
     }
 
+    // Add the created or modified files of this directory in one batch
+    vector<string> paths;
+    vector<ObjectHash> prevs;
+    vector<OriFileInfo *> added;
+    for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
+        string objPath = path + "/" + it->first;
+        OriFileInfo *info = getFileInfo(objPath);
+
+        if (info->type != FILETYPE_DIRTY || info->isSymlink() ||
+            info->path == "")
+            continue;
+
+        ObjectHash prev;
+        Tree::iterator oldEntry = oldTree.find(it->first);
+
+        // The previous version is a good delta base
+        if (oldEntry != oldTree.end() &&
+            oldEntry->second.type == TreeEntry::Blob)
+            prev = oldEntry->second.hash;
+
+        paths.push_back(info->path);
+        prevs.push_back(prev);
+        added.push_back(info);
+    }
+
+    vector<pair<ObjectHash, ObjectHash> > hashes = repo->addFiles(paths,
+                                                                  prevs);
+    for (size_t i = 0; i < added.size(); i++) {
+        // Copy hashes back to info stgructure
+        added[i]->hash = hashes[i].first;
+        added[i]->largeHash = hashes[i].second;
+    }
+
     // Check this directory
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
         string objPath = path + "/" + it->first;
@@ -852,14 +898,6 @@ OriPriv::commitTreeHelper(const string &path)
 
                 e = TreeEntry(hash, ObjectHash());
             } else {
-                if (info->path != "") {
-                    pair<ObjectHash, ObjectHash> hashes;
-                    hashes = repo->addFile(info->path);
-
-                    // Copy hashes back to info stgructure
-                    info->hash = hashes.first;
-                    info->largeHash = hashes.second;
-                }
                 e = TreeEntry(info->hash, info->largeHash);
             }
 
@@ -1647,6 +1685,15 @@ OriPriv::getRepo()
     return repo;
 }
 
+Scrubber *
+OriPriv::getScrubber()
+{
+    if (scrubber == NULL)
+        scrubber = new Scrubber(repo);
+
+    return scrubber;
+}
+
 OriPriv *
 GetOriPriv()
 {
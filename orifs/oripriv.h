@@ -17,7 +17,10 @@
 #ifndef __ORIPRIV_H__
 #define __ORIPRIV_H__
 
+#include <mutex>
+
 #include <oriutil/orifile.h>
+#include <ori/scrubber.h>
 
 typedef enum OriFileType
 {
@@ -198,8 +201,11 @@ public:
     // Locks
     RWLock ioLock; // File I/O lock to allow atomic commits
     RWLock nsLock; // Namespace lock
+    std::mutex scrubLock; // Serializes scrubber slices
 
     LocalRepo *getRepo();
+    /// Created on first use, callers hold a nsLock read lock and scrubLock
+    Scrubber *getScrubber();
 private:
     OriPrivId nextId;
     uint64_t nextFH;
@@ -214,6 +220,7 @@ private:
 
     // Repository State
     LocalRepo *repo;
+    Scrubber *scrubber;
     ObjectHash head;
     Commit headCommit;
     std::string tmpDir;
@@ -52,6 +52,9 @@ usage_replicate()
     cout << "    --full         Full clone (default)" << endl;
     cout << "    --non-bare     Non-bare repository" << endl;
     cout << "    --shallow      Shallow clone" << endl;
+    cout << "    --copy         Copy packfiles instead of sharing them with a"
+         << endl;
+    cout << "                   local source through hard links" << endl;
 }
 
 int
@@ -63,11 +66,13 @@ cmd_replicate(int argc, char * const argv[])
     string srcRoot;
     string newRoot;
     bool bareRepo = true;
+    bool linkPacks = true;
 
     struct option longopts[] = {
         { "full",       no_argument,    NULL,   'f' },
         { "shallow",    no_argument,    NULL,   's' },
         { "non-bare",   no_argument,    NULL,   'n' },
+        { "copy",       no_argument,    NULL,   'c' },
         { NULL,         0,              NULL,   0   }
     };
 
@@ -83,6 +88,9 @@ cmd_replicate(int argc, char * const argv[])
             case 'n':
                 bareRepo = false;
                 break;
+            case 'c':
+                linkPacks = false;
+                break;
             case 's':
                 if (clone_mode != 0) {
                     printf("Cannot set multiple clone modes!\n");
@@ -153,6 +161,10 @@ cmd_replicate(int argc, char * const argv[])
     ObjectHash head = srcRepo->getHead();
 
     if (clone_mode != 2) {
+        // A local source on the same filesystem shares its packfiles
+        if (linkPacks && !Util_IsPathRemote(srcRoot) &&
+            OriFile_Exists(srcRoot + ORI_PATH_UUID))
+            dstRepo.linkObjects(srcRepo.get(), srcRoot);
         dstRepo.pull(srcRepo.get());
     }
 
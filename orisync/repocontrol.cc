@@ -14,12 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdint.h>
+#include <inttypes.h>
+
 #include <string>
 
 #include <oriutil/debug.h>
 #include <oriutil/systemexception.h>
 #include <ori/repo.h>
 #include <ori/localrepo.h>
+#include <ori/scrubber.h>
 #include <ori/udsclient.h>
 #include <ori/udsrepo.h>
 
@@ -316,6 +320,87 @@ RepoControl::gc(time_t time)
   }
 }
 
+void
+RepoControl::repack()
+{
+    if (udsRepo) {
+        strwstream req;
+        req.writePStr("repack");
+
+        try {
+            strstream resp = udsRepo->callExt("FUSE", req.str());
+            if (resp.ended() || resp.readUInt8() != 0) {
+                LOG("Repocontrol::repack: Repack failed!");
+                return;
+            }
+            DLOG("Repocontrol::repack: Repacked %" PRIu64 " objects",
+                 resp.readUInt64());
+        } catch (SystemException e) {
+            WARNING("%s", e.what());
+            return;
+        }
+    } else {
+        localRepo->repack();
+    }
+}
+
+void
+RepoControl::recompress()
+{
+    if (udsRepo) {
+        strwstream req;
+        req.writePStr("recompress");
+
+        try {
+            strstream resp = udsRepo->callExt("FUSE", req.str());
+            if (resp.ended() || resp.readUInt8() != 0) {
+                LOG("Repocontrol::recompress: Recompress failed!");
+                return;
+            }
+            DLOG("Repocontrol::recompress: Recompressed %" PRIu64
+                 " packfiles", resp.readUInt64());
+        } catch (SystemException e) {
+            WARNING("%s", e.what());
+            return;
+        }
+    } else {
+        localRepo->recompress();
+    }
+}
+
+uint32_t
+RepoControl::scrub(Scrubber *&scrubber)
+{
+    if (udsRepo) {
+        strwstream req;
+
+        delete scrubber;
+        scrubber = NULL;
+
+        req.writePStr("scrub");
+        // Default slice length
+        req.writeUInt32(0);
+
+        try {
+            strstream resp = udsRepo->callExt("FUSE", req.str());
+            if (resp.ended() || resp.readUInt8() != 0) {
+                LOG("Repocontrol::scrub: Scrub failed!");
+                return 0;
+            }
+            return resp.readUInt32();
+        } catch (SystemException e) {
+            WARNING("%s", e.what());
+            return 0;
+        }
+    } else {
+        if (scrubber == NULL)
+            scrubber = new Scrubber(localRepo);
+        else
+            scrubber->setRepo(localRepo);
+        return scrubber->step();
+    }
+}
+
 bool
 RepoControl::isMounted()
 {
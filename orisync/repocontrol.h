@@ -23,6 +23,7 @@
 #include <ori/localrepo.h>
 #include <ori/udsclient.h>
 #include <ori/udsrepo.h>
+#include <ori/scrubber.h>
 
 class RepoControl {
 public:
@@ -38,6 +39,13 @@ public:
     std::string push(const std::string &host, const std::string &path);
     int snapshot();
     void gc(time_t time);
+    void repack();
+    void recompress();
+    /// Runs one scrubber slice, returns the milliseconds until the next or
+    /// 0 if it failed.  The caller keeps scrubber across the slices of an
+    /// unmounted repository, it is created on first use and dropped once
+    /// the repository is mounted and orifs scrubs it.
+    uint32_t scrub(Scrubber *&scrubber);
     bool isMounted();
 private:
     std::string path;
@@ -34,6 +34,8 @@
 #include <condition_variable>
 #include <chrono>
 #include <queue>
+#include <thread>
+#include <algorithm>
 
 #include <event2/event.h>
 #include <event2/http.h>
@@ -78,6 +80,10 @@ using namespace std;
 #define ORISYNC_GCINTERVAL	3600 // seconds for now; How often do we run garbage collection
 // Purge time
 #define ORISYNC_PURGETIME	36000 // seconds for now; How old will the repo be purged?
+// How often are the packfiles rewritten in snapshot order
+#define ORISYNC_REPACKINTERVAL	86400
+// Retry interval after a failed scrubber slice
+#define ORISYNC_SCRUBRETRY	60 // seconds
 // Timeout to detect host down
 #define HOST_TIMEOUT		10
 
@@ -700,11 +706,13 @@ public:
     }
     void run() {
         time_t lastGC = time(NULL);
+        time_t lastRepack = time(NULL);
         string down("Down. Last connected ");
         char timeStr[26];
 
         while (!interruptionRequested()) {
-          sleep(ORISYNC_WDINTERVAL);
+          scrubUntil(chrono::steady_clock::now() +
+                     chrono::seconds(ORISYNC_WDINTERVAL));
           // check if hosts are still alive
           RWKey::sp key = hostsLock.readLock();
           for (auto &it : hosts) {
@@ -732,7 +740,7 @@ public:
           key.reset();
 
 
-          if (lastGC + ORISYNC_GCINTERVAL > time(NULL)) {
+          if (lastGC + ORISYNC_GCINTERVAL < time(NULL)) {
             // time to do garbage collection
             //RWKey::sp key2 = infoLock.readLock();
             RWKey::sp key2 = myInfo.hostLock.readLock();
@@ -753,9 +761,95 @@ public:
             key2.reset();
             lastGC = time(NULL);
           }
+
+          if (lastRepack + ORISYNC_REPACKINTERVAL < time(NULL)) {
+            RWKey::sp key2 = myInfo.hostLock.readLock();
+            list<string> repos = myInfo.listPaths();
+            for (auto &it : repos) {
+                RepoControl repo = RepoControl(it);
+                try {
+                    repo.open();
+                } catch (SystemException &e) {
+                    WARNING("Failed to open repository %s: %s", it.c_str(), e.what());
+                    continue;
+                }
+                RWKey::sp repoKey = myInfo.getRepoLock(repo.getUUID())->writeLock();
+                repo.repack();
+                repo.recompress();
+                repoKey.reset();
+                repo.close();
+            }
+            key2.reset();
+            lastRepack = time(NULL);
+          }
+
         }
+        for (auto &it : scrubbers) {
+            delete it.second;
+        }
+        scrubbers.clear();
         DLOG("Watchdog exited!");
     }
+private:
+    /*
+     * Run the scrubber slices of the repositories as they come due until
+     * deadline, each repository is next scrubbed after the wait returned by
+     * its slice.
+     */
+    void scrubUntil(chrono::steady_clock::time_point deadline) {
+        while (!interruptionRequested()) {
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            chrono::steady_clock::time_point wake = deadline;
+
+            if (now >= deadline)
+                return;
+
+            RWKey::sp key = myInfo.hostLock.readLock();
+            list<string> repos = myInfo.listPaths();
+            for (auto &it : repos) {
+                if (nextScrub.count(it) == 0 || nextScrub[it] <= now) {
+                    nextScrub[it] = chrono::steady_clock::now() +
+                                    scrubSlice(it);
+                }
+                wake = min(wake, nextScrub[it]);
+            }
+            key.reset();
+
+            // Drop the scrubbers of removed repositories
+            for (auto it = scrubbers.begin(); it != scrubbers.end();) {
+                if (find(repos.begin(), repos.end(), it->first) == repos.end()) {
+                    delete it->second;
+                    nextScrub.erase(it->first);
+                    it = scrubbers.erase(it);
+                } else {
+                    it++;
+                }
+            }
+
+            this_thread::sleep_until(wake);
+        }
+    }
+    chrono::milliseconds scrubSlice(const string &path) {
+        RepoControl repo = RepoControl(path);
+        try {
+            repo.open();
+        } catch (SystemException &e) {
+            WARNING("Failed to open repository %s: %s", path.c_str(), e.what());
+            return chrono::seconds(ORISYNC_SCRUBRETRY);
+        }
+        RWKey::sp repoKey = myInfo.getRepoLock(repo.getUUID())->writeLock();
+        uint32_t wait = repo.scrub(scrubbers[path]);
+        repoKey.reset();
+        repo.close();
+
+        if (wait == 0)
+            return chrono::seconds(ORISYNC_SCRUBRETRY);
+        return chrono::milliseconds(wait);
+    }
+
+    map<string, chrono::steady_clock::time_point> nextScrub;
+    /// Scrubbers of the unmounted repositories
+    map<string, Scrubber *> scrubbers;
 };
 
 Listener *listener;
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __COMPACTOR_H__
+#define __COMPACTOR_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <set>
+#include <vector>
+
+#include "packfile.h"
+
+class Index;
+
+/*
+ * Rewrites packfiles that are mostly dead into fresh packfiles.
+ *
+ * Packfiles whose dead fraction (bytes not referenced by the index) is at
+ * least GC_COMPACT_THRESHOLD, or that held purged objects, are compacted in
+ * groups of up to PACKFILE_MAXSIZE live bytes and PACKFILE_MAXOBJS objects,
+ * metadata packfiles are grouped separately from data packfiles.  For each group the live objects are streamed
+ * into a new packfile, the index is pointed at the copies and only then the
+ * old packfiles are deleted.  A journal naming the destination and source
+ * packfiles is kept for the duration (repack() uses the same journal with
+ * several destinations), recover() uses it to finish or roll
+ * back a compaction that was interrupted by a crash.
+ */
+class PackfileCompactor
+{
+public:
+    PackfileCompactor(PackfileManager *packfiles, Index *idx);
+    ~PackfileCompactor();
+    /// Completes or undoes an interrupted compaction
+    void recover();
+    /// Packfiles in purgedPacks are rewritten however little of them is dead
+    /// @returns the number of packfiles removed
+    size_t run(const std::set<packid_t> &purgedPacks = std::set<packid_t>());
+    /// Rewrites the live objects of srcs, each stream into its own
+    /// packfiles in the given order, and removes srcs
+    /// @returns the number of objects moved
+    size_t repack(const std::vector<std::vector<IndexEntry> > &streams,
+                  const std::vector<packid_t> &srcs);
+    /// Rewrites packfiles not read since coldBefore with algo
+    /// @returns the number of packfiles replaced
+    size_t recompress(time_t coldBefore, ObjectInfo::ZipAlgo algo);
+private:
+    struct PackStats {
+        packid_t id;
+        uint64_t fileSize;
+        uint64_t liveBytes;
+        uint64_t liveObjects;
+        /// Mostly commits and trees
+        bool metadata;
+    };
+
+    void _compactGroup(const std::vector<packid_t> &group);
+    void _writeJournal(const std::vector<packid_t> &dests,
+                       const std::vector<packid_t> &srcs);
+    bool _readJournal(std::vector<packid_t> &dests,
+                      std::vector<packid_t> &srcs);
+    void _removeJournal();
+    PackfileManager *packfiles;
+    Index *idx;
+    std::string journalPath;
+};
+
+#endif /* __COMPACTOR_H__ */
+
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __COMPRESSION_H__
+#define __COMPRESSION_H__
+
+#include <stdint.h>
+
+#include <string>
+
+#include <oriutil/objectinfo.h>
+
+/*
+ * Repository wide choice of the codec used for new objects.  Every codec is
+ * always decodable, so the policy can be changed without rewriting packs.
+ *
+ *   none, fastlz, snappy, lzma: use that codec for every object
+ *   adaptive: snappy for metadata and small blobs that are read often,
+ *             lzma (fastlz if unavailable) for large file chunks, and
+ *             fastlz for everything else
+ */
+class CompressionPolicy
+{
+public:
+    enum Mode {
+        COMPRESSION_NONE,
+        COMPRESSION_FASTLZ,
+        COMPRESSION_SNAPPY,
+        COMPRESSION_LZMA,
+        COMPRESSION_ADAPTIVE,
+    };
+
+    CompressionPolicy();
+    ~CompressionPolicy();
+    void setMode(Mode m);
+    Mode getMode() const;
+    /// Parses a mode name, fails for codecs that were not compiled in
+    static bool parseMode(const std::string &str, Mode &m);
+    static std::string modeName(Mode m);
+    /// Mode selected at build time with COMPRESSION_ALGO
+    static Mode getDefaultMode();
+
+    /// Codec for a new object, isChunk is set for fragments of large files
+    ObjectInfo::ZipAlgo select(ObjectInfo::Type type, size_t size,
+                               bool isChunk = false) const;
+private:
+    Mode mode;
+};
+
+#endif /* __COMPRESSION_H__ */
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DURABILITY_H__
+#define __DURABILITY_H__
+
+#include <set>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+class DurabilityFlusher;
+
+/*
+ * Repository wide policy deciding when writes to packfiles, the index and the
+ * metadata log are forced to stable storage.
+ *
+ *   none:        never sync, rely on the OS (bulk imports)
+ *   transaction: fdatasync every file as each transaction commits (default)
+ *   group:       remember dirty files and sync them together on a timer
+ *
+ * In group mode data files are synced before metadata files so that the index
+ * should never reach the disk ahead of the packfile data it refers to.
+ *
+ * Only files registered as written are synced when they are released, and
+ * files are synced without holding the policy lock so that repositories
+ * sharing a policy do not wait for each other's syncs.
+ *
+ * Every file holding a policy shares ownership of it, packfiles may outlive
+ * the repository that opened them and still release their descriptors.
+ */
+class DurabilityPolicy
+{
+public:
+    typedef std::shared_ptr<DurabilityPolicy> sp;
+
+    enum Mode {
+        DURABILITY_NONE,
+        DURABILITY_TRANSACTION,
+        DURABILITY_GROUP,
+    };
+    enum FileClass {
+        DURABILITY_DATA,
+        DURABILITY_METADATA,
+    };
+
+    DurabilityPolicy();
+    ~DurabilityPolicy();
+    void setMode(Mode m);
+    Mode getMode() const;
+    /// Parses "none", "transaction" or "group"
+    static bool parseMode(const std::string &str, Mode &m);
+    static std::string modeName(Mode m);
+    /// Shared transaction policy for users that do not configure one
+    static sp getDefault();
+
+    /// Called after writing to fd, the writes are synced by the next commit
+    /// or when fd is released
+    void written(int fd, FileClass c = DURABILITY_METADATA);
+    /// Called when a batch of writes to fd is complete
+    void commit(int fd, FileClass c = DURABILITY_METADATA);
+    /// Called before fd is closed, syncs it if it has outstanding writes
+    void release(int fd);
+    /// Sync every file with outstanding writes
+    void flush();
+    /// Sync fd now regardless of the mode
+    static void syncFd(int fd);
+private:
+    bool _clean(int fd);
+
+    std::mutex lock;
+    std::atomic<Mode> mode;
+    std::set<int> dirtyData;
+    std::set<int> dirtyMeta;
+    /// Files being synced by flush, released only once it completes
+    std::set<int> flushing;
+    std::condition_variable flushedCV;
+    DurabilityFlusher *flusher;
+};
+
+#endif /* __DURABILITY_H__ */
+
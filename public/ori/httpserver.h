@@ -24,6 +24,8 @@
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
+#include "scrubber.h"
+
 class HTTPServer
 {
 public:
@@ -31,6 +33,8 @@ public:
     ~HTTPServer();
     void start(bool mDNSEnable);
     void stop();
+    /// Runs the scrubber between requests, must be set before start
+    void setScrubber(Scrubber *scrubber);
 protected:
     void entry(struct evhttp_request *req);
 private:
@@ -50,7 +54,11 @@ private:
     struct evhttp *httpd;
     /* set if a test needs to call loopexit on a base */
     struct event_base *base;
+    Scrubber *scrubber;
+    struct event *scrubEvent;
+    void scrub();
     friend void HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg);
+    friend void HTTPServerScrubCB(evutil_socket_t fd, short what, void *arg);
 };
 
 #endif
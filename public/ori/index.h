@@ -21,11 +21,36 @@
 
 #include <string>
 #include <set>
+#include <vector>
 #include <unordered_map>
+#include <functional>
 
 #include "object.h"
 #include "packfile.h"
+#include "sortedtable.h"
+#include "indexmap.h"
+#include "durability.h"
 
+/*
+ * The object index is made of two parts: a sorted table (index.tbl) that is
+ * memory mapped and searched in place, and an append-only log (index) of
+ * recent updates that is kept in memory.  The log is written in blocks, one
+ * per batch of updates, each protected by a CRC32C.  The log is folded into the table
+ * by rewrite(), which runs as part of garbage collection.
+ *
+ * Removed objects are recorded in the log as tombstones (entries in the
+ * INDEX_TOMBSTONE packfile) that hide the table entry until the next rewrite.
+ * The in-memory copy of the log is an IndexMap.
+ *
+ * The index also caches the payloads of objects of at most INDEX_INLINE_MAX
+ * bytes, which are still stored in a packfile like any other object.  A
+ * cached payload is logged as a record in the INDEX_INLINE packfile followed
+ * by the payload, and kept in a second sorted table (index.inl) after a
+ * rewrite.  Records are buffered and written with the next log block or
+ * sync.  Losing them only costs a packfile read.  Reads and transmit serve
+ * cached objects without touching their packfile, the packfile copy is
+ * only read by repack, gc and scrubbing.
+ */
 class Index
 {
 public:
@@ -33,20 +58,58 @@ public:
     ~Index();
     void open(const std::string &indexFile);
     void close();
-    void sync();
+    /// force syncs even if the durability policy would not
+    void sync(bool force = false);
+    void setDurability(DurabilityPolicy::sp policy);
     void rewrite();
+    /// Builds the sorted table of an empty index from runs sorted by hash.
+    /// Of several copies of an object the one with the shortest delta chain
+    /// is kept, a whole copy does not depend on any other object.  Equal
+    /// copies are resolved in favor of the later run.
+    void loadTable(const std::vector<std::vector<IndexEntry> > &runs);
     void dump();
     void updateEntry(const ObjectHash &objId, const IndexEntry &entry);
-    const IndexEntry &getEntry(const ObjectHash &objId) const;
-    const ObjectInfo &getInfo(const ObjectHash &objId) const;
+    void updateEntries(const std::vector<IndexEntry> &entries);
+    /// Atomically points existing objects at their new location
+    void relocateEntries(const std::vector<IndexEntry> &entries);
+    /// Atomically removes the objects from the index
+    void removeEntries(const std::vector<ObjectHash> &objs);
+    /// Caches the payload of a tiny object, which must also be packed
+    void addInline(const ObjectInfo &info, const std::string &payload);
+    /// Returns false if the payload of the object is not cached
+    bool getInline(const ObjectHash &objId, std::string &payload) const;
+    bool hasInline(const ObjectHash &objId) const;
+    /// True if cached payloads are waiting to be written
+    bool hasPending() const { return !pending.empty(); }
+    IndexEntry getEntry(const ObjectHash &objId) const;
+    ObjectInfo getInfo(const ObjectHash &objId) const;
     bool hasObject(const ObjectHash &objId) const;
+    /// Prefer forEach, this copies the whole index into a set
     std::set<ObjectInfo> getList();
+    /// Calls fn for every object in the index in no particular order
+    void forEach(const std::function<void(const IndexEntry &)> &fn) const;
 private:
     int fd;
     std::string fileName;
-    std::unordered_map<ObjectHash, IndexEntry> index;
+    DurabilityPolicy::sp durability;
+    SortedTable table;
+    SortedTable inlineTable;
+    IndexMap delta;
+    /// Cached payloads logged since the last rewrite
+    std::unordered_map<ObjectHash, std::string> inlined;
+    /// Cache records not yet written to the log
+    std::vector<IndexEntry> pending;
 
-    void _writeEntry(const IndexEntry &e);
+    void _appendBlock(const std::vector<IndexEntry> &entries);
+    void _flushPending();
+    void _insert(const IndexEntry &entry);
+    void _rewriteInline();
+    void _writeLog(const std::string &buf);
+    void _writeHeader();
+    size_t _replayLog(const std::string &log);
+    void _replayLegacyLog(const std::string &log);
+    static std::string _encodeEntry(const IndexEntry &e);
+    static IndexEntry _decodeEntry(const uint8_t *buf);
 };
 
 #endif /* __INDEX_H__ */
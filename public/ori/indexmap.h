@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __INDEXMAP_H__
+#define __INDEXMAP_H__
+
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+#include <oriutil/objecthash.h>
+#include "packfile.h"
+
+/*
+ * Flat open addressing hash table of index entries keyed by object hash.
+ *
+ * The entries are stored densely in insertion order, in chunks that are
+ * never moved, each holding the hash once together with the packed
+ * ObjectInfo and location fields (52 bytes).  The table itself only holds
+ * a 4 byte entry number per slot and a parallel array of control bytes
+ * with a 7-bit tag per slot (or EMPTY), so that a probe compares the 16
+ * tags of a group at once and only reads the entries whose tag matches.
+ * Object hashes are uniformly distributed so the hash bytes are used
+ * directly for the group index and the tag.
+ *
+ * At a load factor between 7/16 and 7/8 an entry costs 58 to 64 bytes, and
+ * growing the table does not copy the entries.
+ *
+ * Entries are never removed individually, removed objects are recorded as
+ * tombstone entries by the Index.
+ */
+class IndexMap
+{
+public:
+    IndexMap();
+    ~IndexMap();
+    /// Inserts the entry or replaces the entry with the same hash
+    void insert(const IndexEntry &entry);
+    /// Returns false if the object is not in the map
+    bool find(const ObjectHash &hash, IndexEntry *entry) const;
+    bool contains(const ObjectHash &hash) const;
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear();
+    /// Calls fn for every entry in no particular order
+    void forEach(const std::function<void(const IndexEntry &)> &fn) const;
+    static const size_t GROUP_SIZE = 16;
+    /// Entries per chunk of entry storage
+    static const size_t CHUNK_SIZE = 1024;
+private:
+    struct Entry {
+        uint8_t hash[ObjectHash::SIZE];
+        /// ObjectInfo flags with the type in the top byte
+        uint32_t typeFlags;
+        uint32_t payloadSize;
+        offset_t offset;
+        uint32_t packedSize;
+        packid_t packfile;
+    };
+
+    Entry &_entry(uint32_t i) const
+    {
+        return chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+    }
+    ssize_t _findSlot(const ObjectHash &hash, uint8_t tag) const;
+    void _grow();
+    void _insertSlot(const uint8_t *hash, uint32_t entry);
+    static void _pack(const IndexEntry &entry, Entry &e);
+    static void _unpack(const Entry &e, IndexEntry &entry);
+
+    uint8_t *ctrl;
+    /// Entry number of each slot
+    uint32_t *slots;
+    std::vector<Entry *> chunks;
+    size_t groups;
+    size_t count;
+};
+
+#endif /* __INDEXMAP_H__ */
+
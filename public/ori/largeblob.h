@@ -28,10 +28,10 @@ class LBlobEntry
 {
 public:
     LBlobEntry(const LBlobEntry &l);
-    LBlobEntry(const ObjectHash &hash, uint16_t length);
+    LBlobEntry(const ObjectHash &hash, uint32_t length);
     ~LBlobEntry();
     const ObjectHash hash;
-    const uint16_t length;
+    const uint32_t length;
 };
 
 class Repo;
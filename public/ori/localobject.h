@@ -25,6 +25,7 @@
 #include <memory>
 
 #include <oriutil/stream.h>
+#include <oriutil/objectcache.h>
 #include "object.h"
 #include "packfile.h"
 
@@ -35,10 +36,16 @@ public:
 
     LocalObject(PfTransaction::sp transaction, size_t ix);
     LocalObject(Packfile::sp packfile, const IndexEntry &entry);
+    LocalObject(const ObjectInfo &info, ObjectCache::Payload payload);
     ~LocalObject();
 
     // BaseObject implementation
     bytestream *getPayloadStream();
+    bytestream *getPayloadStreamAt(size_t offset);
+    std::string getPayload();
+    /// Borrows the payload without copying if it is stored uncompressed or
+    /// is cached, returns false otherwise
+    bool getPayloadSpan(PayloadSpan &span);
 
 private:
     PfTransaction::sp transaction;
@@ -46,6 +53,8 @@ private:
 
     Packfile::sp packfile;
     IndexEntry entry;
+
+    ObjectCache::Payload payload;
     //void setupLzma(lzma_stream *strm, bool encode);
     //bool appendLzma(int dstFd, lzma_stream *strm, lzma_action action);
 };
@@ -20,7 +20,9 @@
 #include <memory>
 
 #include <oriutil/lrucache.h>
+#include <oriutil/objectcache.h>
 #include <oriutil/key.h>
+#include <oriutil/threadpool.h>
 #include "repo.h"
 #include "index.h"
 #include "snapshotindex.h"
@@ -34,6 +36,8 @@
 #include "packfile.h"
 #include "mergestate.h"
 #include "varlink.h"
+#include "durability.h"
+#include "compression.h"
 
 #define ORI_PATH_DIR "/.ori"
 #define ORI_PATH_VERSION "/version"
@@ -55,6 +59,8 @@
 #define ORI_PATH_LOCK "/lock"
 #define ORI_PATH_UDSSOCK "/uds"
 #define ORI_PATH_BACKUP_CONF "/backup.conf"
+#define ORI_PATH_SCRUB "/scrub"
+#define ORI_PATH_SCRUBBAD "/scrub.bad"
 
 int LocalRepo_Init(const std::string &path, bool barerepo,
                    const std::string &uuid = "");
@@ -106,6 +112,7 @@ public:
 
     // Repo implementation
     int distance() { return 0; }
+    bool isStreaming() { return streaming; }
     Object::sp getObject(const ObjectHash &id);
     ObjectInfo getObjectInfo(const ObjectHash &objId);
     bool hasObject(const ObjectHash &objId);
@@ -114,15 +121,28 @@ public:
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
+    int addChunk(const ObjectHash &hash, const std::string &payload);
+    int addDeltaObject(ObjectType type, const ObjectHash &hash,
+                       const std::string &payload, const ObjectHash &base);
 
     void sync(); /// sync all changes to disk
+    void setDurability(DurabilityPolicy::Mode mode);
+    DurabilityPolicy::Mode getDurability();
+    void setCompression(CompressionPolicy::Mode mode);
+    CompressionPolicy::Mode getCompression();
+    /// Cache of decompressed payloads, budget and statistics
+    ObjectCache &getObjectCache();
 
     // Index
     bool rebuildIndex();
     void dumpIndex();
     void dumpPackfile(packid_t packfileId);
 
-    LocalObject::sp getLocalObject(const ObjectHash &objId);
+    /// cached = false reads the packfile even if the object is cached.
+    /// Framed objects of more than one frame are never decoded whole so
+    /// reads at an offset only decompress the frames they need
+    LocalObject::sp getLocalObject(const ObjectHash &objId,
+                                   bool cached = true);
     
     std::vector<Commit> listCommits();
     std::map<std::string, ObjectHash> listSnapshots();
@@ -142,6 +162,8 @@ public:
 
     // Clone/pull operations
     void pull(Repo *r);
+    /// Shares the sealed packfiles of a local repository through hard links
+    size_t linkObjects(Repo *src, const std::string &srcRoot);
     void multiPull(RemoteRepo::sp defaultRemote);
     void transmit(bytewstream *bs, const std::vector<ObjectHash> &objs);
     void receive(bytestream *bs);
@@ -162,6 +184,10 @@ public:
             Commit &c, const std::string &status="normal");
 
     void gc();
+    /// Rewrite the packfiles in commit traversal order
+    size_t repack();
+    /// Recompress packfiles that have not been read for a long time
+    size_t recompress();
 
     // Reference Counting Operations
     MetadataLog &getMetadata();
@@ -222,24 +248,47 @@ public:
     // Static Operations
     static std::string findRootPath(const std::string &path = "");
 private:
+    /*
+     * Objects are written to one of two streams of packfiles so that
+     * commits and trees are packed densely, apart from file data.
+     */
+    enum PackStream { PACKSTREAM_DATA, PACKSTREAM_METADATA, PACKSTREAM_MAX };
+    static PackStream _getStream(ObjectType type);
+
     // Helper Functions
     void createObjDirs(const ObjectHash &objId);
+    int _addObject(ObjectType type, const ObjectHash &hash,
+            const std::string &payload, ObjectInfo::ZipAlgo algo);
+    void _beginTransaction(PackStream s);
+    void _nextPackfile(PackStream s);
+    void _commitTransactions();
+    void _retirePackfile(PackStream s);
+    /// Returns the open transaction that holds the object if any
+    PfTransaction::sp _findTransaction(const ObjectHash &hash);
+    void _expandDeltas(const std::set<ObjectHash> &bases,
+                       std::set<packid_t> &srcPacks);
 public: // Hack to enable rebuild operations
     std::string objIdToPath(const ObjectHash &objId);
 private:
     // Variables
     bool opened;
+    /// Streaming ingest mode, set from the ingest variable
+    bool streaming;
     std::string rootPath;
     std::string id;
     std::string version;
+    DurabilityPolicy::sp durability;
+    CompressionPolicy compression;
+    ObjectCache objectCache;
     Index index;
     SnapshotIndex snapshots;
     std::map<std::string, Peer> peers;
     MetadataLog metadata;
 
     // Packfiles
-    Packfile::sp currPackfile;
-    PfTransaction::sp currTransaction;
+    ThreadPool::sp compressPool;
+    Packfile::sp currPackfile[PACKSTREAM_MAX];
+    PfTransaction::sp currTransaction[PACKSTREAM_MAX];
     PackfileManager::sp packfiles;
 
     // Purging
@@ -256,6 +305,7 @@ private:
 
     // Friends
     friend int LocalRepo_PeerHelper(LocalRepo *l, const std::string &path);
+    friend class Scrubber;
 };
 
 #endif
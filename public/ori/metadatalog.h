@@ -19,6 +19,9 @@
 
 #include <oriutil/objecthash.h>
 
+#include "durability.h"
+#include "sortedtable.h"
+
 typedef int32_t refcount_t;
 typedef std::unordered_map<ObjectHash, refcount_t> RefcountMap;
 typedef std::unordered_map<std::string, std::string> ObjMetadata;
@@ -43,6 +46,21 @@ private:
     MetadataMap metadata;
 };
 
+/*
+ * Reference counts and object metadata.
+ *
+ * Reference counts are checkpointed into a sorted table (metadata.tbl) that
+ * is memory mapped and searched in place.  Changes since the checkpoint are
+ * appended to the log (metadata) and replayed into memory on open, so the
+ * cost of opening the repository depends on the length of the tail rather
+ * than on the history.  Object metadata is small and is kept entirely in the
+ * log.
+ *
+ * Each checkpoint has a generation, stored in both the table and the log as
+ * the count of the empty hash.  The table is replaced before the log, counts
+ * in a log of an older generation than the table are already part of it (or
+ * were replaced when the counts were rebuilt) and are not replayed.
+ */
 class MetadataLog
 {
 public:
@@ -51,7 +69,8 @@ public:
 
     void open(const std::string &filename);
     void sync();
-    /// rewrites the log file, optionally with new counts
+    void setDurability(DurabilityPolicy::sp policy);
+    /// checkpoints the log, optionally replacing all counts
     void rewrite(const RefcountMap *refs = NULL, const MetadataMap *data = NULL);
 
     void addRef(const ObjectHash &hash, MdTransaction::sp trs =
@@ -69,8 +88,21 @@ private:
     friend class MdTransaction;
     int fd;
     std::string filename;
+    DurabilityPolicy::sp durability;
+    SortedTable snapshot;
+    /// Generation of the checkpoint
+    refcount_t generation;
     RefcountMap refcounts;
     MetadataMap metadata;
+    /// Refcount records in the log since the last checkpoint
+    size_t tailEntries;
+
+    void _writeSnapshot(const RefcountMap &refs, bool merge,
+                        refcount_t newGeneration);
+    static RefcountMap _generationMarker(refcount_t gen);
+    void _writeLog(int logFd, const std::string &buf);
+    static std::string _encodeTransaction(const RefcountMap &counts,
+                                          const MetadataMap &data);
 };
 
 #endif
@@ -37,6 +37,8 @@ public:
 
     virtual const ObjectInfo &getInfo() const { return info; }
     virtual bytestream *getPayloadStream() = 0;
+    /// Returns the payload from offset on
+    virtual bytestream *getPayloadStreamAt(size_t offset);
     
     virtual std::string getPayload();
     
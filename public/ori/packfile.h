@@ -18,19 +18,45 @@
 #define __PACKFILE_H__
 
 #include <set>
+#include <vector>
 #include <deque>
 #include <memory>
 #include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include <time.h>
+#include <sys/uio.h>
 
 #include <oriutil/objecthash.h>
 #include <oriutil/stream.h>
 #include <oriutil/lrucache.h>
+#include <oriutil/threadpool.h>
 #include "object.h"
+#include "durability.h"
 
 typedef uint32_t offset_t;
 typedef uint32_t packid_t;
 typedef uint32_t numobjs_t;
 
+// Object header in a packfile: info, stored length and offset
+#define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
+
+/*
+ * A packfile is a sequence of groups [numobjs][headers][payloads].  Once a
+ * packfile will not be appended to anymore it is sealed with a trailer:
+ *   headers of all objects sorted by hash ([info][stored size][offset])
+ *   footer: object count, end of the groups, CRC32C, magic "ORIT"
+ * The trailer lists a packfile's objects without walking its groups.
+ */
+#define PACKFILE_FOOTER_SIZE 16
+
+/// Packfile id of index entries that mark removed objects
+#define INDEX_TOMBSTONE ((packid_t)0xFFFFFFFF)
+/// Tiny objects stored in the index itself, packed_size is the payload size
+#define INDEX_INLINE ((packid_t)0xFFFFFFFE)
+
 struct IndexEntry
 {
     ObjectInfo info;
@@ -42,32 +68,76 @@ struct IndexEntry
         sizeof(uint32_t) + sizeof(packid_t);
 };
 
+/*
+ * Borrowed view of a payload that is already in memory.  The owner keeps the
+ * memory valid even if the packfile is remapped, purged or closed.
+ */
+struct PayloadSpan
+{
+    const uint8_t *data;
+    size_t len;
+    std::shared_ptr<const void> owner;
+};
+
 class Packfile;
+class PackfileMap;
+class PackfileManager;
+struct PackReads;
 class Index;
 class PfTransaction
 {
 public:
     typedef std::shared_ptr<PfTransaction> sp;
 
-    PfTransaction(Packfile *pf, Index *idx);
+    PfTransaction(Packfile *pf, Index *idx, ThreadPool *pool = NULL);
     ~PfTransaction();
 
     bool full() const;
-    void addPayload(ObjectInfo info, const std::string &payload);
+    /// Compresses the payload with algo, on the pool if one was given
+    void addPayload(ObjectInfo info, const std::string &payload,
+                    ObjectInfo::ZipAlgo algo =
+                        ObjectInfo::ZIPALGO_FASTLZ_FRAMED);
+    /// Stores delta (the base hash followed by the delta) in place of
+    /// payload, info must carry the delta depth
+    void addDelta(ObjectInfo info, const std::string &payload,
+                  const std::string &delta, ObjectInfo::ZipAlgo algo);
     bool has(const ObjectHash &hash) const;
+    /// Safe to use while compression is in flight
+    ObjectInfo getInfo(size_t ix) const;
+    bytestream *getPayloadStream(size_t ix) const;
+    /// Waits for outstanding compression jobs
+    void wait();
     void commit();
+    /// Sets the algorithm in info, true if out holds the compressed payload
+    static bool compress(ObjectInfo &info, const std::string &payload,
+                         ObjectInfo::ZipAlgo algo, std::string &out);
 
     std::vector<ObjectInfo> infos;
     std::vector<std::string> payloads;
     size_t totalSize;
     bool committed;
+    /// Set to store new copies of objects that are already indexed
+    bool replace;
 
     std::unordered_map<ObjectHash, size_t> hashToIx;
 
 private:
     Packfile *pf;
     Index *idx;
-    float _checkCompressionRatio(const std::string &payload);
+    ThreadPool *pool;
+    // Protects the public members while compression jobs are running
+    mutable std::mutex lock;
+    std::condition_variable doneCV;
+    size_t outstanding;
+    /// Uncompressed payloads of objects still being compressed
+    std::unordered_map<size_t, std::shared_ptr<std::string> > inflight;
+    /// Full payloads of objects stored as deltas
+    std::unordered_map<size_t, std::string> deltaPayloads;
+
+    friend class Packfile;
+
+    void _compressJob(size_t ix, ObjectInfo info, ObjectInfo::ZipAlgo algo,
+                      std::shared_ptr<std::string> raw);
 };
 
 class Packfile
@@ -75,59 +145,191 @@ class Packfile
 public:
     typedef std::shared_ptr<Packfile> sp;
 
-    Packfile(const std::string &filename, packid_t id);
+    Packfile(const std::string &filename, packid_t id,
+             DurabilityPolicy::sp durability = DurabilityPolicy::getDefault(),
+             PackfileManager *mgr = NULL);
     ~Packfile();
 
     packid_t getPackfileID() const;
+    size_t getFileSize() const;
 
     bool full() const;
-    PfTransaction::sp begin(Index *idx);
+    bool isSealed() const;
+    /// Appends the trailer, the packfile is read-only afterwards
+    void seal();
+    PfTransaction::sp begin(Index *idx, ThreadPool *pool = NULL);
     void commit(PfTransaction *t, Index *idx);
     //void addPayload(ObjectInfo info, const std::string &payload, Index *idx);
     bytestream *getPayload(const IndexEntry &entry);
-    /// @returns true when the packfile is empty
-    bool purge(const std::set<ObjectHash> &hset, Index *idx);
+    /// Returns the payload from offset on, framed payloads start decoding at
+    /// the frame containing offset
+    bytestream *getPayload(const IndexEntry &entry, size_t offset);
+    /// Maps the stored bytes of an uncompressed object without copying,
+    /// returns false for compressed objects
+    bool getSpan(const IndexEntry &entry, PayloadSpan &span);
+    /// Returns the payload as stored in the packfile
+    bytestream *getStoredPayload(const IndexEntry &entry);
+    /// Returns the object a delta object was encoded against
+    ObjectHash getDeltaBase(const IndexEntry &entry);
+    /// Copies stored objects from other packfiles of the manager without
+    /// recompressing them, moved receives their new entries.  The index is
+    /// not updated.
+    void appendFrom(const std::vector<IndexEntry> &objs,
+                    std::vector<IndexEntry> &moved);
+    /// Like appendFrom but stores the objects compressed with algo where
+    /// that is smaller than their current encoding
+    void recompressFrom(const std::vector<IndexEntry> &objs,
+                        ObjectInfo::ZipAlgo algo,
+                        std::vector<IndexEntry> &moved);
+    /// Forces the packfile to disk regardless of the durability policy
+    void sync();
 
-    typedef void (*ReadEntryCb)(const ObjectInfo &info, offset_t off,
-                                void *arg);
+    typedef void (*ReadEntryCb)(const IndexEntry &entry, void *arg);
+    /// Calls cb for every object in offset order, from the trailer if the
+    /// packfile is sealed
     void readEntries(ReadEntryCb cb, void *arg);
+    /// Returns false if the packfile is not sealed or the trailer is corrupt
+    bool readTrailer(std::vector<IndexEntry> &entries);
 
     void transmit(bytewstream *bs, std::vector<IndexEntry> objects);
+    /// Commits and trees go to the packfile returned by metaPf if given,
+    /// which is only called for batches that hold any
     /// @returns false if nothing to receive
-    bool receive(bytestream *bs, Index *idx);
+    bool receive(bytestream *bs, Index *idx,
+                 const std::function<Packfile *()> &metaPf = nullptr);
 
 private:
+    void _writeVec(std::vector<struct iovec> &iov);
+    void _dropWritten();
+    bool _isStreaming() const;
+    std::shared_ptr<PackfileMap> _getMap(size_t end);
+    bytestream *_getStored(offset_t off, size_t len);
+    std::string _getDecoded(const IndexEntry &entry);
+    void _readDelta(const IndexEntry &entry, ObjectHash &base,
+                    std::string &delta);
+    void _recordRead();
+    bytestream *_getDeltaPayload(const IndexEntry &entry);
+    void _readFooter();
+    size_t _scanGroups(std::vector<IndexEntry> &entries);
     int fd;
     std::string filename;
     packid_t packid;
     size_t numObjects;
     size_t fileSize;
+    /// Set once the trailer is written, the groups end at dataEnd
+    bool sealed;
+    size_t dataEnd;
+    /// Appended data from here on may still be in the page cache
+    size_t writtenFrom;
+    DurabilityPolicy::sp durability;
+    /// Resolves the bases of delta objects
+    PackfileManager *mgr;
+    /// Reads not yet folded into the access records of mgr
+    std::shared_ptr<PackReads> reads;
+    /// Read-only mapping of the file, replaced as the file grows
+    std::mutex mapLock;
+    std::shared_ptr<PackfileMap> mapping;
 };
 
 
 #define PFMGR_FREELIST ".freelist"
+#define PFMGR_ACCESS ".access"
+
+/*
+ * How recently a packfile was read, kept by the PackfileManager to find
+ * packfiles that are worth storing with a stronger codec.
+ */
+struct PackAccess
+{
+    time_t lastRead;
+    uint64_t reads;
+    /// Already rewritten for cold storage
+    bool recompressed;
+    /// Written by repack in traversal order
+    bool ordered;
+};
+
+/*
+ * Reads of a packfile since its access record was last updated, counted
+ * without locking and folded into the record in batches.
+ */
+struct PackReads
+{
+    PackReads() : count(0), last(0) { }
+    std::atomic<uint64_t> count;
+    std::atomic<time_t> last;
+};
 
 class PackfileManager
 {
 public:
     typedef std::shared_ptr<PackfileManager> sp;
 
-    PackfileManager(const std::string &rootPath);
+    PackfileManager(const std::string &rootPath,
+            DurabilityPolicy::sp durability = DurabilityPolicy::getDefault());
     ~PackfileManager();
 
     Packfile::sp getPackfile(packid_t id);
     Packfile::sp newPackfile();
     bool hasPackfile(packid_t id);
     std::vector<packid_t> getPackfileList();
+    /// Deletes the packfile and returns its id to the free list
+    void removePackfile(packid_t id);
+    /// Hard links a packfile of another repository under a new id
+    /// @returns false if the file cannot be linked, e.g. across filesystems
+    /// or because it was removed
+    bool linkPackfile(const std::string &path, packid_t &id);
+    /// True if other repositories link the same packfile
+    bool isShared(packid_t id);
+    /// Ids of the packfiles in another repository's object directory
+    static std::vector<packid_t> listPackfiles(const std::string &dir);
+    const std::string &getRootPath() const { return rootPath; }
+    /// Index used to find the bases of delta objects
+    void setIndex(Index *idx);
+    /// Reads are not recorded while disabled, for scans such as scrubbing
+    void setTrackReads(bool enable);
+    /// Appends and sealing drop the written pages from the page cache
+    void setStreaming(bool enable);
+    /// Packfiles that were never read report their modification time
+    PackAccess getAccess(packid_t id);
+    /// Gives dest the access of the sources it holds objects of, weighted by
+    /// the bytes moved from each.  dest only counts as recompressed if all
+    /// sources were and as ordered if its one source was.
+    void inheritAccess(packid_t dest,
+                       const std::unordered_map<packid_t, uint64_t> &srcBytes);
+    void setRecompressed(packid_t id);
+    void setOrdered(packid_t id);
+    /// Writes the access records if they changed, unless force is false and
+    /// they were written less than PFMGR_ACCESS_INTERVAL seconds ago
+    void saveAccess(bool force = true);
 
 private:
+    friend class Packfile;
+    std::string _getDeltaBase(const ObjectHash &base, uint32_t depth);
+
     std::string rootPath;
+    DurabilityPolicy::sp durability;
+    Index *idx;
 
     std::deque<packid_t> freeList;
     void _recomputeFreeList();
     bool _loadFreeList();
     void _writeFreeList();
 
+    /// Protects the access records and the read counters of open packfiles
+    std::mutex accessLock;
+    std::unordered_map<packid_t, PackAccess> access;
+    std::unordered_map<packid_t, std::shared_ptr<PackReads> > pendingReads;
+    bool accessDirty;
+    std::atomic<bool> trackReads;
+    bool streaming;
+    time_t accessSaved;
+    std::shared_ptr<PackReads> _getReads(packid_t id);
+    void _foldReads();
+    PackAccess _getAccess(packid_t id);
+    void _loadAccess();
+    void _saveAccess();
+
     LRUCache<uint32_t, Packfile::sp, 96> _packfileCache;
 
     std::string _getPackfileName(packid_t id);
@@ -22,9 +22,12 @@
 #include <string>
 #include <set>
 #include <deque>
+#include <vector>
+#include <utility>
 
 #include <oriutil/dag.h>
 #include <oriutil/objecthash.h>
+#include <oriutil/threadpool.h>
 #include "tree.h"
 #include "commit.h"
 #include "object.h"
@@ -46,6 +49,8 @@ public:
     virtual std::string getUUID() = 0;
     virtual ObjectHash getHead() = 0;
     virtual int distance() = 0;
+    /// Bulk file reads and writes bypass the page cache (streaming ingest)
+    virtual bool isStreaming() { return false; }
 
     // Objects
     virtual Object::sp getObject(
@@ -72,13 +77,29 @@ public:
 
     // Wrappers
     virtual ObjectHash addBlob(ObjectType type, const std::string &blob);
+    /// Adds a fragment of a large file (stored as a Blob)
+    virtual int addChunk(const ObjectHash &hash, const std::string &payload);
+    /// Adds a blob that is likely similar to base (e.g. the previous version
+    /// of the same file), repositories may store it as a delta
+    virtual int addDeltaObject(ObjectType type, const ObjectHash &hash,
+                               const std::string &payload,
+                               const ObjectHash &base);
     bytestream *getObjects(const std::deque<ObjectHash> &objs);
 
-    ObjectHash addSmallFile(const std::string &path);
+    /// prev is the previous version of the file if known
+    ObjectHash addSmallFile(const std::string &path,
+                            const ObjectHash &prev = ObjectHash());
     std::pair<ObjectHash, ObjectHash>
         addLargeFile(const std::string &path);
     std::pair<ObjectHash, ObjectHash>
-        addFile(const std::string &path);
+        addFile(const std::string &path,
+                const ObjectHash &prev = ObjectHash());
+    /// Adds the files in order, prevs is empty or holds the previous
+    /// version of each file
+    std::vector<std::pair<ObjectHash, ObjectHash> >
+        addFiles(const std::vector<std::string> &paths,
+                 const std::vector<ObjectHash> &prevs =
+                     std::vector<ObjectHash>());
 
     virtual Tree getTree(const ObjectHash &treeId);
     virtual Commit getCommit(const ObjectHash &commitId);
@@ -102,6 +123,9 @@ public:
             Object *other
             );
     virtual DAG<ObjectHash, Commit> getCommitDag();
+private:
+    // Reads and hashes files for addFiles
+    ThreadPool::sp filePool;
 };
 
 #endif /* __REPO_H__ */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __SCRUBBER_H__
+#define __SCRUBBER_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <set>
+#include <vector>
+
+#include "packfile.h"
+
+class LocalRepo;
+
+/*
+ * Background integrity scrubber.  Walks the packfiles in id order and
+ * checks the trailer of every sealed packfile and the hash of every live
+ * object in it.
+ *
+ * The work is done in slices by step(), which the embedding server calls
+ * from its own timer while it holds whatever protects the repository, so the
+ * scrubber does no locking of its own.  A slice stops after its time
+ * or once it has read its share of the byte budget, and
+ * step() returns how long to wait before the next slice so that reads stay
+ * under the byte budget and the slices under the CPU budget.
+ *
+ * The cursor is saved in the repository (ORI_PATH_SCRUB) so a pass resumes
+ * after a restart.  Corrupt objects are appended to ORI_PATH_SCRUBBAD so
+ * that they can be fetched again from a peer.
+ */
+class Scrubber
+{
+public:
+    Scrubber(LocalRepo *repo);
+    ~Scrubber();
+    /// Continues the pass on a newly opened instance of the same repository
+    void setRepo(LocalRepo *repo);
+    /// bytesPerSec of packfile reads and the percentage of time spent
+    /// scrubbing
+    void setBudget(uint64_t bytesPerSec, int cpuPercent);
+    /// Scrubs one slice of at most sliceMS, 0 uses SCRUB_SLICE_MS
+    /// @returns the milliseconds to wait before the next step
+    uint32_t step(uint32_t sliceMS = 0);
+    /// Objects found corrupt so far, including earlier runs
+    std::vector<ObjectHash> getCorrupt() const;
+    /// Number of completed passes over the repository
+    uint64_t getPasses() const { return passes; }
+private:
+    bool _nextPackfile();
+    bool _verify(const IndexEntry &entry);
+    void _recordCorrupt(const ObjectHash &hash, const std::string &why);
+    void _loadCursor();
+    void _saveCursor();
+
+    LocalRepo *repo;
+    uint64_t bytesPerSec;
+    int cpuPercent;
+
+    // Cursor
+    packid_t packid;
+    offset_t offset;
+    /// When the current pass started or the next one may start
+    time_t passStart;
+    uint64_t passes;
+
+    /// Live entries of the current packfile in offset order
+    Packfile::sp pf;
+    std::vector<IndexEntry> entries;
+    size_t next;
+
+    std::set<ObjectHash> corrupt;
+    std::string cursorPath;
+    std::string badPath;
+};
+
+#endif /* __SCRUBBER_H__ */
+
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __SORTEDTABLE_H__
+#define __SORTEDTABLE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/objecthash.h>
+
+/*
+ * On-disk table of fixed size records sorted by an embedded ObjectHash.
+ *
+ * Layout (all integers big-endian):
+ *   magic "ORIS", version, record size, key offset, record count (uint64)
+ *   fanout[256]: number of records whose key starts with a byte <= i
+ *   records, sorted by key
+ *
+ * The table is mapped read-only and searched in place so that lookups do not
+ * require loading the table into the heap.
+ */
+class SortedTable
+{
+public:
+    SortedTable();
+    ~SortedTable();
+    /// Returns false if the file does not exist, throws if it is corrupt
+    bool open(const std::string &path);
+    void close();
+    bool isOpen() const { return map != NULL; }
+    uint64_t size() const { return count; }
+    size_t recordSize() const { return recSize; }
+    /// Returns a pointer to record i (valid until close)
+    const uint8_t *record(uint64_t i) const;
+    ObjectHash key(uint64_t i) const;
+    /// Returns the record matching key or NULL
+    const uint8_t *lookup(const ObjectHash &key) const;
+    static const size_t HEADER_SIZE = 24 + 256 * 4;
+private:
+    uint8_t *map;
+    size_t mapSize;
+    uint32_t recSize;
+    uint32_t keyOffset;
+    uint64_t count;
+    std::vector<uint64_t> fanout;
+};
+
+/*
+ * Writes a SortedTable to a temporary file and atomically replaces the
+ * target on commit.  Records must be appended in strictly increasing key
+ * order.
+ */
+class SortedTableWriter
+{
+public:
+    SortedTableWriter(const std::string &path, size_t recSize,
+                      size_t keyOffset);
+    ~SortedTableWriter();
+    void append(const std::string &rec);
+    void append(const uint8_t *rec);
+    void commit();
+    uint64_t size() const { return count; }
+private:
+    void flush();
+    int fd;
+    std::string path;
+    std::string tmpPath;
+    size_t recSize;
+    size_t keyOffset;
+    uint64_t count;
+    std::vector<uint64_t> fanout;
+    std::string buf;
+    ObjectHash lastKey;
+};
+
+#endif /* __SORTEDTABLE_H__ */
+
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __OBJECTCACHE_H__
+#define __OBJECTCACHE_H__
+
+#include <stdint.h>
+
+#include <list>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "objecthash.h"
+
+class ObjectCacheShard;
+
+/*
+ * Cache of decompressed object payloads bounded by the total number of
+ * payload bytes.  Keys are spread over independently locked shards, each
+ * evicting in LRU order once it exceeds its share of the budget.
+ *
+ * Objects are immutable so entries never go stale, invalidate is only used
+ * to drop objects that are being purged.
+ */
+class ObjectCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Payload;
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t entries;
+        uint64_t bytes;
+    };
+
+    ObjectCache(size_t budget = 0);
+    ~ObjectCache();
+    /// Budget in bytes, 0 disables the cache
+    void setBudget(size_t budget);
+    size_t getBudget() const;
+    /// Largest payload that will be cached
+    size_t maxObjectSize() const;
+
+    bool get(const ObjectHash &hash, Payload &payload);
+    void put(const ObjectHash &hash, const Payload &payload);
+    void invalidate(const ObjectHash &hash);
+    void clear();
+    Stats getStats() const;
+private:
+    std::vector<ObjectCacheShard *> shards;
+    size_t budget;
+    ObjectCacheShard *getShard(const ObjectHash &hash) const;
+};
+
+#endif /* __OBJECTCACHE_H__ */
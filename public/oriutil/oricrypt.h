@@ -22,7 +22,9 @@
 std::string OriCrypt_MD5String(const std::string &str);
 ObjectHash OriCrypt_HashString(const std::string &str);
 ObjectHash OriCrypt_HashBlob(const uint8_t *data, size_t len);
-ObjectHash OriCrypt_HashFile(const std::string &path);
+/// streaming reads the file without keeping it in the page cache
+ObjectHash OriCrypt_HashFile(const std::string &path, bool streaming = false);
+uint32_t OriCrypt_CRC32C(const uint8_t *data, size_t len, uint32_t crc = 0);
 std::string
 OriCrypt_Encrypt(const std::string &plaintext, const std::string &key);
 std::string
@@ -18,6 +18,7 @@
 #define __ORI_ORIFILE_H__
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <string>
 
@@ -37,6 +38,20 @@ int OriFile_Move(const std::string &origPath, const std::string &newPath);
 int OriFile_Delete(const std::string &path);
 int OriFile_Rename(const std::string &from, const std::string &to);
 
+/*
+ * Streaming I/O keeps bulk reads and writes of file contents from evicting
+ * other data from the page cache.  The helpers below act on the given file
+ * only, whether to use them is up to the caller, e.g. the ingest mode of a
+ * repository (Repo::isStreaming).
+ */
+/// Declares that fd will be read once from start to end
+void OriFile_AdviseSequential(int fd);
+/// Starts writing back a written range of fd without waiting for it
+void OriFile_StartWriteback(int fd, off_t off, off_t len);
+/// Drops a range of fd from the page cache, written pages are written back
+/// first so that they can be dropped
+void OriFile_DropCache(int fd, off_t off, off_t len, bool written = false);
+
 std::string OriFile_Basename(const std::string &path);
 std::string OriFile_Dirname(const std::string &path);
 
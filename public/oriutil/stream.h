@@ -56,7 +56,7 @@ class bytestream : public basestream
 public:
     typedef std::auto_ptr<bytestream> ap;
 
-    bytestream() : typedStream(false) {}
+    bytestream() : typedStream(false), skipped(0) {}
     virtual ~bytestream() {};
 
     virtual bool ended() = 0;
@@ -71,6 +71,8 @@ public:
     bool isTyped();
 
     bool readExact(uint8_t *buf, size_t n);
+    /// Discards n bytes, returns false if the stream ended first
+    bool skip(size_t n);
 
     // Stream utils
     std::string readAll();
@@ -97,6 +99,8 @@ public:
     uint64_t readUInt64();
 protected:
     bool typedStream;
+    /// Bytes discarded by skip, not included in what readAll returns
+    size_t skipped;
 };
 
 class strstream : public bytestream
@@ -112,6 +116,25 @@ private:
     size_t len;
 };
 
+/*
+ * Reads from memory owned by someone else, owner (if given) is held to keep
+ * the memory alive for the life of the stream.
+ */
+class memstream : public bytestream
+{
+public:
+    memstream(const uint8_t *buf, size_t len,
+              std::shared_ptr<const void> owner = std::shared_ptr<const void>());
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+private:
+    const uint8_t *buf;
+    size_t off;
+    size_t len;
+    std::shared_ptr<const void> owner;
+};
+
 class fdstream : public bytestream
 {
 public:
@@ -144,59 +167,72 @@ private:
 #define COMPRESS true
 #define DECOMPRESS false
 
-#ifdef ORI_USE_LZMA
-
+/*
+ * Compresses or decompresses a stream with any of the codecs identified by
+ * ObjectInfo::ZipAlgo.  FastLZ and Snappy are block codecs that process the
+ * whole input at once, LZMA streams and is only available when built with
+ * ORI_USE_LZMA.  ZIPALGO_NONE passes the data through unchanged.
+ *
+ * ZIPALGO_FASTLZ_FRAMED compresses fixed size frames independently so that
+ * memory use is bounded and a reader can start at any frame:
+ *   frames: uint32 header (bit 31 set if stored raw, low bits length), data
+ *   terminator: uint32 0
+ *   trailer: uint32 stored length of each frame (header included),
+ *            uint32 frame size, uint32 frame count
+ * The decompressor stops at the terminator so it may start at any frame
+ * boundary found through the trailer (see findFrame).
+ */
 class zipstream : public bytestream
 {
 public:
     /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
+    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0,
+              ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_FASTLZ);
     ~zipstream();
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
     size_t inputConsumed() const;
+    /// Returns true if the codec was compiled in
+    static bool isSupported(ObjectInfo::ZipAlgo algo);
+    /// Parses the trailer of a framed stream (the last trailerSize bytes
+    /// passed in tail) and finds the frame containing offset
+    static bool findFrame(const std::string &tail, size_t offset,
+                          size_t &storedOff, size_t &frameOff);
+    static size_t trailerSize(const std::string &last8);
+    /// Uncompressed bytes in each frame written by ZIPALGO_FASTLZ_FRAMED
+    static size_t frameSize();
 
 private:
     bytestream *source;
     size_t size_hint;
-
+    ObjectInfo::ZipAlgo algo;
+    bool compress;
     bool output_ended;
-    lzma_stream strm;
-    uint8_t in_buf[COMPFILE_BUFSZ];
-
-    void setLzmaErr(const char *msg, lzma_ret ret);
-};
-
-#endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
-
-class zipstream : public bytestream
-{
-public:
-    /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
-    ~zipstream();
-    bool ended();
-    size_t read(uint8_t *, size_t);
-    size_t sizeHint() const;
-    size_t inputConsumed() const;
-
-private:
-    bytestream *source;
-    size_t size_hint;
-
-    bool compress;
+    // Block codecs
     bool input_processed;
-    std::string input; // TODO
+    std::string input;
     std::vector<uint8_t> output;
-
     size_t offset;
-    bool output_ended;
-};
+    size_t readBlock(uint8_t *, size_t);
 
-#endif /* ORI_USE_FASTLZ */
+    // Framed FastLZ
+    std::vector<uint8_t> frame;
+    std::vector<uint32_t> frame_table;
+    size_t consumed;
+    size_t frame_input;
+    size_t readFramed(uint8_t *, size_t);
+    bool compressFrame();
+    bool decompressFrame();
+
+#ifdef ORI_USE_LZMA
+    lzma_stream strm;
+    std::vector<uint8_t> in_buf;
+    size_t readLzma(uint8_t *, size_t);
+    void setLzmaErr(const char *msg, lzma_ret ret);
+#endif /* ORI_USE_LZMA */
+};
 
 ////////////////////////////////
 // Writable streams
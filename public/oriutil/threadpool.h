@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPoolWorker;
+
+/*
+ * Fixed set of worker threads consuming a bounded queue of jobs.  enqueue
+ * blocks while the queue is full, which bounds the memory held by pending
+ * jobs.  Jobs must not enqueue into the pool they run on.  The first
+ * exception thrown by a job is rethrown by waitIdle.
+ */
+class ThreadPool
+{
+public:
+    typedef std::shared_ptr<ThreadPool> sp;
+    typedef std::function<void()> Job;
+
+    /// threads = 0 uses one thread per online processor
+    ThreadPool(int threads = 0, size_t maxQueued = 0);
+    ~ThreadPool();
+    void enqueue(const Job &job);
+    /// Wait until the queue is empty and no job is running, rethrows the
+    /// first exception thrown by a job since the last call
+    void waitIdle();
+    int getThreads() const;
+private:
+    friend class ThreadPoolWorker;
+    void workerLoop();
+
+    std::mutex lock;
+    std::condition_variable jobCV;
+    std::condition_variable spaceCV;
+    std::condition_variable idleCV;
+    std::deque<Job> jobs;
+    std::vector<ThreadPoolWorker *> workers;
+    size_t maxQueued;
+    int running;
+    bool stopping;
+    std::exception_ptr error;
+};
+
+#endif /* __THREADPOOL_H__ */
+